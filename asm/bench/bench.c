@@ -0,0 +1,293 @@
+#include "obj.h"
+#include "libasm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* an instruction of the mix, `%s` is replaced by a label. */
+typedef struct
+{
+	const char *name;
+	const char *fmt;
+	char branch;
+	size_t weight;
+} template_t;
+
+static template_t templates[] =
+{
+	{ "mov", "mov rax, rbx", 0, 0 },
+	{ "movi", "mov rcx, 5", 0, 0 },
+	{ "load", "mov rax, [rbx+8]", 0, 0 },
+	{ "store", "mov [rbx+8], rax", 0, 0 },
+	{ "add", "add rax, rcx", 0, 0 },
+	{ "sub", "sub rdx, 3", 0, 0 },
+	{ "xor", "xor eax, eax", 0, 0 },
+	{ "cmp", "cmp rax, 16", 0, 0 },
+	{ "imul", "imul rax, rcx", 0, 0 },
+	{ "inc", "inc rax", 0, 0 },
+	{ "push", "push rbx", 0, 0 },
+	{ "pop", "pop rbx", 0, 0 },
+	{ "lea", "lea rsi, [%s]", 2, 0 },
+	{ "jmp", "jmp %s", 1, 0 },
+	{ "je", "je %s", 1, 0 },
+	{ "jne", "jne %s", 1, 0 },
+	{ "call", "call %s", 1, 0 }
+};
+
+#define TEMPLATE_COUNT (sizeof(templates) / sizeof(template_t))
+
+typedef struct
+{
+	size_t lines;
+	size_t labels;
+	size_t forward;
+	size_t db;
+	size_t sections;
+	size_t warmup;
+	size_t reps;
+	unsigned seed;
+	const char *mix;
+	const char *emit;
+} bench_t;
+
+typedef struct
+{
+	char *data;
+	size_t size;
+	size_t cap;
+} buffer_t;
+
+static void append(buffer_t *buf, const char *str)
+{
+	size_t len = strlen(str);
+	while (buf->size + len + 1 > buf->cap)
+		buf->data = realloc(buf->data, buf->cap = buf->cap ? 2 * buf->cap : 0x10000);
+	memcpy(buf->data + buf->size, str, len + 1);
+	buf->size += len;
+}
+
+static size_t percent(size_t p)
+{
+	return (size_t) (rand() % 100) < p;
+}
+
+static void parse_mix(const char *mix)
+{
+	char *dup = strdup(mix), *it = strtok(dup, ",");
+
+	for (; it; it = strtok(0, ","))
+	{
+		char *sep = strchr(it, ':');
+		size_t weight = sep ? strtoul(sep + 1, 0, 10) : 1, i = 0;
+		if (sep)
+			*sep = '\0';
+
+		for (; i < TEMPLATE_COUNT && strcmp(templates[i].name, it) != 0; i++);
+		if (i == TEMPLATE_COUNT)
+		{
+			printf("Unknown instruction `%s` in mix.\n", it);
+			exit(1);
+		}
+
+		templates[i].weight = weight;
+	}
+
+	free(dup);
+}
+
+static template_t* pick(size_t total)
+{
+	size_t r = rand() % total;
+	for (size_t i = 0; i < TEMPLATE_COUNT; i++)
+		if (r < templates[i].weight)
+			return &templates[i];
+		else
+			r -= templates[i].weight;
+	return &templates[0];
+}
+
+static char* bench_generate(bench_t *b, size_t *size)
+{
+	buffer_t buf = { 0 };
+	char line[64], name[32];
+	size_t total = 0, label = 0, label_count = 0;
+
+	parse_mix(b->mix);
+	for (size_t i = 0; i < TEMPLATE_COUNT; i++)
+		total += templates[i].weight;
+	if (total == 0)
+	{
+		printf("Empty instruction mix.\n");
+		exit(1);
+	}
+
+	/* decide where labels go first, so forward references have a target. */
+	srand(b->seed);
+	char *has_label = calloc(b->lines, 1);
+	for (size_t i = 0; i < b->lines; i++)
+		label_count += has_label[i] = i == 0 || percent(b->labels);
+
+	append(&buf, "section .text\n");
+	for (size_t i = 0; i < b->lines; i++)
+	{
+		/* section switches are spread evenly over the program. */
+		if (b->sections && i > 0 && i % (b->lines / (b->sections + 1) + 1) == 0)
+		{
+			sprintf(line, "section .text.%zu\n", i);
+			append(&buf, line);
+		}
+
+		if (has_label[i])
+		{
+			sprintf(line, label == 0 ? "bench_l%zu::\n" : "bench_l%zu:\n", label);
+			append(&buf, line);
+			label++;
+		}
+
+		if (percent(b->db))
+		{
+			append(&buf, "db \"benchmrk\"\n");
+			continue;
+		}
+
+		/* lea only takes labels already seen, the other references may look ahead. */
+		template_t *t = pick(total);
+		size_t target = label - 1;
+		if (t->branch == 1 && label < label_count && percent(b->forward))
+			target = label + rand() % (label_count - label);
+		else if (t->branch)
+			target = rand() % label;
+
+		sprintf(name, "bench_l%zu", target);
+		sprintf(line, t->fmt, name);
+		append(&buf, line);
+		append(&buf, "\n");
+	}
+
+	free(has_label);
+	*size = buf.size;
+	return buf.data;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static size_t option(const char *arg, const char *name, size_t *val)
+{
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return 0;
+	*val = strtoul(arg + len + 1, 0, 10);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	bench_t b = { 20000, 10, 50, 5, 0, 2, 10, 1,
+		"mov:4,movi:2,load:2,store:2,add:2,sub:1,xor:1,cmp:2,imul:1,inc:1,"
+		"push:1,pop:1,lea:1,jmp:1,je:1,jne:1,call:1", 0 };
+	size_t seed = b.seed;
+
+	for (; argc > 1; argc--, argv++)
+		if (!option(argv[1], "-n", &b.lines) && !option(argv[1], "-labels", &b.labels)
+			&& !option(argv[1], "-forward", &b.forward) && !option(argv[1], "-db", &b.db)
+			&& !option(argv[1], "-sections", &b.sections)
+			&& !option(argv[1], "-warmup", &b.warmup)
+			&& !option(argv[1], "-reps", &b.reps) && !option(argv[1], "-seed", &seed))
+		{
+			if (strncmp(argv[1], "-mix=", 5) == 0)
+				b.mix = argv[1] + 5;
+			else if (strncmp(argv[1], "-emit=", 6) == 0)
+				b.emit = argv[1] + 6;
+			else
+			{
+				printf("Unknown option `%s` to bench program.\n", argv[1]);
+				exit(1);
+			}
+		}
+
+	if (b.lines == 0 || b.reps == 0)
+	{
+		printf("Invalid arguments to bench program.\n");
+		exit(1);
+	}
+
+	size_t size;
+	b.seed = seed;
+	char *src = bench_generate(&b, &size);
+
+	/* the generated source can be fed to the assembler directly. */
+	if (b.emit)
+	{
+		FILE *fp = fopen(b.emit, "wb");
+		if (!fp)
+		{
+			printf("Failed to open output file `%s`.\n", b.emit);
+			exit(1);
+		}
+
+		fwrite(src, size, 1, fp);
+		fclose(fp);
+		return 0;
+	}
+
+	double *pass = calloc(b.reps, sizeof(double)), *obj = calloc(b.reps, sizeof(double)),
+		*total = calloc(b.reps, sizeof(double));
+	size_t out_size = 0;
+
+	for (size_t i = 0; i < b.warmup + b.reps; i++)
+	{
+		char *out;
+		double start = now();
+		asm_t *as = asm_init(lexer_init_buffer(src, size));
+		asm_full_pass(as);
+		double mid = now();
+		out_size = asm_to_elf_obj(as, &out);
+		double end = now();
+
+		free(out);
+		libasm_free(as);
+
+		if (i >= b.warmup)
+		{
+			pass[i - b.warmup] = mid - start;
+			obj[i - b.warmup] = end - mid;
+			total[i - b.warmup] = end - start;
+		}
+	}
+
+	qsort(pass, b.reps, sizeof(double), compare);
+	qsort(obj, b.reps, sizeof(double), compare);
+	qsort(total, b.reps, sizeof(double), compare);
+
+	/* one json object per run, medians are robust against the odd slow repetition. */
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	double median = total[b.reps / 2];
+	printf("{\"lines\": %zu, \"labels\": %zu, \"forward\": %zu, \"db\": %zu, "
+		"\"sections\": %zu, \"seed\": %u, \"warmup\": %zu, \"reps\": %zu, "
+		"\"source_bytes\": %zu, \"output_bytes\": %zu, "
+		"\"pass_s\": %.6f, \"obj_s\": %.6f, \"total_s\": %.6f, \"min_s\": %.6f, "
+		"\"lines_per_s\": %.0f, \"output_bytes_per_s\": %.0f, \"peak_rss_kb\": %ld}\n",
+		b.lines, b.labels, b.forward, b.db, b.sections, b.seed, b.warmup, b.reps,
+		size, out_size, pass[b.reps / 2], obj[b.reps / 2], median, total[0],
+		b.lines / median, out_size / median, ru.ru_maxrss);
+
+	free(pass);
+	free(obj);
+	free(total);
+	free(src);
+	return 0;
+}
@@ -0,0 +1,41 @@
+
+section .data
+
+counter: db _"\0\0\0\0\0\0\0\0"
+spin: db _"\0\0\0\0\0\0\0\0"
+
+section .text
+
+_start::
+
+lea rbx, [counter]
+lea rcx, [spin]
+
+# acquire the spinlock.
+acquire:
+mov rax, 1
+xchg [rcx], rax
+test rax, 1
+je locked
+pause
+jmp acquire
+
+locked:
+lock inc [rbx]
+lock add [rbx], 2
+mov rax, 1
+lock xadd [rbx], rax
+mov rdx, 5
+lock cmpxchg [rbx], rdx
+lock dec [rbx]
+mfence
+
+# release the spinlock.
+xor rax, rax
+xchg [rcx], rax
+sfence
+lfence
+
+mov rdi, [rbx]
+mov rax, 60
+syscall
@@ -0,0 +1,30 @@
+
+section .rodata
+
+msg: db "Scratch buffer ready.\n"
+
+section .bss
+
+scratch: resb 0x4000000
+counters: resq 16
+
+section .text
+
+_start::
+
+# touch both ends of the scratch buffer.
+lea rbx, [scratch]
+mov rax, 1
+mov [rbx], rax
+lea rbx, [counters]
+lock inc [rbx]
+
+mov rax, 1
+mov rdi, 1
+lea rsi, [msg]
+mov rdx, 22
+syscall
+
+mov rdi, [rbx]
+mov rax, 60
+syscall
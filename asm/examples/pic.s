@@ -0,0 +1,49 @@
+
+section .rodata
+
+fmt: db "%s, counter at %d\n"
+name: db "pic"
+
+section .text
+
+extern printf
+extern stdout
+extern fflush
+extern optional_hook
+
+weak optional_hook
+hidden helper
+
+helper::
+mov rax, [rdi]
+inc rax
+mov [rdi], rax
+ret
+
+main::
+
+push rbp
+mov rbp, rsp
+
+# call an optional hook only if something defines it.
+mov rax, [optional_hook@gotpcrel]
+test rax, 0xFFFFFFFF
+je no_hook
+call optional_hook
+
+no_hook:
+lea rdi, [fmt]
+lea rsi, [name]
+mov rdx, 41
+xor rax, rax
+call printf
+
+# flush through the GOT without going through the PLT.
+mov rdi, [stdout@gotpcrel]
+mov rdi, [rdi]
+call [fflush@gotpcrel]
+
+xor rax, rax
+mov rsp, rbp
+pop rbp
+ret
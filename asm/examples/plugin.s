@@ -0,0 +1,44 @@
+
+# build with `asm -shared plugin.s plugin.so` and load it with dlopen.
+
+section .rodata
+
+greeting: db "plugin loaded, %d calls so far\n"
+
+section .data
+
+calls: db _"\0\0\0\0\0\0\0\0"
+
+section .text
+
+extern printf
+extern stdout
+extern fflush
+
+hidden bump
+
+bump::
+lea rax, [calls]
+lock inc [rax]
+mov rax, [rax]
+ret
+
+plugin_calls::
+call bump
+ret
+
+plugin_greet::
+push rbp
+mov rbp, rsp
+call bump
+lea rdi, [greeting]
+mov rsi, rax
+xor rax, rax
+call printf@plt
+mov rdi, [stdout@gotpcrel]
+mov rdi, [rdi]
+call fflush@plt
+call plugin_calls
+mov rsp, rbp
+pop rbp
+ret
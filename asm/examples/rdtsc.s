@@ -0,0 +1,38 @@
+
+section .data
+
+src: db _"\1\2\3\4\5\6\7\10\11\12\13\14\15\16\17\20"
+dst: db _"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+
+section .text
+
+_start::
+
+# serialize, then take the start timestamp.
+xor rax, rax
+cpuid
+lfence
+rdtsc
+mov rsi, rax
+
+# copy 16 bytes around the cache.
+lea rbx, [src]
+lea rcx, [dst]
+prefetcht0 [rbx]
+prefetchw [rcx]
+mov rax, [rbx]
+movnti [rcx], rax
+mov rax, [rbx+8]
+movnti [rcx+8], rax
+sfence
+clflush [rbx]
+clflushopt [rcx]
+
+# wait for the kernel to retire, then take the end timestamp.
+rdtscp
+lfence
+sub rax, rsi
+
+mov rdi, rax
+mov rax, 60
+syscall
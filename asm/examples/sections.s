@@ -0,0 +1,31 @@
+
+section .rodata
+
+msg: db "Hot path taken.\n"
+
+section .text.unlikely, ax
+
+unused::
+mov rax, 60
+mov rdi, 1
+syscall
+
+section .text
+
+_start::
+call hot
+mov rax, 60
+mov rdi, 0
+syscall
+
+hot::
+mov rax, 1
+mov rdi, 1
+lea rsi, [msg]
+mov rdx, 16
+syscall
+ret
+
+dead::
+call unused
+ret
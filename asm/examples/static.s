@@ -0,0 +1,26 @@
+
+# link with `asm -static static.s static_lib.s static`, exits with 42.
+
+section .data
+
+total: db _"\x28\0\0\0\0\0\0\0"
+
+section .text
+
+extern add_two
+extern optional_hook
+weak optional_hook
+
+main::
+
+# undefined weak symbols resolve to zero.
+mov rax, [optional_hook@gotpcrel]
+test rax, 0xFFFFFFFF
+je no_hook
+call optional_hook
+
+no_hook:
+lea rdi, [total]
+call add_two@plt
+mov rax, [total]
+ret
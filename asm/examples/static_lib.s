@@ -0,0 +1,8 @@
+
+section .text
+
+add_two::
+mov rax, [rdi]
+add rax, 2
+mov [rdi], rax
+ret
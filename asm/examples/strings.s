@@ -0,0 +1,32 @@
+
+section .rodata.str1.1
+
+hello: db "Hello World!\n"
+bye: db "Goodbye!\n"
+again: db "Hello World!\n"
+
+section .text
+
+_start::
+
+mov rax, 1
+mov rdi, 1
+lea rsi, [hello]
+mov rdx, 13
+syscall
+
+mov rax, 1
+mov rdi, 1
+lea rsi, [again]
+mov rdx, 13
+syscall
+
+mov rax, 1
+mov rdi, 1
+lea rsi, [bye+4]
+mov rdx, 5
+syscall
+
+mov rax, 60
+mov rdi, 0
+syscall
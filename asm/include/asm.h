@@ -4,6 +4,24 @@
 
 #include "lexer.h"
 #include "op.h"
+#include "cache.h"
+#include "cost.h"
+#include <stdio.h>
+
+#define SEC_ALLOC (1 << 0)
+#define SEC_WRITE (1 << 1)
+#define SEC_EXEC (1 << 2)
+#define SEC_NOBITS (1 << 3)
+#define SEC_MERGE (1 << 4)
+#define SEC_STRINGS (1 << 5)
+#define SEC_TLS (1 << 6)
+
+#define SYM_WEAK (1 << 0)
+#define SYM_HIDDEN (1 << 1)
+#define SYM_TLS (1 << 2)
+
+#define CFI_EXPLICIT 1
+#define CFI_INFERRED 2
 
 enum symbol_type
 {
@@ -15,7 +33,12 @@ enum symbol_type
 enum reloc_type
 {
 	ABSOLUTE,
-	RELATIVE
+	RELATIVE,
+	PLT_RELATIVE,
+	GOT_RELATIVE,
+	GOT_RELATIVE_REX,
+	TLS_OFFSET,
+	TLS_GOT_RELATIVE
 };
 
 typedef struct
@@ -23,6 +46,9 @@ typedef struct
 	char *name;
 	size_t addr;
 	size_t size;
+	size_t reserved;
+	size_t flags;
+	size_t entsize;
 } section_t;
 
 typedef struct
@@ -32,24 +58,75 @@ typedef struct
 	size_t section;
 	size_t addr;
 	size_t size;
+	size_t flags;
 } symbol_t;
 
 typedef struct
 {
 	enum reloc_type type;
 	size_t sym;
+	size_t section;
 	size_t addr;
 	size_t add;
+	char size;
+	char sign;
 } reloc_t;
 
 typedef struct
 {
 	enum reloc_type type;
 	char *name;
+	size_t section;
 	size_t addr;
 	size_t add;
+	char size;
+	char sign;
 } def_reloc_t;
 
+typedef struct
+{
+	char *name;
+	size_t flags;
+} def_attr_t;
+
+typedef struct
+{
+	size_t section;
+	size_t addr;
+	size_t loc;
+} dbg_line_t;
+
+/* a function of a reordered section, moved from `start` to `to`. */
+typedef struct
+{
+	size_t start;
+	size_t end;
+	size_t rank;
+	size_t to;
+} chunk_t;
+
+enum cfi_type
+{
+	CFI_STARTPROC,
+	CFI_ENDPROC,
+	CFI_DEF_CFA,
+	CFI_DEF_CFA_OFFSET,
+	CFI_DEF_CFA_REGISTER,
+	CFI_OFFSET,
+	CFI_REMEMBER_STATE,
+	CFI_RESTORE_STATE
+};
+
+/* call frame information, registers use the dwarf numbering. */
+typedef struct
+{
+	enum cfi_type type;
+	size_t section;
+	size_t addr;
+	size_t reg;
+	long val;
+} cfi_t;
+
 typedef struct
 {
 	char *op;
@@ -57,8 +134,13 @@ typedef struct
 	int disp;
 	char rel;
 	char def_rel;
+	char got;
 	char extended;
 	char legacy;
+	char segment;
+	char absolute;
+	char tls;
+	char byte;
 	char **sub;
 	size_t sub_count;
 } dec_t;
@@ -68,6 +150,7 @@ typedef struct
 	char *mnemonic;
 	dec_t *op;
 	size_t op_count;
+	char lock;
 } instr_t;
 
 typedef struct
@@ -75,6 +158,7 @@ typedef struct
 	lexer_t *lex;
 	instr_t cur;
 	char ext;
+	size_t attr;
 	char *token;
 
 	char *out;
@@ -91,31 +175,113 @@ typedef struct
 	def_reloc_t *def_rel;
 	size_t def_rel_count;
 
+	def_attr_t *def_attr;
+	size_t def_attr_count;
+
 	char *section;
 	size_t section_start;
+	size_t section_reserved;
+	size_t section_flags;
+	size_t section_entsize;
+	char *section_base;
+	char function_sections;
 	section_t *sec;
 	size_t sec_count;
+
+	/* the listing is only written if a stream is given. */
+	FILE *listing;
+
+	/* encodings of unchanged lines are taken from the cache, if given. */
+	cache_t *cache;
+	size_t line_start;
+	size_t line_instr;
+	size_t line_symbols;
+	char line_cacheable;
+	fixup_t *fix;
+	size_t fix_count;
+
+	/* source lines of the emitted code, for the debug information. */
+	char debug;
+	char *file;
+	dbg_line_t *dbg;
+	size_t dbg_count;
+
+	/* procedures are either given by directives, or inferred from their prologue. */
+	cfi_t *cfi;
+	size_t cfi_count;
+	char cfi_open;
+	char cfi_infer;
+	char cfi_state;
+	char cfi_candidate;
+	size_t cfi_label;
+
+	/* cost estimates of the listed instructions, for the given microarchitecture. */
+	const uarch_t *analyze;
+	cost_instr_t *cost;
+	size_t cost_count;
+	size_t last_cost_count;
+
+	/* kernels marked by bench_begin and bench_end, for the generated driver. */
+	char **bench;
+	size_t bench_count;
+	char bench_open;
+
+	/* functions of executable sections are laid out in this order, if given. */
+	char **order;
+	size_t order_count;
+	reloc_t *patch;
+	size_t patch_count;
+
+	/* names of sections and strings of operands, they live as long as the assembler. */
+	char **str;
+	size_t str_count;
 } asm_t;
 
 asm_t* asm_init(lexer_t *lex);
+char* asm_keep(asm_t *as, char *str);
 void asm_full_pass(asm_t *as);
 
+char* asm_next_token(asm_t *as);
 void asm_advance(asm_t *as, char *new);
 void asm_make_instr(asm_t *as);
+void asm_clear_instr(asm_t *as);
+void asm_fixup(asm_t *as, fixup_t *fix, symbol_t *sym);
+void asm_begin_line(asm_t *as);
+void asm_end_line(asm_t *as);
+size_t asm_replay(asm_t *as, size_t loc);
+void asm_map_line(asm_t *as, size_t loc);
 char asm_consume_label(asm_t *as);
 char asm_consume_extern(asm_t *as);
+char asm_consume_attribute(asm_t *as);
+char asm_consume_cfi(asm_t *as);
+char asm_consume_bench(asm_t *as);
+void asm_add_cfi(asm_t *as, enum cfi_type type, size_t addr, size_t reg, long val);
+void asm_infer_cfi(asm_t *as);
+void asm_analyze(asm_t *as, op_t *op);
+void asm_open_section(asm_t *as, char *name, size_t flags);
 void asm_close_section(asm_t *as);
+void asm_size_symbols(asm_t *as);
+void asm_order_section(asm_t *as);
+size_t asm_decode_section_flags(asm_t *as, const char *name, const char *flags);
+void asm_resolve_deferred(asm_t *as);
+void asm_resolve_attributes(asm_t *as);
+void asm_merge_strings(asm_t *as);
 
 op_t* asm_match_op(asm_t *as);
 size_t asm_resolve_op(asm_t *as, size_t i, size_t j);
 reg_t* asm_decode_reg(asm_t *as, size_t i, size_t j);
+reg_t* asm_find_reg(const char *name);
 long asm_decode_imm(asm_t *as, size_t i, size_t j);
 
 void asm_emit(asm_t *as, char byte);
+void asm_emit_data(asm_t *as, const char *data, size_t size);
 void asm_emit_imm(asm_t *as, size_t op, size_t val);
+void asm_reserve(asm_t *as, size_t size);
 
 void asm_emit_current_labels(asm_t *as, char *line);
 void asm_emit_current_hex(asm_t *as, char *line);
+void asm_emit_current_cost(asm_t *as, char *line);
+void asm_emit_current_loops(asm_t *as);
 
 symbol_t* asm_find_symbol(asm_t *as, const char *name);
 symbol_t* asm_iterate_symbols(asm_t *as, size_t ind);
@@ -0,0 +1,60 @@
+#ifndef ASM_CACHE_H
+#define ASM_CACHE_H
+
+#include "stats.h"
+#include "error.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+#define CACHE_MAGIC 0x434D5341
+#define CACHE_VERSION 2
+#define CACHE_BASIS 0xCBF29CE484222325
+
+/* a symbol reference within an encoded line, resolved whenever the line is emitted. */
+typedef struct
+{
+	char *name;
+	size_t type;
+	size_t op;
+	size_t offset;
+	size_t add;
+	size_t end;
+	char sign;
+	char branch;
+} fixup_t;
+
+typedef struct
+{
+	uint64_t hash;
+	char *str;
+	char *data;
+	size_t size;
+	fixup_t *fix;
+	size_t fix_count;
+	char used;
+} cache_line_t;
+
+/* encodings of source lines, keyed on the hash of their text and compared on it. */
+typedef struct
+{
+	cache_line_t *line;
+	size_t line_count;
+	size_t slot_count;
+} cache_t;
+
+cache_t* cache_init();
+cache_t* cache_load(const char *file);
+void cache_save(cache_t *cache, const char *file);
+void cache_free(cache_t *cache);
+
+uint64_t cache_hash(const char *str);
+uint64_t cache_hash_data(uint64_t h, const void *data, size_t size);
+cache_line_t* cache_find(cache_t *cache, uint64_t hash, const char *str);
+cache_line_t* cache_add(cache_t *cache, uint64_t hash, const char *str);
+
+/* finished objects, keyed on the normalized source, the assembler and its flags. */
+uint64_t cache_key(const char *src, size_t size, size_t flags);
+size_t cache_fetch(const char *dir, uint64_t key, const char *out);
+void cache_store(const char *dir, uint64_t key, const char *out);
+
+#endif /* ASM_CACHE_H */
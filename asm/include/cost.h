@@ -0,0 +1,60 @@
+#ifndef ASM_COST_H
+#define ASM_COST_H
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/* forms of an instruction: registers and immediates only, a memory source or destination. */
+#define COST_REG 0
+#define COST_LOAD 1
+#define COST_STORE 2
+
+/* dependencies are tracked on the 16 registers, the flags and memory operands. */
+#define COST_FLAGS 16
+#define COST_MEM 17
+#define COST_DEPS 12
+
+typedef struct
+{
+	const char *mnemonic;
+	char form;
+	size_t lat;
+	double rthru;
+	/* the ports each uop can issue to, separated by spaces. */
+	const char *uops;
+} cost_t;
+
+typedef struct
+{
+	const char *name;
+	size_t width;
+	size_t ports;
+	size_t atomic;
+	cost_t *cost;
+	size_t cost_count;
+} uarch_t;
+
+/* an analyzed instruction, `mem` is the text of its memory operand. */
+typedef struct
+{
+	const cost_t *cost;
+	size_t section;
+	size_t addr;
+	size_t lat;
+	double rthru;
+	char *mem;
+	char mem_read;
+	char mem_write;
+	size_t read[COST_DEPS];
+	size_t read_count;
+	size_t write[COST_DEPS];
+	size_t write_count;
+	char *loop;
+} cost_instr_t;
+
+const uarch_t* cost_find_uarch(const char *name);
+const cost_t* cost_lookup(const uarch_t *ua, const char *mnemonic, char form);
+void cost_format(const cost_instr_t *ci, char *buf);
+char* cost_loop(const uarch_t *ua, const cost_instr_t *body, size_t count, const char *name);
+
+#endif /* ASM_COST_H */
@@ -0,0 +1,100 @@
+#ifndef ASM_DWARF_H
+#define ASM_DWARF_H
+
+#include "asm.h"
+#include <elf.h>
+
+#define DWARF_VERSION 4
+#define DWARF_LINE_BASE -5
+#define DWARF_LINE_RANGE 14
+#define DWARF_OPCODE_BASE 13
+
+#define DW_TAG_compile_unit 0x11
+#define DW_CHILDREN_no 0x00
+#define DW_AT_name 0x03
+#define DW_AT_stmt_list 0x10
+#define DW_AT_low_pc 0x11
+#define DW_AT_language 0x13
+#define DW_AT_comp_dir 0x1B
+#define DW_AT_producer 0x25
+#define DW_AT_ranges 0x55
+#define DW_FORM_addr 0x01
+#define DW_FORM_data2 0x05
+#define DW_FORM_string 0x08
+#define DW_FORM_sec_offset 0x17
+#define DW_LANG_Mips_Assembler 0x8001
+
+#define DW_LNS_copy 0x01
+#define DW_LNS_advance_pc 0x02
+#define DW_LNS_advance_line 0x03
+#define DW_LNE_end_sequence 0x01
+#define DW_LNE_set_address 0x02
+
+#define DW_CFA_advance_loc 0x40
+#define DW_CFA_offset 0x80
+#define DW_CFA_nop 0x00
+#define DW_CFA_advance_loc1 0x02
+#define DW_CFA_advance_loc2 0x03
+#define DW_CFA_advance_loc4 0x04
+#define DW_CFA_remember_state 0x0A
+#define DW_CFA_restore_state 0x0B
+#define DW_CFA_def_cfa 0x0C
+#define DW_CFA_def_cfa_register 0x0D
+#define DW_CFA_def_cfa_offset 0x0E
+#define DW_EH_PE_pcrel_sdata4 0x1B
+
+/* dwarf numbers of rsp and the return address column on x86-64. */
+#define DWARF_RSP 7
+#define DWARF_RA 16
+
+enum dwarf_section
+{
+	DWARF_ABBREV,
+	DWARF_INFO,
+	DWARF_LINE,
+	DWARF_RANGES,
+	DWARF_FRAME,
+	DWARF_COUNT
+};
+
+/* a field holding the address of an elf section plus the addend. */
+typedef struct
+{
+	size_t offset;
+	size_t section;
+	size_t add;
+	char size;
+	char pcrel;
+} dwarf_rel_t;
+
+typedef struct
+{
+	const char *name;
+	size_t type;
+	size_t flags;
+	size_t align;
+	char present;
+	char *data;
+	size_t size;
+	dwarf_rel_t *rel;
+	size_t rel_count;
+} dwarf_section_t;
+
+typedef struct
+{
+	dwarf_section_t sec[DWARF_COUNT];
+	size_t index[DWARF_COUNT];
+} dwarf_t;
+
+/*
+ * sections are referred to by their elf index, `first` is that of the first
+ * assembled one. the caller assigns `index` to the present sections before building.
+ */
+dwarf_t* dwarf_init(asm_t *as);
+void dwarf_build(dwarf_t *dw, asm_t *as, const char *comp_dir, size_t first);
+void dwarf_build_info(dwarf_t *dw, asm_t *as, const char *comp_dir, size_t first);
+void dwarf_build_line(dwarf_t *dw, asm_t *as, size_t first);
+void dwarf_build_frame(dwarf_t *dw, asm_t *as, size_t first);
+void dwarf_free(dwarf_t *dw);
+
+#endif /* ASM_DWARF_H */
@@ -0,0 +1,24 @@
+#ifndef ASM_ERROR_H
+#define ASM_ERROR_H
+
+#include <setjmp.h>
+#include <stdlib.h>
+
+/*
+ * errors are printed to stdout and end the process. while a handler is
+ * installed, the message is written to its buffer instead and control
+ * returns to its jump buffer.
+ */
+typedef struct
+{
+	jmp_buf env;
+	char *msg;
+	size_t size;
+	size_t len;
+} error_handler_t;
+
+error_handler_t* error_catch(error_handler_t *handler);
+void error_print(const char *format, ...);
+void error_exit(void) __attribute__((noreturn));
+
+#endif /* ASM_ERROR_H */
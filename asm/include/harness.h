@@ -0,0 +1,15 @@
+#ifndef ASM_HARNESS_H
+#define ASM_HARNESS_H
+
+#include "asm.h"
+
+#define HARNESS_RUNS 1000
+#define HARNESS_PERF_OPEN 298
+
+/*
+ * source of a driver that times every kernel of the given units `runs` times,
+ * it defines `main` and prints min and median cycles per kernel.
+ */
+char* harness_generate(asm_t **units, size_t count, size_t runs, char perf, size_t *size);
+
+#endif /* ASM_HARNESS_H */
@@ -0,0 +1,53 @@
+#ifndef ASM_JIT_H
+#define ASM_JIT_H
+
+#include "linker.h"
+#include <stdint.h>
+
+#define JIT_MAGIC 0x4A695444
+#define JIT_VERSION 1
+#define JIT_CODE_LOAD 0
+
+/* layouts of the perf jitdump file, see tools/perf/Documentation/jitdump-specification.txt */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+} jit_header_t;
+
+typedef struct
+{
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+} jit_code_load_t;
+
+typedef struct
+{
+	linker_t *ln;
+	char *mem;
+	size_t size;
+} jit_t;
+
+jit_t* jit_init();
+void jit_add(jit_t *jit, asm_t *as);
+void jit_load(jit_t *jit);
+int jit_run(jit_t *jit, int argc, char **argv);
+
+size_t jit_symbol_size(jit_t *jit, size_t u, size_t sym);
+void jit_write_perf_map(jit_t *jit);
+void jit_write_dump(jit_t *jit);
+
+#endif /* ASM_JIT_H */
@@ -2,7 +2,13 @@
 #ifndef ASM_LEXER_H
 #define ASM_LEXER_H
 
+#include "stats.h"
+#include "error.h"
 #include <stdlib.h>
+#include <stdio.h>
+
+#define LEXER_CHUNK 0x10000
+#define LEXER_DEPTH 64
 
 typedef struct
 {
@@ -12,16 +18,78 @@ typedef struct
 	char *next;
 } loc_t;
 
+/* a line of a %rep or %macro body, recorded as tokens. */
+typedef struct
+{
+	char **tok;
+	size_t tok_count;
+	size_t loc;
+} lexer_line_t;
+
+typedef struct
+{
+	char *name;
+	size_t params;
+	lexer_line_t *line;
+	size_t line_count;
+} lexer_macro_t;
+
+/* an expansion in progress, lines `begin` up to `end` are replayed `count` times. */
+typedef struct
+{
+	lexer_line_t *line;
+	size_t begin;
+	size_t end;
+	size_t count;
+	size_t iter;
+	size_t cur;
+	size_t tok;
+	char *next;
+	char **arg;
+	size_t arg_count;
+	char rep;
+} lexer_frame_t;
+
 typedef struct
 {
 	loc_t *loc;
 	size_t loc_count;
 	loc_t *cur;
+	char first;
+
+	/* streams only keep the current line, which is loc `base`. */
+	FILE *fp;
+	size_t base;
+	char *chunk;
+	size_t chunk_count;
+	size_t chunk_off;
+	size_t chunk_size;
+
+	/*
+	 * %rep N and %macro NAME N are recorded up to %endrep or %endmacro and
+	 * expanded from their tokens. %i is the iteration of the innermost %rep,
+	 * %i*N scales it, %1 to %N are the arguments of the innermost macro.
+	 */
+	lexer_macro_t *macro;
+	size_t macro_count;
+	lexer_frame_t *frame;
+	size_t frame_count;
+	lexer_macro_t *block;
+	size_t block_count;
+	char **expanded;
+	size_t expanded_count;
 } lexer_t;
 
 lexer_t* lexer_init(const char *filename);
+lexer_t* lexer_init_stream(FILE *fp);
+lexer_t* lexer_init_buffer(const char *buf, size_t len);
+char* lexer_read_file(const char *file, size_t *size);
 lexer_t* lexer_duplicate(lexer_t *lex);
+void lexer_free(lexer_t *lex);
+char* lexer_read_line(lexer_t *lex);
+char lexer_next_line(lexer_t *lex);
 char* lexer_advance(lexer_t *lex);
+void lexer_seek(lexer_t *lex, size_t loc);
 char* lexer_peek(lexer_t *lex);
 size_t lexer_loc(lexer_t *lex);
 
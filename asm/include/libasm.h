@@ -0,0 +1,51 @@
+#ifndef ASM_LIBASM_H
+#define ASM_LIBASM_H
+
+#include "asm.h"
+#include <stdio.h>
+
+typedef struct
+{
+	const char *name;
+	const char *data;
+	size_t size;
+	size_t flags;
+	size_t entsize;
+} libasm_section_t;
+
+typedef struct
+{
+	const char *name;
+	enum symbol_type type;
+	size_t section;
+	size_t addr;
+	size_t size;
+	size_t flags;
+} libasm_symbol_t;
+
+typedef struct
+{
+	enum reloc_type type;
+	size_t symbol;
+	size_t section;
+	size_t addr;
+	long long addend;
+	size_t size;
+	char sign;
+} libasm_reloc_t;
+
+/* the listing is only written if a stream is given, errors return null with the message in the buffer. */
+asm_t* libasm_assemble(const char *buf, size_t len, FILE *listing, char *error, size_t error_size);
+asm_t* libasm_assemble_stream(FILE *fp, FILE *listing, char *error, size_t error_size);
+void libasm_free(asm_t *as);
+
+size_t libasm_section_count(asm_t *as);
+size_t libasm_symbol_count(asm_t *as);
+size_t libasm_reloc_count(asm_t *as);
+char libasm_section(asm_t *as, size_t i, libasm_section_t *sec);
+char libasm_symbol(asm_t *as, size_t i, libasm_symbol_t *sym);
+char libasm_reloc(asm_t *as, size_t i, libasm_reloc_t *rel);
+
+size_t libasm_write_elf(asm_t *as, char *buf, size_t size);
+
+#endif /* ASM_LIBASM_H */
@@ -0,0 +1,123 @@
+#ifndef ASM_LINKER_H
+#define ASM_LINKER_H
+
+#include "asm.h"
+#include <elf.h>
+
+#define LINK_BASE 0x400000
+#define LINK_PAGE 0x1000
+#define LINK_HUGE_PAGE 0x200000
+#define LINK_PLT_ENTRY 8
+#define LINK_GOT_PLT 3
+#define LINK_BLOOM_SHIFT 6
+
+enum segment_type
+{
+	TEXT,
+	RODATA,
+	DATA,
+	BSS
+};
+
+/* output sections in the order they are laid out. */
+enum output_type
+{
+	OUT_TEXT,
+	OUT_PLT,
+	OUT_RODATA,
+	OUT_GNU_HASH,
+	OUT_DYNSYM,
+	OUT_DYNSTR,
+	OUT_RELA_DYN,
+	OUT_RELA_PLT,
+	OUT_DATA,
+	OUT_DYNAMIC,
+	OUT_GOT,
+	OUT_GOT_PLT,
+	OUT_BSS,
+	OUT_COUNT
+};
+
+typedef struct
+{
+	asm_t *as;
+	size_t *addr;
+	size_t *off;
+	size_t *got;
+	size_t *plt;
+	size_t *dyn;
+} unit_t;
+
+typedef struct
+{
+	size_t off;
+	size_t addr;
+	size_t size;
+	size_t mem_size;
+} segment_t;
+
+typedef struct
+{
+	size_t index;
+	size_t off;
+	size_t addr;
+	size_t size;
+} output_t;
+
+typedef struct
+{
+	char *name;
+	size_t unit;
+	size_t sym;
+	unsigned int hash;
+	size_t bucket;
+} dynsym_t;
+
+typedef struct
+{
+	unit_t *unit;
+	size_t unit_count;
+
+	segment_t seg[BSS + 1];
+	output_t sec[OUT_COUNT];
+	size_t sec_count;
+
+	dynsym_t *dyn;
+	size_t dyn_count;
+	size_t import_count;
+	size_t dynstr_count;
+	size_t bucket_count;
+	size_t bloom_count;
+
+	size_t got_count;
+	size_t plt_count;
+	size_t rela_count;
+	size_t stub;
+	size_t entry;
+	size_t base;
+	char huge;
+	char shared;
+	char jit;
+	char textrel;
+	size_t (*external)(const char *name);
+
+	char *out;
+	size_t out_count;
+} linker_t;
+
+linker_t* linker_init(char huge, char shared);
+void linker_add(linker_t *ln, asm_t *as);
+size_t linker_to_elf(linker_t *ln, char **out);
+
+void linker_copy(linker_t *ln);
+void linker_scan(linker_t *ln);
+void linker_import(linker_t *ln, size_t u, size_t sym);
+void linker_layout(linker_t *ln, size_t header);
+size_t linker_dynamic(linker_t *ln, Elf64_Dyn *dyn);
+char linker_defined(linker_t *ln, size_t u, size_t sym);
+size_t linker_resolve(linker_t *ln, size_t u, size_t sym);
+symbol_t* linker_find_global(linker_t *ln, const char *name, size_t *u);
+void linker_relocate(linker_t *ln);
+void linker_write_dynamic(linker_t *ln);
+
+#endif /* ASM_LINKER_H */
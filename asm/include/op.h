@@ -12,6 +12,10 @@
 #define IMM32 (1 << 6)
 #define IMM64 (1 << 7)
 
+#define LOCKABLE (1 << 0)
+#define MEM_ONLY (1 << 1)
+#define RESERVE (1 << 2)
+
 #define IS_REG(x) ((x & REG8) || (x & REG16) || (x & REG32) || (x & REG64))
 #define IS_IMM(x) ((x & IMM8) || (x & IMM16) || (x & IMM32) || (x & IMM64))
 
@@ -59,6 +63,8 @@ typedef struct
 	size_t primary;
 	size_t secondary;
 	size_t extension;
+	size_t flags;
+	size_t prefix;
 } op_t;
 
 typedef struct
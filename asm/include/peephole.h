@@ -0,0 +1,50 @@
+#ifndef ASM_PEEPHOLE_H
+#define ASM_PEEPHOLE_H
+
+#include "asm.h"
+
+#define PEEP_CF (1 << 0)
+#define PEEP_FLAGS (1 << 1)
+
+/* a source line, split into its labels and the instruction that follows them. */
+typedef struct
+{
+	char *text;
+	char **label;
+	size_t label_count;
+	char *mnemonic;
+	char *op[2];
+	size_t op_count;
+	char upper;
+	size_t loc;
+} peep_line_t;
+
+typedef struct
+{
+	peep_line_t *line;
+	size_t line_count;
+	const char *file;
+	FILE *info;
+	const char *rule;
+} peephole_t;
+
+/* a rewrite, with its gain in bytes and cycles on the critical path every time it fires. */
+typedef struct
+{
+	const char *name;
+	char (*apply)(peephole_t *ph, size_t i);
+	size_t size;
+	size_t lat;
+	size_t fired;
+} peep_rule_t;
+
+/*
+ * rewrites the instructions of a source, lines keep their numbers so the
+ * listing and debug information still refer to the input. every rewrite is
+ * noted on `info`, if given.
+ */
+char* peephole_run(const char *src, size_t size, const char *file, FILE *info,
+	size_t *out_size);
+void peephole_report(FILE *fp);
+
+#endif /* ASM_PEEPHOLE_H */
@@ -0,0 +1,78 @@
+#ifndef ASM_STATS_H
+#define ASM_STATS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum stats_phase
+{
+	STATS_LEX,
+	STATS_MATCH,
+	STATS_ENCODE,
+	STATS_CLOSE,
+	STATS_WRITE,
+	STATS_PHASES
+};
+
+/* counters of the hot paths, the cycle timers only run once enabled. */
+typedef struct
+{
+	char enabled;
+	uint64_t cycles[STATS_PHASES];
+	size_t *instr;
+	size_t instr_count;
+	size_t op_probes;
+	size_t sym_lookups;
+	size_t sym_probes;
+	size_t sym_probe_max;
+	size_t fix_resolved;
+	size_t fix_reloc;
+	size_t fix_deferred;
+	size_t allocs;
+	size_t alloc_bytes;
+} stats_t;
+
+extern stats_t stats;
+
+void stats_enable();
+void stats_instr(size_t op);
+void stats_report(FILE *fp);
+
+void* stats_malloc(size_t size);
+void* stats_calloc(size_t count, size_t size);
+void* stats_realloc(void *ptr, size_t size);
+char* stats_strdup(const char *str);
+char* stats_strndup(const char *str, size_t len);
+
+/* built with -DASM_STATS, everything below compiles to nothing otherwise. */
+#ifdef ASM_STATS
+#include <x86intrin.h>
+
+#define STATS_INC(field) (stats.field++)
+#define STATS_ADD(field, val) (stats.field += (val))
+#define STATS_MAX(field, val) (stats.field = stats.field > (val) ? stats.field : (val))
+#define STATS_INSTR(op) stats_instr(op)
+#define STATS_REPORT(fp) stats_report(fp)
+#define STATS_BEGIN(phase) uint64_t stats_##phase = stats.enabled ? __rdtsc() : 0
+#define STATS_END(phase) (stats.cycles[phase] += stats.enabled ? __rdtsc() - stats_##phase : 0)
+
+#ifndef STATS_NO_WRAP
+#define malloc(size) stats_malloc(size)
+#define calloc(count, size) stats_calloc(count, size)
+#define realloc(ptr, size) stats_realloc(ptr, size)
+#define strdup(str) stats_strdup(str)
+#define strndup(str, len) stats_strndup(str, len)
+#endif
+#else
+#define STATS_INC(field) ((void) 0)
+#define STATS_ADD(field, val) ((void) 0)
+#define STATS_MAX(field, val) ((void) 0)
+#define STATS_INSTR(op) ((void) 0)
+#define STATS_REPORT(fp) ((void) 0)
+#define STATS_BEGIN(phase) ((void) 0)
+#define STATS_END(phase) ((void) 0)
+#endif
+
+#endif /* ASM_STATS_H */
@@ -8,7 +8,7 @@
 
 #define is_odigit(c)  ('0' <= c && c <= '7')
 
-	/* mn | Op/En | REX long | OP1 | OP2 | CODE_PRIMARY | CODE_SECONDARY | CODE_EXTENSION */
+	/* mn | Op/En | REX long | OP1 | OP2 | CODE_PRIMARY | CODE_SECONDARY | CODE_EXTENSION | FLAGS | PREFIX */
 op_t op[] =
 {
 	/*
@@ -30,6 +30,12 @@ op_t op[] =
 	{ "mov", OI, FALSE, REG64, IMM64, 0xB8, EMPTY, EMPTY },
 	{ "mov", MR, FALSE, REG64, REG64, 0x89, EMPTY, EMPTY },
 	{ "mov", RM, FALSE, REG64, REG64, 0x8B, EMPTY, EMPTY },
+	{ "mov", MR, FALSE, REG64, REG8, 0x88, EMPTY, EMPTY },
+	{ "mov", MR, FALSE, IMM32, REG8, 0x88, EMPTY, EMPTY },
+	{ "mov", MR, FALSE, IMM32, REG32, 0x89, EMPTY, EMPTY },
+	{ "mov", MR, FALSE, IMM32, REG64, 0x89, EMPTY, EMPTY },
+	{ "mov", RM, FALSE, REG32, IMM32, 0x8B, EMPTY, EMPTY },
+	{ "mov", RM, FALSE, REG64, IMM32, 0x8B, EMPTY, EMPTY },
 
 	/* PUSH — Push Word, Doubleword or Quadword Onto the Stack */
 	{ "push", O, TRUE, REG64, EMPTY, 0x50, EMPTY, EMPTY },
@@ -39,18 +45,18 @@ op_t op[] =
 	{ "pop", O, TRUE, REG64, EMPTY, 0x58, EMPTY, EMPTY },
 
 	/* ADD — Add */
-	{ "add", MI, FALSE, REG8, IMM8, 0x80, EMPTY, EMPTY },
-	{ "add", MI, FALSE, REG32, IMM8, 0x83, EMPTY, EMPTY },
-	{ "add", MI, FALSE, REG64, IMM8, 0x83, EMPTY, EMPTY },
-	{ "add", MI, FALSE, REG64, IMM32, 0x81, EMPTY, EMPTY },
-	{ "add", MR, FALSE, REG8, REG8, 0x00, EMPTY, EMPTY },
-	{ "add", MR, FALSE, REG16, REG16, 0x01, EMPTY, EMPTY },
-	{ "add", MR, FALSE, REG32, REG32, 0x01, EMPTY, EMPTY },
-	{ "add", MR, FALSE, REG64, REG64, 0x01, EMPTY, EMPTY },
+	{ "add", MI, FALSE, REG8, IMM8, 0x80, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MI, FALSE, REG32, IMM8, 0x83, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MI, FALSE, REG64, IMM8, 0x83, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MI, FALSE, REG64, IMM32, 0x81, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MR, FALSE, REG8, REG8, 0x00, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MR, FALSE, REG16, REG16, 0x01, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MR, FALSE, REG32, REG32, 0x01, EMPTY, EMPTY, LOCKABLE },
+	{ "add", MR, FALSE, REG64, REG64, 0x01, EMPTY, EMPTY, LOCKABLE },
 	{ "add", RM, FALSE, REG64, REG64, 0x03, EMPTY, EMPTY },
 
 	/* INC — Increment by 1 */
-	{ "inc", M, FALSE, REG64, EMPTY, 0xFF, EMPTY, EMPTY },
+	{ "inc", M, FALSE, REG64, EMPTY, 0xFF, EMPTY, EMPTY, LOCKABLE },
 
 	/* IMUL - Signed Multiply */
 	{ "imul", RM, FALSE, REG32, REG32, 0x0F, 0xAF, EMPTY },
@@ -61,36 +67,39 @@ op_t op[] =
 	{ "idiv", M, FALSE, REG64, EMPTY, 0xF7, EMPTY, 0x07 },
 	
 	/* SUB — Subtract */
-	{ "sub", MI, FALSE, REG8, IMM8, 0x80, EMPTY, 0x05 },
-	{ "sub", MI, FALSE, REG32, IMM8, 0x83, EMPTY, 0x05 },
-	{ "sub", MI, FALSE, REG64, IMM8, 0x83, EMPTY, 0x05 },
-	{ "sub", MI, FALSE, REG64, IMM32, 0x81, EMPTY, 0x05 },
-	{ "sub", MR, FALSE, REG8, REG8, 0x28, EMPTY, EMPTY },
-	{ "sub", MR, FALSE, REG16, REG16, 0x29, EMPTY, EMPTY },
-	{ "sub", MR, FALSE, REG32, REG32, 0x29, EMPTY, EMPTY },
-	{ "sub", MR, FALSE, REG64, REG64, 0x29, EMPTY, EMPTY },
+	{ "sub", MI, FALSE, REG8, IMM8, 0x80, EMPTY, 0x05, LOCKABLE },
+	{ "sub", MI, FALSE, REG32, IMM8, 0x83, EMPTY, 0x05, LOCKABLE },
+	{ "sub", MI, FALSE, REG64, IMM8, 0x83, EMPTY, 0x05, LOCKABLE },
+	{ "sub", MI, FALSE, REG64, IMM32, 0x81, EMPTY, 0x05, LOCKABLE },
+	{ "sub", MR, FALSE, REG8, REG8, 0x28, EMPTY, EMPTY, LOCKABLE },
+	{ "sub", MR, FALSE, REG16, REG16, 0x29, EMPTY, EMPTY, LOCKABLE },
+	{ "sub", MR, FALSE, REG32, REG32, 0x29, EMPTY, EMPTY, LOCKABLE },
+	{ "sub", MR, FALSE, REG64, REG64, 0x29, EMPTY, EMPTY, LOCKABLE },
 	{ "sub", RM, FALSE, REG64, REG64, 0x2B, EMPTY, EMPTY },
 
 	/* DEC — Decrement by 1 */
-	{ "dec", M, FALSE, REG64, EMPTY, 0xFF, EMPTY, 0x01 },
+	{ "dec", M, FALSE, REG64, EMPTY, 0xFF, EMPTY, 0x01, LOCKABLE },
 
 	/* XOR — Logical Exclusive OR */
-	{ "xor", MR, FALSE, REG8, REG8, 0x30, EMPTY, EMPTY },
-	{ "xor", MR, FALSE, REG32, REG32, 0x31, EMPTY, EMPTY },
-	{ "xor", MR, FALSE, REG64, REG64, 0x31, EMPTY, EMPTY },
-	{ "xor", MI, FALSE, REG8, IMM8, 0x80, EMPTY, 0x06 },
-	{ "xor", MI, FALSE, REG16, IMM16, 0x81, EMPTY, 0x06 },
-	{ "xor", MI, FALSE, REG32, IMM32, 0x81, EMPTY, 0x06 },
-	{ "xor", MI, FALSE, REG64, IMM32, 0x81, EMPTY, 0x06 },
+	{ "xor", MR, FALSE, REG8, REG8, 0x30, EMPTY, EMPTY, LOCKABLE },
+	{ "xor", MR, FALSE, REG32, REG32, 0x31, EMPTY, EMPTY, LOCKABLE },
+	{ "xor", MR, FALSE, REG64, REG64, 0x31, EMPTY, EMPTY, LOCKABLE },
+	{ "xor", MI, FALSE, REG8, IMM8, 0x80, EMPTY, 0x06, LOCKABLE },
+	{ "xor", MI, FALSE, REG16, IMM16, 0x81, EMPTY, 0x06, LOCKABLE },
+	{ "xor", MI, FALSE, REG32, IMM32, 0x81, EMPTY, 0x06, LOCKABLE },
+	{ "xor", MI, FALSE, REG64, IMM32, 0x81, EMPTY, 0x06, LOCKABLE },
 
 	/* CMP — Compare Two Operands */
 	{ "cmp", MI, FALSE, REG64, IMM8, 0x83, EMPTY, 0x07 },
 	{ "cmp", MI, FALSE, REG64, IMM32, 0x81, EMPTY, 0x07 },
-	{ "cmp", MR, FALSE, REG8, REG8, 0x3A, EMPTY, EMPTY },
-	{ "cmp", MR, FALSE, REG64, REG64, 0x3B, EMPTY, EMPTY },
+	{ "cmp", MR, FALSE, REG8, REG8, 0x38, EMPTY, EMPTY },
+	{ "cmp", MR, FALSE, REG64, REG64, 0x39, EMPTY, EMPTY },
 
 	/* TEST — Logical Compare */
 	{ "test", MI, FALSE, REG64, IMM32, 0xF7, EMPTY, EMPTY },
+	{ "test", MR, FALSE, REG8, REG8, 0x84, EMPTY, EMPTY },
+	{ "test", MR, FALSE, REG32, REG32, 0x85, EMPTY, EMPTY },
+	{ "test", MR, FALSE, REG64, REG64, 0x85, EMPTY, EMPTY },
 
 	/* SETcc - Set Byte on Condition */
 	{ "setz", M, FALSE, REG8, EMPTY, 0x0F, 0x94, EMPTY },
@@ -101,6 +110,72 @@ op_t op[] =
 	/* Jcc — Jump if Condition Is Met */
 	{ "je", D, FALSE, IMM32, EMPTY, 0x0F, 0x84, EMPTY },
 	{ "jne", D, FALSE, IMM32, EMPTY, 0x0F, 0x85, EMPTY },
+	{ "jb", D, FALSE, IMM32, EMPTY, 0x0F, 0x82, EMPTY },
+	{ "jae", D, FALSE, IMM32, EMPTY, 0x0F, 0x83, EMPTY },
+	{ "jbe", D, FALSE, IMM32, EMPTY, 0x0F, 0x86, EMPTY },
+	{ "ja", D, FALSE, IMM32, EMPTY, 0x0F, 0x87, EMPTY },
+	{ "jl", D, FALSE, IMM32, EMPTY, 0x0F, 0x8C, EMPTY },
+	{ "jge", D, FALSE, IMM32, EMPTY, 0x0F, 0x8D, EMPTY },
+	{ "jle", D, FALSE, IMM32, EMPTY, 0x0F, 0x8E, EMPTY },
+	{ "jg", D, FALSE, IMM32, EMPTY, 0x0F, 0x8F, EMPTY },
+
+	/* XCHG — Exchange Register/Memory with Register */
+	{ "xchg", MR, FALSE, REG8, REG8, 0x86, EMPTY, EMPTY, LOCKABLE },
+	{ "xchg", MR, FALSE, REG32, REG32, 0x87, EMPTY, EMPTY, LOCKABLE },
+	{ "xchg", MR, FALSE, REG64, REG64, 0x87, EMPTY, EMPTY, LOCKABLE },
+	{ "xchg", RM, FALSE, REG64, REG64, 0x87, EMPTY, EMPTY, LOCKABLE },
+
+	/* XADD — Exchange and Add */
+	{ "xadd", MR, FALSE, REG8, REG8, 0x0F, 0xC0, EMPTY, LOCKABLE },
+	{ "xadd", MR, FALSE, REG32, REG32, 0x0F, 0xC1, EMPTY, LOCKABLE },
+	{ "xadd", MR, FALSE, REG64, REG64, 0x0F, 0xC1, EMPTY, LOCKABLE },
+
+	/* CMPXCHG — Compare and Exchange */
+	{ "cmpxchg", MR, FALSE, REG8, REG8, 0x0F, 0xB0, EMPTY, LOCKABLE },
+	{ "cmpxchg", MR, FALSE, REG32, REG32, 0x0F, 0xB1, EMPTY, LOCKABLE },
+	{ "cmpxchg", MR, FALSE, REG64, REG64, 0x0F, 0xB1, EMPTY, LOCKABLE },
+
+	/* CMPXCHG8B/CMPXCHG16B — Compare and Exchange Bytes */
+	{ "cmpxchg16b", M, FALSE, REG64, EMPTY, 0x0F, 0xC7, 0x01, LOCKABLE | MEM_ONLY },
+
+	/* PAUSE — Spin Loop Hint */
+	{ "pause", ZO, FALSE, EMPTY, EMPTY, 0x90, EMPTY, EMPTY, EMPTY, 0xF3 },
+
+	/*
+	 * MFENCE/LFENCE/SFENCE — Memory Fences
+	 * the third opcode byte of ZO forms is stored as the extension.
+	 */
+	{ "mfence", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0xAE, 0xF0 },
+	{ "lfence", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0xAE, 0xE8 },
+	{ "sfence", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0xAE, 0xF8 },
+
+	/* PREFETCHh — Prefetch Data Into Caches */
+	{ "prefetchnta", M, TRUE, REG64, EMPTY, 0x0F, 0x18, 0x00, MEM_ONLY },
+	{ "prefetcht0", M, TRUE, REG64, EMPTY, 0x0F, 0x18, 0x01, MEM_ONLY },
+	{ "prefetcht1", M, TRUE, REG64, EMPTY, 0x0F, 0x18, 0x02, MEM_ONLY },
+	{ "prefetcht2", M, TRUE, REG64, EMPTY, 0x0F, 0x18, 0x03, MEM_ONLY },
+
+	/* PREFETCHW — Prefetch Data Into Caches in Anticipation of a Write */
+	{ "prefetchw", M, TRUE, REG64, EMPTY, 0x0F, 0x0D, 0x01, MEM_ONLY },
+
+	/* MOVNTI — Store Doubleword Using Non-Temporal Hint */
+	{ "movnti", MR, FALSE, REG32, REG32, 0x0F, 0xC3, EMPTY, MEM_ONLY },
+	{ "movnti", MR, FALSE, REG64, REG64, 0x0F, 0xC3, EMPTY, MEM_ONLY },
+
+	/* CLFLUSH — Flush Cache Line */
+	{ "clflush", M, TRUE, REG64, EMPTY, 0x0F, 0xAE, 0x07, MEM_ONLY },
+
+	/* CLFLUSHOPT — Flush Cache Line Optimized */
+	{ "clflushopt", M, TRUE, REG64, EMPTY, 0x0F, 0xAE, 0x07, MEM_ONLY, 0x66 },
+
+	/* RDTSC — Read Time-Stamp Counter */
+	{ "rdtsc", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0x31, EMPTY },
+
+	/* RDTSCP — Read Time-Stamp Counter and Processor ID */
+	{ "rdtscp", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0x01, 0xF9 },
+
+	/* CPUID — CPU Identification */
+	{ "cpuid", ZO, FALSE, EMPTY, EMPTY, 0x0F, 0xA2, EMPTY },
 
 	/* INT n/INTO/INT3/INT1 — Call to Interrupt Procedure */
 	{ "int", I, FALSE, IMM8, EMPTY, 0xCD, 0x00, EMPTY },
@@ -110,13 +185,18 @@ op_t op[] =
 
 	/* CALL — Call Procedure */
 	{ "call", D, FALSE, IMM32, EMPTY, 0xE8, EMPTY, EMPTY },
+	{ "call", M, TRUE, IMM32, EMPTY, 0xFF, EMPTY, 0x02 },
 
 	/* RET — Return from Procedure */
 	{ "ret", ZO, FALSE, EMPTY, EMPTY, 0xC3, EMPTY, EMPTY },
 	{ "ret", I, FALSE, IMM16, EMPTY, 0xC2, EMPTY, EMPTY },
 
 	/* Pseudo-operations */
-	{ "db", EMPTY, FALSE, IMM8, EMPTY, EMPTY, EMPTY, EMPTY }
+	{ "db", EMPTY, FALSE, IMM8, EMPTY, EMPTY, EMPTY, EMPTY },
+	{ "resb", EMPTY, FALSE, IMM8, EMPTY, EMPTY, EMPTY, EMPTY, RESERVE },
+	{ "resw", EMPTY, FALSE, IMM16, EMPTY, EMPTY, EMPTY, EMPTY, RESERVE },
+	{ "resd", EMPTY, FALSE, IMM32, EMPTY, EMPTY, EMPTY, EMPTY, RESERVE },
+	{ "resq", EMPTY, FALSE, IMM64, EMPTY, EMPTY, EMPTY, EMPTY, RESERVE }
 };
 
 reg_t reg[] =
@@ -199,19 +279,32 @@ asm_t* asm_init(lexer_t *lex)
 	return as;
 }
 
+char* asm_keep(asm_t *as, char *str)
+{
+	as->str = realloc(as->str, ++as->str_count * sizeof(char*));
+	as->str[as->str_count - 1] = str;
+	return str;
+}
+
 void asm_full_pass(asm_t *as)
 {
-	char new = 2;
-	char line[256] = { 0 };
-	size_t loc = -1;
+	char new = 2, fresh = 1;
+	char line[512] = { 0 };
+	size_t loc = -1, shown = 0;
 
-	while (as->token = lexer_advance(as->lex))
+	asm_replay(as, 0);
+	while (as->token = asm_next_token(as))
 	{
-		/* print all locs we skipped. */
+		/* print all locs we skipped, expanded lines go back to their body. */
 		size_t new_loc = lexer_loc(as->lex);
-		for (size_t i = loc + 1; i < new_loc; i++)
-			printf("%d\n", i);
+		for (size_t i = shown; i < new_loc && as->listing; i++)
+			fprintf(as->listing, "%d\n", i);
+		if (new_loc >= shown)
+			shown = new_loc + 1;
+		if (new_loc != loc || fresh)
+			asm_begin_line(as);
 		loc = new_loc;
+		fresh = 0;
 
 		/* advance the current state. */
 		asm_advance(as, &new);
@@ -219,42 +312,70 @@ void asm_full_pass(asm_t *as)
 		/* write out the tokens, one after the other. */
 		if (new == 3)
 			new = 2;
+		else if (new == 4)
+		{
+			sprintf(line, "%s ", as->token);
+			new = 2;
+		}
 		else if (new == 2)
 		{
-			sprintf(line, "%s", as->token);
+			strcat(line, as->token);
 			new = 1;
 		}
 		else if (new == 1)
 		{
-			sprintf(line, "%s %s", strdup(line), as->token);
+			sprintf(line + strlen(line), " %s", as->token);
 			new = 0;
 		}
 		else
-			sprintf(line, "%s, %s", strdup(line), as->token);
+			sprintf(line + strlen(line), ", %s", as->token);
 
 		/* finished line, print out total op's emitted and new labels. */
 		if (!lexer_peek(as->lex))
 		{
 			asm_emit_current_hex(as, line);
 			asm_emit_current_labels(as, line);
-			printf("%-6d%s\n", loc, line);
+			asm_emit_current_cost(as, line);
+			if (as->listing)
+				fprintf(as->listing, "%-6d%s\n", loc, line);
+			asm_emit_current_loops(as);
 			memset(line, '\0', sizeof(line));
 			new = 2;
+			fresh = 1;
+
+			/* unchanged lines that follow need not be tokenized at all. */
+			asm_map_line(as, loc);
+			asm_infer_cfi(as);
+			asm_end_line(as);
+			asm_replay(as, loc + 1);
 		}
 	}
 
 	/* finalize the last section */
 	asm_close_section(as);
+	asm_resolve_deferred(as);
+	asm_resolve_attributes(as);
+	asm_merge_strings(as);
 
 	/* there might be even more empty locs with no token for the lexer to catch. */
-	for (size_t i = loc + 1; i < as->lex->loc_count; i++)
-		printf("%d\n", i);
+	for (size_t i = shown; i < as->lex->loc_count && as->listing; i++)
+		fprintf(as->listing, "%d\n", i);
+}
+
+char* asm_next_token(asm_t *as)
+{
+	STATS_BEGIN(STATS_LEX);
+	char *token = lexer_advance(as->lex);
+	STATS_END(STATS_LEX);
+	return token;
 }
 
 void asm_advance(asm_t *as, char *new)
 {
-	if (asm_consume_label(as) || asm_consume_extern(as))
+	if (asm_consume_label(as) || asm_consume_extern(as)
+		|| asm_consume_attribute(as) || asm_consume_cfi(as) || asm_consume_bench(as))
 	{
+		as->line_cacheable = 0;
 		*new = 3;
 		return;
 	}
@@ -262,18 +383,43 @@ void asm_advance(asm_t *as, char *new)
 	if (strcmp(as->token, "section") == 0)
 	{
 		asm_close_section(as);
+		as->line_cacheable = 0;
 		*new = 3;
 		return;
 	}
 
 	if (!as->section)
 	{
-		as->section = as->token;
-		as->section_start = as->out_count;
+		/* the section name might be followed by its flags and entry size. */
+		char *name = asm_keep(as, strdup(as->token)), *flags = lexer_peek(as->lex) ?
+			lexer_advance(as->lex) : 0, *entsize = flags && lexer_peek(as->lex) ?
+			lexer_advance(as->lex) : 0;
+		asm_open_section(as, name, asm_decode_section_flags(as, name, flags));
+		as->section_base = name;
+
+		/* .rodata.strN.M holds strings of N byte wide characters. */
+		if (entsize)
+			as->section_entsize = strtoul(entsize, 0, 0);
+		else if (sscanf(name, ".rodata.str%zu", &as->section_entsize) != 1)
+			as->section_entsize = 1;
+		as->line_cacheable = 0;
 		*new = 3;
 		return;
 	}
 
+	if (!as->cur.mnemonic && strcasecmp(as->token, "lock") == 0)
+	{
+		if (!lexer_peek(as->lex))
+		{
+			error_print("Encountered LOCK prefix without instruction.\n");
+			error_exit();
+		}
+
+		as->cur.lock = 1;
+		*new = 4;
+		return;
+	}
+
 	if (!as->cur.mnemonic)
 		as->cur.mnemonic = as->token;
 	else
@@ -293,36 +439,103 @@ void asm_advance(asm_t *as, char *new)
 	}
 
 	if (!lexer_peek(as->lex))
+	{
+		STATS_BEGIN(STATS_ENCODE);
 		asm_make_instr(as);
+		STATS_END(STATS_ENCODE);
+	}
+}
+
+static enum reloc_type reloc_type(dec_t *o, enum operand_encoding_type e, char rex)
+{
+	/* direct branches go through the PLT, so the linker can relax them. */
+	if (o->tls)
+		return o->tls;
+	else if (!o->rel)
+		return ABSOLUTE;
+	else if (o->got)
+		return rex ? GOT_RELATIVE_REX : GOT_RELATIVE;
+	else if (e == D)
+		return PLT_RELATIVE;
+	return RELATIVE;
+}
+
+/* only branches to externs and global labels may be redirected through the PLT. */
+static enum reloc_type reloc_branch(enum reloc_type type, symbol_t *sym)
+{
+	return type == PLT_RELATIVE && sym->type == LABEL ? RELATIVE : type;
 }
 
 void asm_make_instr(asm_t *as)
 {
+	STATS_BEGIN(STATS_MATCH);
 	op_t* op = asm_match_op(as);
+	STATS_END(STATS_MATCH);
 	
 	if (!op)
 	{
-		printf("Failed to match current instruction to opcode.\n"
+		error_print("Failed to match current instruction to opcode.\n"
 			"Mnemonic: %s\nOP count: %d\n", as->cur.mnemonic,
 			as->cur.op_count);
 		for (size_t i = 0; i < as->cur.op_count; i++)
-			printf("OP %d: %s\n", i, as->cur.op[i].op);
-		exit(1);
+			error_print("OP %d: %s\n", i, as->cur.op[i].op);
+		error_exit();
 	}
 
-	symbol_t *sym;
 	enum operand_encoding_type e = op->op;
+
+	if (as->analyze && op->primary != EMPTY)
+		asm_analyze(as, op);
+
+	/* a line is only cached if all of its symbols end up as fixups. */
+	as->line_instr++;
+	for (size_t i = 0; i < as->cur.op_count; i++)
+		if (as->cur.op[i].sym || as->cur.op[i].def_rel)
+			as->line_symbols++;
 	
+	/* the LOCK prefix is only valid for RMW instructions on memory. */
+	if (as->cur.lock)
+	{
+		dec_t *dst = e == RM ? &as->cur.op[1] : &as->cur.op[0];
+		if (!(op->flags & LOCKABLE) || as->cur.op_count == 0 || dst->disp == ~0)
+		{
+			error_print("LOCK prefix is not permitted on `%s` with the given operands.\n",
+				as->cur.mnemonic);
+			error_exit();
+		}
+
+		asm_emit(as, 0xF0);
+	}
+
 	/* handle pseudo-instructions first */
-	if (e == EMPTY)
+	if (e == EMPTY && op->flags & RESERVE)
+	{
+		if (as->cur.op_count != 1)
+		{
+			error_print("Reservation `%s` expects exactly one count.\n",
+				as->cur.mnemonic);
+			error_exit();
+		}
+
+		asm_reserve(as, asm_decode_imm(as, 0, 0) * op_size(op->op_1));
+		as->line_cacheable = 0;
+		asm_clear_instr(as);
+		return;
+	}
+	else if (e == EMPTY)
 	{
 		for (size_t i = 0; i < as->cur.op_count; i++)
 			for (size_t j = 0; j < as->cur.op[i].sub_count; j++)
 				asm_emit_imm(as, op->op_1, asm_decode_imm(as, i, j));
-		memset(&as->cur, 0, sizeof(instr_t));
+		asm_clear_instr(as);
 		return;
 	}
 
+	/* write segment overrides */
+	for (size_t i = 0; i < as->cur.op_count; i++)
+		if (as->cur.op[i].segment)
+			asm_emit(as, as->cur.op[i].segment);
+
 	/* write legacy prefixes */
 	size_t op_1 = op->op_1, op_2 = op->op_2;
 	if (as->cur.op_count > 0 && as->cur.op[0].legacy)
@@ -333,6 +546,10 @@ void asm_make_instr(asm_t *as)
 		if (op_size(op->op_2) >= 4)
 			op->op_2 >>= 1;
 	}
+
+	/* write mandatory prefixes */
+	if (op->prefix)
+		asm_emit(as, op->prefix);
 	
 	/* swap RM to MR, makes the code following a lot easier */
 	if (e == RM)
@@ -352,22 +569,25 @@ void asm_make_instr(asm_t *as)
 	reg_t *r2 = IS_REG(op->op_2) ? asm_decode_reg(as, 1, 0) : 0;
 	char reg1 = r1 ? r1->val | (r1->upper << 2) : 0;
 	char reg2 = r2 ? r2->val | (r2->upper << 2) : 0;
-	char primary = op->primary;
+	char primary = op->primary, rex = 0;
 
 	if (IS_REG(op->op_1) || IS_REG(op->op_2))
 	{
 		if (e == O || e == OI)
 			primary += reg1;
 		
-		/* write REX prefix */
-		if (!op->rex_long && (op->op_1 & REG64 || op->op_2 & REG64 ||
-					(o1 && o1->extended) || (o2 && o2->extended) ||
+		/*
+		 * write REX prefix, instructions that default to 64-bit operands
+		 * (or only address memory) never need REX.W.
+		 */
+		char rex_w = !op->rex_long && (op->op_1 & REG64 || op->op_2 & REG64);
+		if (rex_w || (o1 && o1->extended) || (o2 && o2->extended) ||
 					(op->op_1 & REG8 && r1->val & 0b100) ||
-					(op->op_2 & REG8 && r2->val & 0b100)))
+					(op->op_2 & REG8 && r2->val & 0b100))
 		{
-			char rex = 0b01000000;
+			rex = 0b01000000;
 
-			if (op->op_1 & REG64 || op->op_2 & REG64)
+			if (rex_w)
 				rex |= 0b1 << 3;
 		
 			/*
@@ -387,6 +607,10 @@ void asm_make_instr(asm_t *as)
 	if (op->secondary)
 		asm_emit(as, op->secondary);
 
+	/* some instructions without operands have a third opcode byte. */
+	if (e == ZO && op->extension)
+		asm_emit(as, op->extension);
+
 	/* write ModR/M */
 	if (e == M || e == MI || e == MR)
 	{
@@ -398,7 +622,10 @@ void asm_make_instr(asm_t *as)
 		if (IS_REG(op->op_2))
 			rm |= reg2 << 3;
 	
-		if (!(o1 && o1->rel) && !(o2 && o2->rel))
+		char absolute = o1 && o1->absolute || o2 && o2->absolute;
+		if (absolute)
+			rm |= 0b100;
+		else if (!(o1 && o1->rel) && !(o2 && o2->rel))
 		{
 			if (o1 && o1->disp != ~0)
 			{
@@ -425,9 +652,12 @@ void asm_make_instr(asm_t *as)
 		
 		if (o1 && o2 && o1->disp != ~0 && o2->disp != ~0)
 		{
-			printf("Two displacements are impossible to occur.\n");
-			exit(1);
+			error_print("Two displacements are impossible to occur.\n");
+			error_exit();
 		}
+		/* absolute addresses use a SIB byte without base and index, the address follows. */
+		else if (absolute)
+			asm_emit(as, 0b00100101);
 		else if (o1 && o1->disp != ~0 && !o1->sym)
 		{
 			/* TODO: add dynamic encoding of SIB byte. */
@@ -447,174 +677,1030 @@ void asm_make_instr(asm_t *as)
 				asm_emit_imm(as, IMM32, o2->disp);
 		}
 	}
-	
-	long imm;
-	if (IS_IMM(op->op_1))
-	{
-		imm = asm_decode_imm(as, 0, 0);
+	
+	long imm;
+	if (IS_IMM(op->op_1))
+	{
+		if (e == D)
+			o1->rel = 1;
+
+		if (o1->sym || o1->def_rel)
+			asm_fixup(as, &(fixup_t)
+			{
+				.name = o1->sym ? o1->sym->name : o1->sub[0],
+				.type = reloc_type(o1, e, rex),
+				.op = op->op_1,
+				.add = o1->disp != ~0 ? o1->disp : 0,
+				.end = op_size(op->op_1) + op_size(op->op_2),
+				.sign = e != OI,
+				.branch = e == D
+			}, o1->sym);
+		else
+		{
+			imm = asm_decode_imm(as, 0, 0);
+
+			if (e == D)
+				imm -= as->out_count - as->section_start
+					+ op_size(op->op_1) + op_size(op->op_2);
+
+			asm_emit_imm(as, op->op_1, imm);
+		}
+	}
+
+	if (IS_IMM(op->op_2))
+	{
+		if (o2->sym || o2->def_rel)
+			asm_fixup(as, &(fixup_t)
+			{
+				.name = o2->sym ? o2->sym->name : o2->sub[0],
+				.type = reloc_type(o2, e, rex),
+				.op = op->op_2,
+				.add = o2->disp != ~0 ? o2->disp : 0,
+				.end = op_size(op->op_2),
+				.sign = e != OI,
+				.branch = 0
+			}, o2->sym);
+		else
+			asm_emit_imm(as, op->op_2, asm_decode_imm(as, 1, 0));
+	}
+
+	if (op->op == RM)
+	{
+		dec_t tmp1 = as->cur.op[0];
+		as->cur.op[0] = as->cur.op[1];
+		as->cur.op[1] = tmp1;
+		size_t tmp2 = op->op_1;
+		op->op_1 = op->op_2;
+		op->op_2 = tmp2;
+		e = MR;
+	}
+	
+	op->op_1 = op_1;
+	op->op_2 = op_2;
+	asm_clear_instr(as);
+}
+
+void asm_fixup(asm_t *as, fixup_t *fix, symbol_t *sym)
+{
+	long imm = 0;
+	fix->offset = as->out_count - as->line_start;
+
+	/* direct branches within the section are resolved right away. */
+	if (sym && fix->branch && sym->type != EXTERN && sym->section == ~0)
+	{
+		imm = sym->addr - (as->out_count - as->section_start + fix->end);
+		STATS_INC(fix_resolved);
+
+		/* reordered functions need these patched again. */
+		if (as->order_count)
+		{
+			as->patch = realloc(as->patch, ++as->patch_count * sizeof(reloc_t));
+			as->patch[as->patch_count - 1] = (reloc_t)
+			{
+				.type = RELATIVE,
+				.sym = sym - &as->sym[0],
+				.section = ~0,
+				.addr = as->out_count - as->section_start,
+				.add = fix->end,
+				.size = op_size(fix->op),
+				.sign = 1
+			};
+		}
+	}
+	/* symbols of previous sections are only known to the linker. */
+	else if (sym)
+	{
+		STATS_INC(fix_reloc);
+		as->rel = realloc(as->rel, ++as->rel_count * sizeof(reloc_t));
+		as->rel[as->rel_count - 1] = (reloc_t)
+		{
+			.type = reloc_branch(fix->type, sym),
+			.sym = sym - &as->sym[0],
+			.section = ~0,
+			.addr = as->out_count - as->section_start,
+			.add = fix->add,
+			.size = op_size(fix->op),
+			.sign = fix->sign
+		};
+	}
+	else
+	{
+		STATS_INC(fix_deferred);
+		as->def_rel = realloc(as->def_rel, ++as->def_rel_count
+				* sizeof(def_reloc_t));
+		as->def_rel[as->def_rel_count - 1] = (def_reloc_t)
+		{
+			.type = fix->type,
+			.name = fix->name,
+			.section = ~0,
+			.addr = as->out_count - as->section_start,
+			.add = fix->add,
+			.size = op_size(fix->op),
+			.sign = fix->sign
+		};
+	}
+
+	if (as->cache)
+	{
+		as->fix = realloc(as->fix, ++as->fix_count * sizeof(fixup_t));
+		as->fix[as->fix_count - 1] = *fix;
+	}
+
+	asm_emit_imm(as, fix->op, imm);
+}
+
+void asm_begin_line(asm_t *as)
+{
+	/* lines continuing a directive depend on more than their own text. */
+	as->line_start = as->out_count;
+	as->line_instr = 0;
+	as->line_symbols = 0;
+	as->line_cacheable = as->section && !as->ext && !as->attr
+		&& as->lex->frame_count == 0;
+	as->fix_count = 0;
+}
+
+void asm_end_line(asm_t *as)
+{
+	if (!as->cache || !as->line_cacheable || as->line_instr != 1
+		|| as->line_symbols != as->fix_count)
+		return;
+
+	char *str = as->lex->cur->str;
+	uint64_t hash = cache_hash(str);
+	cache_line_t *cl = cache_find(as->cache, hash, str);
+
+	if (!cl)
+	{
+		/* fields are stored blank, they are filled in on every use. */
+		cl = cache_add(as->cache, hash, str);
+		cl->size = as->out_count - as->line_start;
+		cl->data = malloc(cl->size);
+		memcpy(cl->data, as->out + as->line_start, cl->size);
+		cl->fix = calloc(as->fix_count, sizeof(fixup_t));
+		cl->fix_count = as->fix_count;
+
+		for (size_t i = 0; i < as->fix_count; i++)
+		{
+			cl->fix[i] = as->fix[i];
+			cl->fix[i].name = strdup(as->fix[i].name);
+			memset(cl->data + cl->fix[i].offset, 0, op_size(cl->fix[i].op));
+		}
+	}
+
+	cl->used = 1;
+}
+
+size_t asm_replay(asm_t *as, size_t loc)
+{
+	lexer_t *lex = as->lex;
+
+	/* streams cannot skip ahead, their lines are only recorded. */
+	if (!as->cache || lex->fp || lex->frame_count > 0)
+		return loc;
+
+	for (; loc < lex->loc_count; loc++)
+	{
+		char *line = lex->loc[loc].str, *str = line + strspn(line, "\t ");
+		if (*str == '\0' || *str == '#')
+			continue;
+
+		cache_line_t *cl;
+		if (!as->section || as->ext || as->attr
+			|| !(cl = cache_find(as->cache, cache_hash(line), line)))
+			break;
+
+		/* copy the encoding, resolving its symbols like the encoder would. */
+		size_t done = 0;
+		as->line_start = as->out_count;
+		for (size_t i = 0; i < cl->fix_count; i++)
+		{
+			fixup_t *fix = &cl->fix[i];
+			asm_emit_data(as, cl->data + done, fix->offset - done);
+			asm_fixup(as, fix, asm_find_symbol(as, fix->name));
+			done = fix->offset + op_size(fix->op);
+		}
+
+		asm_emit_data(as, cl->data + done, cl->size - done);
+		asm_map_line(as, loc);
+		asm_infer_cfi(as);
+		as->last_out_count = as->out_count;
+		as->fix_count = 0;
+		cl->used = 1;
+	}
+
+	lexer_seek(lex, loc);
+	return loc;
+}
+
+void asm_map_line(asm_t *as, size_t loc)
+{
+	if (!as->debug || as->out_count == as->line_start
+		|| !(as->section_flags & SEC_EXEC))
+		return;
+
+	as->dbg = realloc(as->dbg, ++as->dbg_count * sizeof(dbg_line_t));
+	as->dbg[as->dbg_count - 1] = (dbg_line_t)
+	{
+		.section = ~0,
+		.addr = as->line_start - as->section_start,
+		.loc = loc
+	};
+}
+
+void asm_clear_instr(asm_t *as)
+{
+	/* operand strings stay alive, deferred relocations refer to them. */
+	for (size_t i = 0; i < as->cur.op_count; i++)
+		free(as->cur.op[i].sub);
+	free(as->cur.op);
+	memset(&as->cur, 0, sizeof(instr_t));
+}
+
+char asm_consume_label(asm_t *as)
+{
+	size_t len = strlen(as->token);
+	enum symbol_type t = LABEL;
+
+	if (len < 2 || as->token[len - 1] != ':')
+		return 0;
+	
+	if (len > 2 && as->token[len - 2] == ':')
+	{
+		len--;
+		t = GLOBAL_LABEL;
+	}
+
+	/* an inferred procedure ends where the next function begins. */
+	if (t == GLOBAL_LABEL && as->cfi_open == CFI_INFERRED)
+	{
+		asm_add_cfi(as, CFI_ENDPROC, as->out_count - as->section_start, 0, 0);
+		as->cfi_open = 0;
+	}
+
+	/* every global function gets its own section, if requested. */
+	if (t == GLOBAL_LABEL && as->function_sections && as->section
+		&& strncmp(as->section_base, ".text", 5) == 0)
+	{
+		char *name = asm_keep(as, calloc(strlen(as->section_base) + len + 1, 1));
+		sprintf(name, "%s.%.*s", as->section_base, (int) len - 1, as->token);
+
+		if (as->out_count == as->section_start && as->section == as->section_base)
+			as->section = name;
+		else
+		{
+			asm_close_section(as);
+			asm_open_section(as, name, SEC_ALLOC | SEC_EXEC);
+		}
+	}
+
+	as->sym = realloc(as->sym, ++as->sym_count * sizeof(symbol_t));
+	symbol_t *sym = &as->sym[as->sym_count - 1];
+	sym->name = calloc(len + 1, 1);
+	strcpy(sym->name, as->token);
+	sym->name[len - 1] = '\0';
+	sym->addr = as->out_count - as->section_start + as->section_reserved;
+	sym->type = t;
+	sym->section = ~0;
+	sym->size = 0;
+	sym->flags = 0;
+
+	if (t == GLOBAL_LABEL && as->cfi_infer && !as->cfi_open
+		&& as->section_flags & SEC_EXEC)
+	{
+		as->cfi_candidate = 1;
+		as->cfi_label = sym->addr;
+	}
+
+	return 1;
+}
+
+char asm_consume_extern(asm_t *as)
+{
+	if (as->ext == 1)
+	{
+		as->sym = realloc(as->sym, ++as->sym_count * sizeof(symbol_t));
+
+		symbol_t *sym = &as->sym[as->sym_count - 1];
+		size_t len = strlen(as->token);
+		sym->type = EXTERN;
+		sym->name = calloc(len + 1, 1);
+		strcpy(sym->name, as->token);
+		sym->addr = 0;
+		sym->section = ~0;
+		sym->size = 0;
+		sym->flags = 0;
+		
+		as->ext = 0;
+		return 1;
+	}
+
+	if (strcmp(as->token, "extern") == 0)
+	{
+		as->ext = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+char asm_consume_attribute(asm_t *as)
+{
+	if (as->attr)
+	{
+		as->def_attr = realloc(as->def_attr, ++as->def_attr_count
+				* sizeof(def_attr_t));
+		as->def_attr[as->def_attr_count - 1] = (def_attr_t)
+		{
+			.name = asm_keep(as, strdup(as->token)),
+			.flags = as->attr
+		};
+
+		as->attr = 0;
+		return 1;
+	}
+
+	if (as->cur.mnemonic)
+		return 0;
+
+	if (strcmp(as->token, "weak") == 0)
+		as->attr = SYM_WEAK;
+	else if (strcmp(as->token, "hidden") == 0)
+		as->attr = SYM_HIDDEN;
+	else
+		return 0;
+
+	return 1;
+}
+
+static size_t cfi_reg(const char *name)
+{
+	/* dwarf orders the first registers differently from their encoding. */
+	const char map[] = { 0, 2, 1, 3, 7, 6, 4, 5 };
+
+	for (size_t i = 0; name && i < sizeof(reg) / sizeof(reg_t); i++)
+		if (reg[i].size == REG64 && strcasecmp(reg[i].mnemonic, name) == 0)
+			return reg[i].extended ? 8 + reg[i].val : map[reg[i].val];
+
+	error_print("Invalid register `%s` in CFI directive.\n", name ? name : "");
+	error_exit();
+}
+
+static long cfi_val(const char *val)
+{
+	char *end;
+	long res = val ? strtol(val, &end, 0) : 0;
+
+	if (!val || *end != '\0')
+	{
+		error_print("Invalid offset `%s` in CFI directive.\n", val ? val : "");
+		error_exit();
+	}
+
+	return res;
+}
+
+char asm_consume_cfi(asm_t *as)
+{
+	if (as->cur.mnemonic || strncmp(as->token, ".cfi_", 5) != 0)
+		return 0;
+
+	char *dir = as->token, *arg1 = lexer_peek(as->lex) ? lexer_advance(as->lex) : 0,
+		*arg2 = arg1 && lexer_peek(as->lex) ? lexer_advance(as->lex) : 0;
+	size_t addr = as->out_count - as->section_start;
+
+	if (!as->section)
+	{
+		error_print("CFI directive `%s` outside of a section.\n", dir);
+		error_exit();
+	}
+
+	if (strcmp(dir, ".cfi_startproc") != 0 && as->cfi_open != CFI_EXPLICIT)
+	{
+		error_print("CFI directive `%s` outside of a procedure.\n", dir);
+		error_exit();
+	}
+
+	/* explicit directives take precedence over inferred procedures. */
+	if (strcmp(dir, ".cfi_startproc") == 0)
+	{
+		if (as->cfi_open == CFI_EXPLICIT)
+		{
+			error_print("Nested .cfi_startproc are not permitted.\n");
+			error_exit();
+		}
+		else if (as->cfi_open == CFI_INFERRED)
+			asm_add_cfi(as, CFI_ENDPROC, addr, 0, 0);
+
+		as->cfi_open = CFI_EXPLICIT;
+		as->cfi_candidate = 0;
+		asm_add_cfi(as, CFI_STARTPROC, addr, 0, 0);
+	}
+	else if (strcmp(dir, ".cfi_endproc") == 0)
+	{
+		as->cfi_open = 0;
+		asm_add_cfi(as, CFI_ENDPROC, addr, 0, 0);
+	}
+	else if (strcmp(dir, ".cfi_def_cfa") == 0)
+		asm_add_cfi(as, CFI_DEF_CFA, addr, cfi_reg(arg1), cfi_val(arg2));
+	else if (strcmp(dir, ".cfi_def_cfa_offset") == 0)
+		asm_add_cfi(as, CFI_DEF_CFA_OFFSET, addr, 0, cfi_val(arg1));
+	else if (strcmp(dir, ".cfi_def_cfa_register") == 0)
+		asm_add_cfi(as, CFI_DEF_CFA_REGISTER, addr, cfi_reg(arg1), 0);
+	else if (strcmp(dir, ".cfi_offset") == 0)
+	{
+		long val = cfi_val(arg2);
+		if (val >= 0 || val % 8 != 0)
+		{
+			error_print("CFI offset %ld is not a negative multiple of 8.\n", val);
+			error_exit();
+		}
+
+		asm_add_cfi(as, CFI_OFFSET, addr, cfi_reg(arg1), val);
+	}
+	else if (strcmp(dir, ".cfi_remember_state") == 0)
+		asm_add_cfi(as, CFI_REMEMBER_STATE, addr, 0, 0);
+	else if (strcmp(dir, ".cfi_restore_state") == 0)
+		asm_add_cfi(as, CFI_RESTORE_STATE, addr, 0, 0);
+	else
+	{
+		error_print("Unknown CFI directive `%s`.\n", dir);
+		error_exit();
+	}
+
+	return 1;
+}
+
+char asm_consume_bench(asm_t *as)
+{
+	if (as->cur.mnemonic || strcmp(as->token, "bench_begin") != 0
+		&& strcmp(as->token, "bench_end") != 0)
+		return 0;
+
+	if (!as->section)
+	{
+		error_print("Benchmark directive `%s` outside of a section.\n", as->token);
+		error_exit();
+	}
+
+	if (strcmp(as->token, "bench_end") == 0)
+	{
+		if (!as->bench_open)
+		{
+			error_print("Encountered bench_end without bench_begin.\n");
+			error_exit();
+		}
+
+		/* the kernel is called by the driver. */
+		asm_emit(as, 0xC3);
+		as->bench_open = 0;
+		return 1;
+	}
+
+	char *name = lexer_peek(as->lex) ? lexer_advance(as->lex) : 0;
+	if (!name || as->bench_open)
+	{
+		error_print(name ? "Nested bench_begin are not permitted.\n"
+			: "Encountered bench_begin without a name.\n");
+		error_exit();
+	}
+
+	/* the kernel starts a global function of the given name. */
+	char *label = calloc(strlen(name) + 3, 1), *token = as->token;
+	sprintf(label, "%s::", name);
+	as->token = label;
+	asm_consume_label(as);
+	as->token = token;
+	free(label);
+
+	as->bench = realloc(as->bench, ++as->bench_count * sizeof(char*));
+	as->bench[as->bench_count - 1] = strdup(name);
+	as->bench_open = 1;
+	return 1;
+}
+
+void asm_add_cfi(asm_t *as, enum cfi_type type, size_t addr, size_t reg, long val)
+{
+	as->cfi = realloc(as->cfi, ++as->cfi_count * sizeof(cfi_t));
+	as->cfi[as->cfi_count - 1] = (cfi_t)
+	{
+		.type = type,
+		.section = ~0,
+		.addr = addr,
+		.reg = reg,
+		.val = val
+	};
+}
+
+void asm_infer_cfi(asm_t *as)
+{
+	size_t size = as->out_count - as->line_start,
+		addr = as->out_count - as->section_start;
+	char *code = as->out + as->line_start;
+
+	if (size == 0)
+		return;
+
+	/* only functions starting with `push rbp` are described. */
+	if (as->cfi_candidate)
+	{
+		as->cfi_candidate = 0;
+		if (size != 1 || code[0] != 0x55)
+			return;
+
+		as->cfi_open = CFI_INFERRED;
+		as->cfi_state = 1;
+		asm_add_cfi(as, CFI_STARTPROC, as->cfi_label, 0, 0);
+		asm_add_cfi(as, CFI_DEF_CFA_OFFSET, addr, 0, 16);
+		asm_add_cfi(as, CFI_OFFSET, addr, cfi_reg("rbp"), -16);
+		return;
+	}
+
+	if (as->cfi_open != CFI_INFERRED)
+		return;
+
+	/*
+	 * once `mov rbp, rsp` set up the frame, `pop rbp` tears it down. code
+	 * following the `ret` is back inside the frame.
+	 */
+	if (as->cfi_state == 4)
+	{
+		asm_add_cfi(as, CFI_RESTORE_STATE, as->line_start - as->section_start, 0, 0);
+		as->cfi_state = 2;
+	}
+
+	if (as->cfi_state == 1 && size == 3 && memcmp(code, "\x48\x89\xE5", 3) == 0)
+	{
+		asm_add_cfi(as, CFI_DEF_CFA_REGISTER, addr, cfi_reg("rbp"), 0);
+		as->cfi_state = 2;
+	}
+	else if (as->cfi_state == 2 && size == 1 && code[0] == 0x5D)
+	{
+		asm_add_cfi(as, CFI_REMEMBER_STATE, addr, 0, 0);
+		asm_add_cfi(as, CFI_DEF_CFA, addr, cfi_reg("rsp"), 8);
+		as->cfi_state = 3;
+	}
+	else if (as->cfi_state == 3 && size == 1 && code[0] == (char) 0xC3)
+		as->cfi_state = 4;
+}
+
+static char is_one_of(const char *mnemonic, const char *list)
+{
+	size_t len = strlen(mnemonic);
+	for (const char *it = list; *it; it += strspn(it, " "))
+	{
+		size_t word = strcspn(it, " ");
+		if (word == len && strncasecmp(it, mnemonic, len) == 0)
+			return 1;
+		it += word;
+	}
+
+	return 0;
+}
+
+static void cost_dep(size_t *dep, size_t *count, size_t res)
+{
+	for (size_t i = 0; i < *count; i++)
+		if (dep[i] == res)
+			return;
+
+	if (*count < COST_DEPS)
+		dep[(*count)++] = res;
+}
+
+static void cost_regs(cost_instr_t *ci, const char *list, char write)
+{
+	char *dup = strdup(list);
+	for (char *it = strtok(dup, " "); it; it = strtok(0, " "))
+	{
+		reg_t *r = asm_find_reg(it);
+		if (write)
+			cost_dep(ci->write, &ci->write_count, r->val + 8 * r->extended);
+		else
+			cost_dep(ci->read, &ci->read_count, r->val + 8 * r->extended);
+	}
+	free(dup);
+}
+
+void asm_analyze(asm_t *as, op_t *op)
+{
+	instr_t *in = &as->cur;
+	cost_instr_t ci = { .section = as->sec_count, .addr = as->out_count - as->section_start };
+	char form = COST_REG, *mn = in->mnemonic;
+
+	for (size_t i = 0; i < in->op_count && i < 2; i++)
+		if (in->op[i].op[0] == '[')
+		{
+			form = i == 0 ? COST_STORE : COST_LOAD;
+			ci.mem = in->op[i].op;
+		}
+
+	/* lea only computes the address. */
+	if (strcasecmp(mn, "lea") == 0)
+		form = COST_REG;
+
+	ci.cost = cost_lookup(as->analyze, mn, form);
+	ci.lat = ci.cost ? ci.cost->lat : 1;
+	ci.rthru = ci.cost ? ci.cost->rthru : 1;
+	if (in->lock)
+	{
+		ci.lat = ci.lat > as->analyze->atomic ? ci.lat : as->analyze->atomic;
+		ci.rthru = ci.rthru > as->analyze->atomic ? ci.rthru : as->analyze->atomic;
+	}
+
+	/* destinations are either only written, only read, or both. */
+	char dst_read = !is_one_of(mn, "mov lea pop setz movnti"),
+		dst_write = !is_one_of(mn, "cmp test push call jmp je jne jb jae jbe ja jl jge jle jg int ret "
+			"idiv prefetchnta prefetcht0 prefetcht1 prefetcht2 prefetchw clflush clflushopt");
+
+	for (size_t i = 0; i < in->op_count && i < 2; i++)
+	{
+		char *text = in->op[i].op;
+		reg_t *r;
+
+		if (text[0] == '[')
+		{
+			/* the registers of the address are read either way. */
+			char *dup = strdup(text + 1);
+			for (char *it = strtok(dup, "+-*]"); it; it = strtok(0, "+-*]"))
+				if ((r = asm_find_reg(it)))
+					cost_dep(ci.read, &ci.read_count, r->val + 8 * r->extended);
+			free(dup);
+
+			ci.mem_read = form != COST_REG && (i == 1 || dst_read);
+			ci.mem_write = form != COST_REG && i == 0 && dst_write;
+		}
+		else if ((r = asm_find_reg(text)))
+		{
+			size_t res = r->val + 8 * r->extended;
+			if (i == 1 || dst_read)
+				cost_dep(ci.read, &ci.read_count, res);
+			if (i == 0 && dst_write || i == 1 && is_one_of(mn, "xchg xadd"))
+				cost_dep(ci.write, &ci.write_count, res);
+		}
+	}
+
+	/* implicit operands. */
+	if (is_one_of(mn, "idiv"))
+		cost_regs(&ci, "rax rdx", 0), cost_regs(&ci, "rax rdx", 1);
+	else if (is_one_of(mn, "cmpxchg"))
+		cost_regs(&ci, "rax", 0), cost_regs(&ci, "rax", 1);
+	else if (is_one_of(mn, "cmpxchg16b"))
+		cost_regs(&ci, "rax rdx rbx rcx", 0), cost_regs(&ci, "rax rdx", 1);
+	else if (is_one_of(mn, "rdtsc rdtscp"))
+		cost_regs(&ci, strcasecmp(mn, "rdtscp") == 0 ? "rax rdx rcx" : "rax rdx", 1);
+	else if (is_one_of(mn, "cpuid"))
+		cost_regs(&ci, "rax rcx", 0), cost_regs(&ci, "rax rbx rcx rdx", 1);
+	else if (is_one_of(mn, "syscall"))
+		cost_regs(&ci, "rax rdi rsi rdx r10 r8 r9", 0), cost_regs(&ci, "rax rcx r11", 1);
+	/* the callee is not analyzed, it clobbers the caller-saved registers. */
+	else if (is_one_of(mn, "call"))
+		cost_regs(&ci, "rax rcx rdx rsi rdi r8 r9 r10 r11", 1);
+
+	if (is_one_of(mn, "je jne jb jae jbe ja jl jge jle jg setz"))
+		cost_dep(ci.read, &ci.read_count, COST_FLAGS);
+	if (is_one_of(mn, "add sub inc dec imul idiv xor cmp test xadd cmpxchg cmpxchg16b"))
+		cost_dep(ci.write, &ci.write_count, COST_FLAGS);
+
+	/* zeroing idioms do not depend on the register. */
+	if (is_one_of(mn, "xor sub") && in->op_count == 2 && form == COST_REG
+		&& strcasecmp(in->op[0].op, in->op[1].op) == 0)
+	{
+		ci.read_count = 0;
+		ci.lat = 0;
+	}
+
+	/* a branch back to a label of this section closes a loop. */
+	symbol_t *sym = in->op_count == 1 && is_one_of(mn, "jmp je jne jb jae jbe ja jl jge jle jg") ?
+		asm_find_symbol(as, in->op[0].op) : 0;
+	as->cost = realloc(as->cost, ++as->cost_count * sizeof(cost_instr_t));
+	as->cost[as->cost_count - 1] = ci;
+
+	if (sym && sym->type != EXTERN && sym->section == ~0 && sym->addr <= ci.addr)
+	{
+		size_t first = as->cost_count - 1;
+		while (first > 0 && as->cost[first - 1].section == ci.section
+			&& as->cost[first - 1].addr >= sym->addr)
+			first--;
+
+		as->cost[as->cost_count - 1].loop = cost_loop(as->analyze, &as->cost[first],
+			as->cost_count - first, sym->name);
+	}
+}
+
+void asm_open_section(asm_t *as, char *name, size_t flags)
+{
+	as->section = name;
+	as->section_start = as->out_count;
+	as->section_reserved = 0;
+	as->section_flags = flags;
+}
+
+void asm_close_section(asm_t *as)
+{
+	if (!as->section)
+		return;
+
+	STATS_BEGIN(STATS_CLOSE);
+	if (as->cfi_open == CFI_EXPLICIT)
+	{
+		error_print("Missing .cfi_endproc before the end of section %s.\n", as->section);
+		error_exit();
+	}
+	else if (as->cfi_open == CFI_INFERRED)
+		asm_add_cfi(as, CFI_ENDPROC, as->out_count - as->section_start, 0, 0);
+	as->cfi_open = as->cfi_candidate = 0;
+
+	if (as->bench_open)
+	{
+		error_print("Missing bench_end before the end of section %s.\n", as->section);
+		error_exit();
+	}
+
+	for (size_t i = 0; i < as->sec_count; i++)
+		if (strcasecmp(as->sec[i].name, as->section) == 0)
+		{
+			error_print("Tried to close section %s which was already closed.\n", as->section);
+			error_exit();
+		}
+
+	if (as->section_flags & SEC_NOBITS && as->out_count != as->section_start)
+	{
+		error_print("Encountered initialized data in section %s.\n", as->section);
+		error_exit();
+	}
+
+	as->sec = realloc(as->sec, ++as->sec_count * sizeof(section_t));
+	as->sec[as->sec_count - 1] = (section_t)
+	{
+		.name = as->section,
+		.addr = as->section_start,
+		.size = as->out_count - as->section_start,
+		.reserved = as->section_reserved,
+		.flags = as->section_flags,
+		.entsize = as->section_flags & SEC_MERGE ? as->section_entsize : 0
+	};
+
+	asm_size_symbols(as);
+	asm_order_section(as);
+	as->patch_count = 0;
+
+	for (size_t i = 0; i < as->sym_count; i++)
+		if (as->sym[i].section == ~0)
+			as->sym[i].section = as->sec_count - 1;
+
+	for (size_t i = 0; i < as->rel_count; i++)
+		if (as->rel[i].section == ~0)
+			as->rel[i].section = as->sec_count - 1;
+
+	for (size_t i = 0; i < as->def_rel_count; i++)
+		if (as->def_rel[i].section == ~0)
+			as->def_rel[i].section = as->sec_count - 1;
+
+	for (size_t i = 0; i < as->dbg_count; i++)
+		if (as->dbg[i].section == ~0)
+			as->dbg[i].section = as->sec_count - 1;
+
+	for (size_t i = 0; i < as->cfi_count; i++)
+		if (as->cfi[i].section == ~0)
+			as->cfi[i].section = as->sec_count - 1;
+
+	as->section = 0;
+	as->section_start = 0;
+	as->section_reserved = 0;
+	as->section_flags = 0;
+	as->section_entsize = 0;
+	STATS_END(STATS_CLOSE);
+}
+
+void asm_size_symbols(asm_t *as)
+{
+	section_t *se = &as->sec[as->sec_count - 1];
+	size_t end = se->size + se->reserved, next = end, end_global = end,
+		next_global = end;
+
+	/*
+	 * labels of a section are defined in ascending order. a global label
+	 * extends up to the next global one, a local label up to the next label.
+	 */
+	for (size_t i = as->sym_count; i-- > 0;)
+	{
+		symbol_t *sy = &as->sym[i];
+		if (sy->section != ~0 || sy->type == EXTERN)
+			continue;
+
+		if (next > sy->addr)
+			end = next;
+		if (next_global > sy->addr)
+			end_global = next_global;
+
+		if (sy->size == 0)
+			sy->size = (sy->type == GLOBAL_LABEL ? end_global : end) - sy->addr;
+
+		next = sy->addr;
+		if (sy->type == GLOBAL_LABEL)
+			next_global = sy->addr;
+	}
+}
 
-		if (e == D)
-		{
-			imm -= as->out_count + op_size(op->op_1) + op_size(op->op_2);
-			o1->rel = 1;
-		}
+static int compare_chunk(const void *a, const void *b)
+{
+	const chunk_t *x = a, *y = b;
+	return x->rank < y->rank ? -1 : x->rank > y->rank;
+}
 
-		if (o1->sym && (o1->sym->type == EXTERN || e != D))
-		{
-			as->rel = realloc(as->rel, ++as->rel_count * sizeof(reloc_t));
-			as->rel[as->rel_count - 1] = (reloc_t)
-			{
-				.type = o1->rel ? RELATIVE : ABSOLUTE,
-				.sym = o1->sym - &as->sym[0],
-				.addr = as->out_count - as->section_start,
-				.add = o1->disp != ~0 ? o1->disp : 0
-			};
-			imm = 0;
-		}
+static size_t chunk_find(chunk_t *ch, size_t count, size_t addr)
+{
+	for (size_t i = 0; i < count; i++)
+		if (addr >= ch[i].start && addr < ch[i].end)
+			return i;
 
-		if (!o1->sym && o1->def_rel)
-		{
-			as->def_rel = realloc(as->def_rel, ++as->def_rel_count
-					* sizeof(def_reloc_t));
-			as->def_rel[as->def_rel_count - 1] = (def_reloc_t)
-			{
-				.type = o1->rel ? RELATIVE : ABSOLUTE,
-				.name = o1->op,
-				.addr = as->out_count - as->section_start,
-				.add = o1->disp != ~0 ? o1->disp : 0
-			};
-			imm = 0;
-		}
+	return count;
+}
 
-		asm_emit_imm(as, op->op_1, imm);
-	}
+static size_t chunk_map(chunk_t *ch, size_t count, size_t addr)
+{
+	size_t i = chunk_find(ch, count, addr);
+	return i < count ? addr - ch[i].start + ch[i].to : addr;
+}
 
-	if (IS_IMM(op->op_2))
+void asm_order_section(asm_t *as)
+{
+	section_t *se = &as->sec[as->sec_count - 1];
+	if (!as->order_count || !(se->flags & SEC_EXEC) || se->size == 0)
+		return;
+
+	/*
+	 * every global label starts a function, aliases share theirs. code in
+	 * front of the first one stays in place, the listed functions follow in
+	 * the given order and all others keep their order behind them.
+	 */
+	chunk_t *ch = 0;
+	size_t count = 0;
+	for (size_t i = 0; i < as->sym_count; i++)
 	{
-		imm = asm_decode_imm(as, 1, 0);
-		
-		if (o2->sym && (o2->sym->type == EXTERN || e != D))
+		symbol_t *sy = &as->sym[i];
+		if (sy->section != ~0 || sy->type != GLOBAL_LABEL || sy->addr >= se->size)
+			continue;
+
+		if (count == 0 || ch[count - 1].start != sy->addr)
 		{
-			as->rel = realloc(as->rel, ++as->rel_count * sizeof(reloc_t));
-			as->rel[as->rel_count - 1] = (reloc_t)
+			if (count == 0 && sy->addr > 0)
 			{
-				.type = o2->rel ? RELATIVE : ABSOLUTE,
-				.sym = o2->sym - &as->sym[0],
-				.addr = as->out_count - as->section_start,
-				.add = o2->disp != ~0 ? o2->disp : 0
-			};
-			imm = 0;
-		}
-		
-		if (!o2->sym && o2->def_rel)
-		{
-			as->def_rel = realloc(as->def_rel, ++as->def_rel_count
-					* sizeof(def_reloc_t));
-			as->def_rel[as->def_rel_count - 1] = (def_reloc_t)
+				ch = realloc(ch, ++count * sizeof(chunk_t));
+				ch[0] = (chunk_t) { .start = 0, .end = sy->addr, .rank = 0 };
+			}
+			else if (count > 0)
+				ch[count - 1].end = sy->addr;
+
+			ch = realloc(ch, ++count * sizeof(chunk_t));
+			ch[count - 1] = (chunk_t)
 			{
-				.type = o2->rel ? RELATIVE : ABSOLUTE,
-				.name = o2->op,
-				.addr = as->out_count - as->section_start,
-				.add = o2->disp != ~0 ? o2->disp : 0
+				.start = sy->addr,
+				.end = se->size,
+				.rank = 1 + as->order_count + count
 			};
-			imm = 0;
 		}
-		
-		asm_emit_imm(as, op->op_2, imm);
+
+		for (size_t j = 0; j < as->order_count; j++)
+			if (strcmp(as->order[j], sy->name) == 0 && j + 1 < ch[count - 1].rank)
+			{
+				ch[count - 1].rank = j + 1;
+				break;
+			}
 	}
 
-	if (op->op == RM)
+	if (count < 2)
 	{
-		dec_t tmp1 = as->cur.op[0];
-		as->cur.op[0] = as->cur.op[1];
-		as->cur.op[1] = tmp1;
-		size_t tmp2 = op->op_1;
-		op->op_1 = op->op_2;
-		op->op_2 = tmp2;
-		e = MR;
+		free(ch);
+		return;
 	}
-	
-	op->op_1 = op_1;
-	op->op_2 = op_2;
-	memset(&as->cur, 0, sizeof(instr_t));
-}
-
-char asm_consume_label(asm_t *as)
-{
-	size_t len = strlen(as->token);
-	enum symbol_type t = LABEL;
 
-	if (len < 2 || as->token[len - 1] != ':')
-		return 0;
-	
-	if (len > 2 && as->token[len - 2] == ':')
+	qsort(ch, count, sizeof(chunk_t), compare_chunk);
+	char *data = malloc(se->size);
+	for (size_t i = 0, to = 0; i < count; i++)
 	{
-		len--;
-		t = GLOBAL_LABEL;
+		ch[i].to = to;
+		memcpy(data + to, as->out + se->addr + ch[i].start, ch[i].end - ch[i].start);
+		to += ch[i].end - ch[i].start;
 	}
 
-	as->sym = realloc(as->sym, ++as->sym_count * sizeof(symbol_t));
-	symbol_t *sym = &as->sym[as->sym_count - 1];
-	sym->name = calloc(len + 1, 1);
-	strcpy(sym->name, as->token);
-	sym->name[len - 1] = '\0';
-	sym->addr = as->out_count - as->section_start;
-	sym->type = t;
-	sym->section = ~0;
-	return 1;
-}
+	memcpy(as->out + se->addr, data, se->size);
+	free(data);
 
-char asm_consume_extern(asm_t *as)
-{
-	if (as->ext == 1)
+	for (size_t i = 0; i < as->sym_count; i++)
+		if (as->sym[i].section == ~0 && as->sym[i].type != EXTERN)
+			as->sym[i].addr = chunk_map(ch, count, as->sym[i].addr);
+
+	for (size_t i = 0; i < as->rel_count; i++)
+		if (as->rel[i].section == ~0)
+			as->rel[i].addr = chunk_map(ch, count, as->rel[i].addr);
+
+	for (size_t i = 0; i < as->def_rel_count; i++)
+		if (as->def_rel[i].section == ~0)
+			as->def_rel[i].addr = chunk_map(ch, count, as->def_rel[i].addr);
+
+	/* branches resolved in place now point to where their target moved. */
+	for (size_t i = 0; i < as->patch_count; i++)
 	{
-		as->sym = realloc(as->sym, ++as->sym_count * sizeof(symbol_t));
+		reloc_t *p = &as->patch[i];
+		size_t addr = chunk_map(ch, count, p->addr);
+		long val = as->sym[p->sym].addr - (addr + p->add);
 
-		symbol_t *sym = &as->sym[as->sym_count - 1];
-		size_t len = strlen(as->token);
-		sym->type = EXTERN;
-		sym->name = calloc(len + 1, 1);
-		strcpy(sym->name, as->token);
-		sym->addr = 0;
-		sym->section = ~0;
-		
-		as->ext = 0;
-		return 1;
+		if (p->size < 8 && (val < -(1L << (p->size * 8 - 1))
+			|| val >= 1L << (p->size * 8 - 1)))
+		{
+			error_print("Branch to `%s` out of range after reordering.\n",
+				as->sym[p->sym].name);
+			error_exit();
+		}
+
+		for (size_t j = 0; j < p->size; j++)
+			as->out[se->addr + addr + j] = (val >> (j * 8)) & 0xFF;
 	}
 
-	if (strcmp(as->token, "extern") == 0)
+	/* the line program wants ascending addresses, entries move with their function. */
+	size_t first = as->dbg_count;
+	while (first > 0 && as->dbg[first - 1].section == ~0)
+		first--;
+
+	dbg_line_t *dbg = malloc((as->dbg_count - first) * sizeof(dbg_line_t));
+	size_t dbg_count = 0;
+	for (size_t i = 0; i <= count; i++)
+		for (size_t j = first; j < as->dbg_count; j++)
+			if (chunk_find(ch, count, as->dbg[j].addr) == i)
+			{
+				dbg[dbg_count] = as->dbg[j];
+				dbg[dbg_count++].addr = chunk_map(ch, count, as->dbg[j].addr);
+			}
+
+	memcpy(as->dbg + first, dbg, dbg_count * sizeof(dbg_line_t));
+	free(dbg);
+
+	/* a procedure ends where the next function starts, it moves with its start. */
+	for (size_t i = 0, cur = count; i < as->cfi_count; i++)
 	{
-		as->ext = 1;
-		return 1;
+		cfi_t *c = &as->cfi[i];
+		if (c->section != ~0)
+			continue;
+
+		if (c->type == CFI_STARTPROC)
+			cur = chunk_find(ch, count, c->addr);
+		if (cur < count)
+			c->addr = c->addr - ch[cur].start + ch[cur].to;
 	}
 
-	return 0;
+	free(ch);
 }
 
-void asm_close_section(asm_t *as)
+size_t asm_decode_section_flags(asm_t *as, const char *name, const char *flags)
 {
-	if (!as->section)
-		return;
+	size_t res = 0;
 
-	for (size_t i = 0; i < as->sec_count; i++)
-		if (strcasecmp(as->sec[i].name, as->section) == 0)
+	/* well-known sections do not need explicit flags. */
+	if (!flags)
+	{
+		if (strncmp(name, ".text", 5) == 0)
+			return SEC_ALLOC | SEC_EXEC;
+		else if (strncmp(name, ".data", 5) == 0)
+			return SEC_ALLOC | SEC_WRITE;
+		else if (strncmp(name, ".rodata.str", 11) == 0)
+			return SEC_ALLOC | SEC_MERGE | SEC_STRINGS;
+		else if (strncmp(name, ".rodata", 7) == 0)
+			return SEC_ALLOC;
+		else if (strncmp(name, ".bss", 4) == 0)
+			return SEC_ALLOC | SEC_WRITE | SEC_NOBITS;
+		else if (strncmp(name, ".tdata", 6) == 0)
+			return SEC_ALLOC | SEC_WRITE | SEC_TLS;
+		else if (strncmp(name, ".tbss", 5) == 0)
+			return SEC_ALLOC | SEC_WRITE | SEC_NOBITS | SEC_TLS;
+		return 0;
+	}
+
+	/*
+	 * a: allocated, w: writable, x: executable, b: zero-filled,
+	 * M: mergeable entries, S: null-terminated strings, T: thread-local
+	 */
+	for (const char *c = flags; *c; c++)
+		switch (*c)
 		{
-			printf("Tried to close section %s which was already closed.\n", as->section);
-			exit(1);
+		case 'a': res |= SEC_ALLOC; break;
+		case 'w': res |= SEC_WRITE; break;
+		case 'x': res |= SEC_EXEC; break;
+		case 'b': res |= SEC_NOBITS; break;
+		case 'M': res |= SEC_MERGE; break;
+		case 'S': res |= SEC_STRINGS; break;
+		case 'T': res |= SEC_TLS; break;
+		default:
+			error_print("Unknown flag `%c` for section %s.\n", *c, name);
+			error_exit();
 		}
-	
-	as->sec = realloc(as->sec, ++as->sec_count * sizeof(section_t));
-	as->sec[as->sec_count - 1] = (section_t)
-	{
-		.name = as->section,
-		.addr = as->section_start,
-		.size = as->out_count - as->section_start
-	};
 
-	for (size_t i = 0; i < as->sym_count; i++)
-		if (as->sym[i].section == ~0)
-			as->sym[i].section = as->sec_count - 1;
+	return res;
+}
 
+void asm_resolve_deferred(asm_t *as)
+{
 	for (size_t i = 0; i < as->def_rel_count; i++)
 	{
 		def_reloc_t *rel = &as->def_rel[i];
@@ -622,22 +1708,154 @@ void asm_close_section(asm_t *as)
 
 		if (!sym)
 		{
-			printf("Failed to lookup symbol in deferred relocation.\n");
-			exit(1);
+			error_print("Failed to lookup symbol `%s` in deferred relocation.\n",
+				rel->name);
+			error_exit();
 		}
 
 		as->rel = realloc(as->rel, ++as->rel_count * sizeof(reloc_t));
 		as->rel[as->rel_count - 1] = (reloc_t)
 		{
-			.type = rel->type,
+			.type = reloc_branch(rel->type, sym),
 			.sym = sym - &as->sym[0],
+			.section = rel->section,
 			.addr = rel->addr,
-			.add = rel->add
+			.add = rel->add,
+			.size = rel->size,
+			.sign = rel->sign
 		};
 	}
-	
-	as->section = 0;
-	as->section_start = 0;
+
+	as->def_rel_count = 0;
+}
+
+void asm_resolve_attributes(asm_t *as)
+{
+	/* attributes may be given before the symbol is defined. */
+	for (size_t i = 0; i < as->def_attr_count; i++)
+	{
+		def_attr_t *attr = &as->def_attr[i];
+		symbol_t *sym = asm_find_symbol(as, attr->name);
+
+		if (!sym)
+		{
+			error_print("Failed to lookup symbol `%s` for attribute.\n", attr->name);
+			error_exit();
+		}
+
+		if (sym->type == LABEL)
+		{
+			error_print("Attributes require a global label or extern, `%s` is local.\n",
+				attr->name);
+			error_exit();
+		}
+
+		sym->flags |= attr->flags;
+	}
+
+	as->def_attr_count = 0;
+}
+
+static size_t string_length(const char *s, size_t size, size_t entsize)
+{
+	/* length of the string at s including its terminator, or all remaining bytes. */
+	for (size_t i = 0; i + entsize <= size; i += entsize)
+	{
+		size_t j;
+		for (j = 0; j < entsize && !s[i + j]; j++);
+		if (j == entsize)
+			return i + entsize;
+	}
+
+	return size;
+}
+
+static size_t string_hash(const char *s, size_t len)
+{
+	/* FNV-1a */
+	size_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) s[i]) * 0x100000001b3;
+	return hash;
+}
+
+void asm_merge_strings(asm_t *as)
+{
+	for (size_t s = 0; s < as->sec_count; s++)
+	{
+		section_t *sec = &as->sec[s];
+		if ((sec->flags & (SEC_MERGE | SEC_STRINGS)) != (SEC_MERGE | SEC_STRINGS)
+			|| sec->size == 0)
+			continue;
+
+		/* maps every old offset in the section to its offset after merging. */
+		char *base = as->out + sec->addr;
+		size_t *map = calloc(sec->size + 1, sizeof(size_t)), count = 0;
+		for (size_t off = 0; off < sec->size; count++)
+			off += string_length(base + off, sec->size - off, sec->entsize);
+
+		/* open addressing table of the offsets of unique strings. */
+		size_t cap = 1, *table, kept = 0, len, h;
+		while (cap < count * 2)
+			cap <<= 1;
+		table = malloc(cap * sizeof(size_t));
+		memset(table, 0xFF, cap * sizeof(size_t));
+
+		for (size_t off = 0; off < sec->size; off += len)
+		{
+			len = string_length(base + off, sec->size - off, sec->entsize);
+			h = string_hash(base + off, len) & (cap - 1);
+
+			for (; table[h] != ~0; h = (h + 1) & (cap - 1))
+				if (string_length(base + table[h], kept - table[h], sec->entsize) == len
+					&& memcmp(base + table[h], base + off, len) == 0)
+					break;
+
+			if (table[h] == ~0)
+			{
+				memmove(base + kept, base + off, len);
+				table[h] = kept;
+				kept += len;
+			}
+
+			for (size_t i = 0; i < len; i++)
+				map[off + i] = table[h] + i;
+		}
+		map[sec->size] = kept;
+
+		/* relocations keep pointing at the same bytes, relative to their symbol. */
+		for (size_t i = 0; i < as->rel_count; i++)
+		{
+			reloc_t *rel = &as->rel[i];
+			symbol_t *sym = &as->sym[rel->sym];
+
+			if (rel->section == s)
+				rel->addr = map[rel->addr];
+
+			if (sym->type == EXTERN || sym->section != s
+				|| sym->addr + rel->add > sec->size)
+				continue;
+
+			rel->add = map[sym->addr + rel->add] - map[sym->addr];
+		}
+
+		for (size_t i = 0; i < as->sym_count; i++)
+			if (as->sym[i].type != EXTERN && as->sym[i].section == s)
+				as->sym[i].addr = map[as->sym[i].addr];
+
+		/* close the gap in the output and move all following sections. */
+		size_t removed = sec->size - kept;
+		memmove(base + kept, base + sec->size,
+			as->out_count - sec->addr - sec->size);
+		as->out_count -= removed;
+		sec->size = kept;
+		for (size_t i = 0; i < as->sec_count; i++)
+			if (as->sec[i].addr > sec->addr)
+				as->sec[i].addr -= removed;
+
+		free(table);
+		free(map);
+	}
 }
 
 static size_t unescape(char *s)
@@ -670,8 +1888,8 @@ static size_t unescape(char *s)
 		r++;
 		if (!*r)
 		{
-			printf("null escape sequence\n");
-			exit(1);
+			error_print("null escape sequence\n");
+			error_exit();
 		}
 		else if (escapes[(unsigned char)*r])
 			*w++ = escapes[(unsigned char)*r++];
@@ -693,8 +1911,8 @@ static size_t unescape(char *s)
 		}
 		else
 		{
-			printf("invalid escape sequence '\\%c'\n", *r);
-			exit(1);
+			error_print("invalid escape sequence '\\%c'\n", *r);
+			error_exit();
 		}
 	}
 
@@ -702,6 +1920,35 @@ static size_t unescape(char *s)
 	return w - s;
 }
 
+/* bytes are only sign-extended next to a wider operand, 0x80 to 0xFF fit otherwise. */
+static char asm_unsigned_byte(size_t form, size_t other, dec_t *dec)
+{
+	return form == IMM8 && dec->byte && !(other & (REG16 | REG32 | REG64));
+}
+
+/* whether a symbol's value picked the immediate size, which the line's text does not show. */
+static char asm_sized_by_symbol(asm_t *as, op_t *cur)
+{
+	for (size_t i = 0; i < as->cur.op_count && i < 2; i++)
+	{
+		dec_t *dec = &as->cur.op[i];
+		size_t form = i ? cur->op_2 : cur->op_1;
+
+		if (!IS_IMM(form) || dec->disp != ~0 || !dec->sym && !dec->def_rel)
+			continue;
+
+		for (size_t j = 0; j < sizeof(op) / sizeof(op_t); j++)
+		{
+			size_t other = i ? op[j].op_2 : op[j].op_1;
+			if (IS_IMM(other) && other != form
+				&& strcasecmp(op[j].mnemonic, cur->mnemonic) == 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 op_t* asm_match_op(asm_t *as)
 {
 	/* special case for string literals */
@@ -712,7 +1959,7 @@ op_t* asm_match_op(asm_t *as)
 	for (size_t i = 0; i < as->cur.op_count; i++)
 	{
 		dec = &as->cur.op[i];
-		dup = strdup(dec->op);
+		dup = asm_keep(as, strdup(dec->op));
 		dup_len = unescape(dup);
 
 		if (dup[0] == '\"')
@@ -720,12 +1967,12 @@ op_t* asm_match_op(asm_t *as)
 			for (size_t j = 1; j < dup_len - 1; j++)
 			{
 				dec->sub = realloc(dec->sub, ++dec->sub_count * sizeof(char*));
-				dec->sub[dec->sub_count - 1] = calloc(5, 1);
+				dec->sub[dec->sub_count - 1] = asm_keep(as, calloc(5, 1));
 				sprintf(dec->sub[dec->sub_count - 1], "0x%.2x", dup[j]);
 			}
 
 			dec->sub = realloc(dec->sub, ++dec->sub_count * sizeof(char*));
-			dec->sub[dec->sub_count - 1] = calloc(2, 1);
+			dec->sub[dec->sub_count - 1] = asm_keep(as, calloc(2, 1));
 			dec->sub[dec->sub_count - 1][0] = '0';
 		}
 		else if (dup[0] == '_' && dup[1] == '\"')
@@ -733,7 +1980,7 @@ op_t* asm_match_op(asm_t *as)
 			for (size_t j = 2; j < dup_len - 1; j++)
 			{
 				dec->sub = realloc(dec->sub, ++dec->sub_count * sizeof(char*));
-				dec->sub[dec->sub_count - 1] = calloc(5, 1);
+				dec->sub[dec->sub_count - 1] = asm_keep(as, calloc(5, 1));
 				sprintf(dec->sub[dec->sub_count - 1], "0x%.2x", dup[j]);
 			}
 		}
@@ -758,6 +2005,7 @@ scan_again:
 	for (size_t i = 0; i < sizeof(op) / sizeof(op_t); i++)
 	{
 		cur = &op[i];
+		STATS_INC(op_probes);
 
 		if (strcasecmp(cur->mnemonic, as->cur.mnemonic))
 			continue;
@@ -773,7 +2021,10 @@ scan_again:
 				}
 
 			if (!fail)
+			{
+				STATS_INSTR(i);
 				return cur;
+			}
 		}
 		
 		if (as->cur.op_count > 0)
@@ -781,12 +2032,22 @@ scan_again:
 			/* types matching? */
 			if ((IS_REG(cur->op_1) && cur->op_1 != ops[0])
 				|| (IS_IMM(cur->op_1) != IS_IMM(ops[0]))
-				|| (IS_IMM(cur->op_1) && cur->op_1 < ops[0]))
+				|| (IS_IMM(cur->op_1) && cur->op_1 < ops[0]
+					&& !asm_unsigned_byte(cur->op_1, cur->op_2, &as->cur.op[0])))
 				continue;
 
 			/* r/x matching? */
 			if (cur->op == MR && as->cur.op[1].disp != ~0)
 				continue;
+
+			/* memory operand required? */
+			if (cur->flags & MEM_ONLY && as->cur.op[0].disp == ~0)
+				continue;
+
+			/* references only fit into the ModR/M byte, immediates never. */
+			if (IS_IMM(cur->op_1) && cur->primary != EMPTY && (cur->op == M
+					|| cur->op == MR) != (as->cur.op[0].disp != ~0))
+				continue;
 		}
 
 		if (as->cur.op_count > 1)
@@ -794,14 +2055,22 @@ scan_again:
 			/* types matching? */
 			if ((IS_REG(cur->op_2) && cur->op_2 != ops[1])
 				|| (IS_IMM(cur->op_2) != IS_IMM(ops[1]))
-				|| (IS_IMM(cur->op_2) && cur->op_2 < ops[1]))
+				|| (IS_IMM(cur->op_2) && cur->op_2 < ops[1]
+					&& !asm_unsigned_byte(cur->op_2, cur->op_1, &as->cur.op[1])))
 				continue;
 			
 			/* r/x matching? */
 			if (cur->op == RM && as->cur.op[0].disp != ~0)
 				continue;
+
+			if (IS_IMM(cur->op_2) && (cur->op == RM) != (as->cur.op[1].disp != ~0))
+				continue;
 		}
+
+		if (asm_sized_by_symbol(as, cur))
+			as->line_cacheable = 0;
 		
+		STATS_INSTR(i);
 		return cur;
 	}
 
@@ -841,21 +2110,30 @@ size_t asm_resolve_op(asm_t *as, size_t i, size_t j)
 {
 	if (i >= as->cur.op_count)
 	{
-		printf("Attempted to resolve non-existing operand at index %d.\n", i);
-		exit(1);
+		error_print("Attempted to resolve non-existing operand at index %d.\n", i);
+		error_exit();
 	}
 
 	dec_t *dec = &as->cur.op[i];
 
 	if (j >= dec->sub_count)
 	{
-		printf("Attempted to resolve non-existing sub-operand of %d at index %d.\n", i, j);
-		exit(1);
+		error_print("Attempted to resolve non-existing sub-operand of %d at index %d.\n", i, j);
+		error_exit();
 	}
 
 	char *op = dec->sub[j], *sign, ref = 0;
 	size_t len = strlen(op);
 
+	/* segment overrides precede the memory operand. */
+	if (len > 5 && op[3] == '[' && (strncasecmp(op, "fs:", 3) == 0
+		|| strncasecmp(op, "gs:", 3) == 0))
+	{
+		dec->segment = op[0] == 'f' || op[0] == 'F' ? 0x64 : 0x65;
+		op += 3;
+		len -= 3;
+	}
+
 	if (len > 2 && op[0] == '[' && op[len - 1] == ']')
 	{
 		op[len - 1] = '\0';
@@ -879,6 +2157,25 @@ size_t asm_resolve_op(asm_t *as, size_t i, size_t j)
 		}
 	}
 
+	/* relocation specifiers follow the symbol name. */
+	char *at = strchr(op, '@');
+	if (at)
+	{
+		if (strcasecmp(at, "@gotpcrel") == 0 && ref)
+			dec->got = 1;
+		else if (strcasecmp(at, "@tpoff") == 0 && ref && dec->segment)
+			dec->tls = TLS_OFFSET;
+		else if (strcasecmp(at, "@gottpoff") == 0 && ref && !dec->segment)
+			dec->tls = TLS_GOT_RELATIVE;
+		else if (strcasecmp(at, "@plt") != 0)
+		{
+			error_print("Invalid relocation specifier `%s`.\n", at);
+			error_exit();
+		}
+
+		*at = '\0';
+	}
+
 	symbol_t *sym = asm_find_symbol(as, op);
 	if (sym)
 	{
@@ -886,7 +2183,9 @@ size_t asm_resolve_op(asm_t *as, size_t i, size_t j)
 		dec->sym = sym;
 		if (ref)
 			dec->rel = 1;
-		op = calloc(19, 1);
+		if (dec->tls)
+			sym->flags |= SYM_TLS;
+		op = asm_keep(as, calloc(19, 1));
 		sprintf(op, "0x%.16x", addr);
 	}
 
@@ -904,8 +2203,16 @@ size_t asm_resolve_op(asm_t *as, size_t i, size_t j)
 	char hex = op[0] == '0' && op[1] == 'x';
 	if (hex) op += 2;
 	long res = asm_decode_imm(as, i, j);
+	dec->byte = res >= 0x80 && res <= 0xFF;
 	if (!res && !sym && op[0] != '0')
 		dec->rel = dec->def_rel = 1;
+
+	/* offsets from the thread pointer and plain numbers are not relative to rip. */
+	if (ref && (dec->tls == TLS_OFFSET || !dec->rel))
+	{
+		dec->rel = 0;
+		dec->absolute = 1;
+	}
 	return imm_size(res);
 }
 
@@ -913,24 +2220,33 @@ reg_t* asm_decode_reg(asm_t *as, size_t i, size_t j)
 {
 	if (i >= as->cur.op_count)
 	{
-		printf("Attempted to decode non-existing register at index %d.\n", i);
-		exit(1);
+		error_print("Attempted to decode non-existing register at index %d.\n", i);
+		error_exit();
 	}
 
 	dec_t *dec = &as->cur.op[i];
 
 	if (j >= dec->sub_count)
 	{
-		printf("Attempted to decode non-existing sub-register of %d at index %d.\n", i, j);
-		exit(1);
+		error_print("Attempted to decode non-existing sub-register of %d at index %d.\n", i, j);
+		error_exit();
 	}
 
+	reg_t *r = asm_find_reg(dec->sub[j]);
+	if (r)
+		return r;
+
+	error_print("Unknown register `%s` to decode.", dec->sub[j]);
+	error_exit();
+	return 0;
+}
+
+reg_t* asm_find_reg(const char *name)
+{
 	for (size_t t = 0; t < sizeof(reg) / sizeof(reg_t); t++)
-		if (!strcasecmp(reg[t].mnemonic, dec->sub[j]))
+		if (!strcasecmp(reg[t].mnemonic, name))
 			return &reg[t];
 
-	printf("Unknown register `%s` to decode.", dec->sub[j]);
-	exit(1);
 	return 0;
 }
 
@@ -938,16 +2254,16 @@ long asm_decode_imm(asm_t *as, size_t i, size_t j)
 {
 	if (i >= as->cur.op_count)
 	{
-		printf("Attempted to decode non-existing immediate at index %d.\n", i);
-		exit(1);
+		error_print("Attempted to decode non-existing immediate at index %d.\n", i);
+		error_exit();
 	}
 
 	dec_t *dec = &as->cur.op[i];
 
 	if (j >= dec->sub_count)
 	{
-		printf("Attempted to decode non-existing sub-immediate of %d at index %d.\n", i, j);
-		exit(1);
+		error_print("Attempted to decode non-existing sub-immediate of %d at index %d.\n", i, j);
+		error_exit();
 	}
 
 	char *op = dec->sub[j];
@@ -961,8 +2277,8 @@ long asm_decode_imm(asm_t *as, size_t i, size_t j)
 	
 	if (res == UINTMAX_MAX && errno == ERANGE)
 	{
-		printf("Attempted to decode huge immediate value at index %d, %d.\n", i, j);
-		exit(1);
+		error_print("Attempted to decode huge immediate value at index %d, %d.\n", i, j);
+		error_exit();
 	}
 
 	return res;
@@ -974,6 +2290,13 @@ void asm_emit(asm_t *as, char byte)
 	as->out[as->out_count - 1] = byte;
 }
 
+void asm_emit_data(asm_t *as, const char *data, size_t size)
+{
+	as->out = realloc(as->out, as->out_count + size);
+	memcpy(as->out + as->out_count, data, size);
+	as->out_count += size;
+}
+
 void asm_emit_imm(asm_t *as, size_t op, size_t val)
 {
 	if (op & IMM8)
@@ -1003,6 +2326,20 @@ void asm_emit_imm(asm_t *as, size_t op, size_t val)
 	}
 }
 
+void asm_reserve(asm_t *as, size_t size)
+{
+	/* zero-fill sections only grow in size, they occupy no space in the output. */
+	if (as->section_flags & SEC_NOBITS)
+	{
+		as->section_reserved += size;
+		return;
+	}
+
+	as->out = realloc(as->out, as->out_count + size);
+	memset(as->out + as->out_count, 0, size);
+	as->out_count += size;
+}
+
 void asm_emit_current_labels(asm_t *as, char *line)
 {
 	char *org = strdup(line), *buf;
@@ -1028,6 +2365,8 @@ void asm_emit_current_labels(asm_t *as, char *line)
 	fclose(str);
 	as->last_sym_count = as->sym_count;
 	sprintf(line, "%-22s%s", buf, org);
+	free(buf);
+	free(org);
 }
 
 void asm_emit_current_hex(asm_t *as, char *line)
@@ -1050,14 +2389,45 @@ void asm_emit_current_hex(asm_t *as, char *line)
 	fclose(str);
 	as->last_out_count = as->out_count;
 	sprintf(line, "%-38s%-20s", buf, org);
+	free(buf);
+	free(org);
+}
+
+void asm_emit_current_cost(asm_t *as, char *line)
+{
+	char buf[256];
+	for (size_t i = as->last_cost_count; i < as->cost_count; i++)
+	{
+		cost_format(&as->cost[i], buf);
+		sprintf(line + strlen(line), "  %s", buf);
+	}
+}
+
+void asm_emit_current_loops(asm_t *as)
+{
+	for (size_t i = as->last_cost_count; i < as->cost_count && as->listing; i++)
+		for (char *it = as->cost[i].loop; it; it = strchr(it, '\n'))
+		{
+			it += *it == '\n';
+			fprintf(as->listing, "      %.*s\n", (int) strcspn(it, "\n"), it);
+		}
+
+	as->last_cost_count = as->cost_count;
 }
 
 symbol_t* asm_find_symbol(asm_t *as, const char *name)
 {
+	STATS_INC(sym_lookups);
 	for (size_t i = 0; i < as->sym_count; i++)
 		if (strcmp(as->sym[i].name, name) == 0)
+		{
+			STATS_ADD(sym_probes, i + 1);
+			STATS_MAX(sym_probe_max, i + 1);
 			return &as->sym[i];
+		}
 
+	STATS_ADD(sym_probes, as->sym_count);
+	STATS_MAX(sym_probe_max, as->sym_count);
 	return 0;
 }
 
@@ -1102,11 +2472,12 @@ char op_size(size_t op)
 
 size_t imm_size(long long op)
 {
-	if (op <= 0xFF)
+	/* short forms sign-extend their byte, 0x80 to 0xFF take a wider one. */
+	if (op >= -0x80 && op <= 0x7F)
 		return IMM8;
-	else if (op <= 0xFFFF)
+	else if (op >= -0x8000 && op <= 0xFFFF)
 		return IMM16;
-	else if (op <= 0xFFFFFFFF)
+	else if (op >= -0x80000000LL && op <= 0xFFFFFFFF)
 		return IMM32;
 	else if (op <= ~0ULL)
 		return IMM64;
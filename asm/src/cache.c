@@ -0,0 +1,321 @@
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+cache_t* cache_init()
+{
+	cache_t *cache = calloc(1, sizeof(cache_t));
+	cache->slot_count = 64;
+	cache->line = calloc(cache->slot_count, sizeof(cache_line_t));
+	return cache;
+}
+
+static char read_size(FILE *fp, size_t *val)
+{
+	uint64_t v;
+	if (fread(&v, sizeof(v), 1, fp) != 1)
+		return 0;
+	*val = v;
+	return 1;
+}
+
+static void write_size(FILE *fp, size_t val)
+{
+	uint64_t v = val;
+	fwrite(&v, sizeof(v), 1, fp);
+}
+
+static char read_line(FILE *fp, cache_t *cache)
+{
+	size_t hash, size, count, len;
+	if (!read_size(fp, &hash) || !read_size(fp, &len))
+		return 0;
+
+	char *str = calloc(len + 1, 1);
+	if (fread(str, 1, len, fp) != len || !read_size(fp, &size))
+	{
+		free(str);
+		return 0;
+	}
+
+	cache_line_t *cl = cache_add(cache, hash, str);
+	free(str);
+	cl->data = malloc(size);
+	cl->size = size;
+	if (fread(cl->data, 1, size, fp) != size || !read_size(fp, &count))
+		return 0;
+
+	cl->fix = calloc(count, sizeof(fixup_t));
+	for (; cl->fix_count < count; cl->fix_count++)
+	{
+		fixup_t *fix = &cl->fix[cl->fix_count];
+		if (!read_size(fp, &fix->type) || !read_size(fp, &fix->op)
+			|| !read_size(fp, &fix->offset) || !read_size(fp, &fix->add)
+			|| !read_size(fp, &fix->end) || fread(&fix->sign, 1, 1, fp) != 1
+			|| fread(&fix->branch, 1, 1, fp) != 1 || !read_size(fp, &len))
+			return 0;
+
+		fix->name = calloc(len + 1, 1);
+		if (fread(fix->name, 1, len, fp) != len)
+			return 0;
+	}
+
+	return 1;
+}
+
+cache_t* cache_load(const char *file)
+{
+	cache_t *cache = cache_init();
+	FILE *fp = fopen(file, "rb");
+	size_t magic, version, count;
+
+	/* a missing or stale cache just means every line is encoded again. */
+	if (!fp)
+		return cache;
+
+	if (!read_size(fp, &magic) || magic != CACHE_MAGIC
+		|| !read_size(fp, &version) || version != CACHE_VERSION
+		|| !read_size(fp, &count))
+	{
+		fclose(fp);
+		return cache;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		if (!read_line(fp, cache))
+		{
+			fclose(fp);
+			cache_free(cache);
+			return cache_init();
+		}
+
+	fclose(fp);
+	return cache;
+}
+
+void cache_save(cache_t *cache, const char *file)
+{
+	FILE *fp = fopen(file, "wb");
+	size_t count = 0;
+
+	if (!fp)
+	{
+		error_print("Failed to open cache file `%s`.\n", file);
+		error_exit();
+	}
+
+	/* lines no longer in the source are dropped. */
+	for (size_t i = 0; i < cache->slot_count; i++)
+		if (cache->line[i].hash && cache->line[i].used)
+			count++;
+
+	write_size(fp, CACHE_MAGIC);
+	write_size(fp, CACHE_VERSION);
+	write_size(fp, count);
+
+	for (size_t i = 0; i < cache->slot_count; i++)
+	{
+		cache_line_t *cl = &cache->line[i];
+		if (!cl->hash || !cl->used)
+			continue;
+
+		write_size(fp, cl->hash);
+		write_size(fp, strlen(cl->str));
+		fwrite(cl->str, 1, strlen(cl->str), fp);
+		write_size(fp, cl->size);
+		fwrite(cl->data, 1, cl->size, fp);
+		write_size(fp, cl->fix_count);
+
+		for (size_t j = 0; j < cl->fix_count; j++)
+		{
+			fixup_t *fix = &cl->fix[j];
+			size_t len = strlen(fix->name);
+			write_size(fp, fix->type);
+			write_size(fp, fix->op);
+			write_size(fp, fix->offset);
+			write_size(fp, fix->add);
+			write_size(fp, fix->end);
+			fwrite(&fix->sign, 1, 1, fp);
+			fwrite(&fix->branch, 1, 1, fp);
+			write_size(fp, len);
+			fwrite(fix->name, 1, len, fp);
+		}
+	}
+
+	fclose(fp);
+}
+
+void cache_free(cache_t *cache)
+{
+	for (size_t i = 0; i < cache->slot_count; i++)
+	{
+		cache_line_t *cl = &cache->line[i];
+		for (size_t j = 0; j < cl->fix_count; j++)
+			free(cl->fix[j].name);
+		free(cl->fix);
+		free(cl->data);
+		free(cl->str);
+	}
+
+	free(cache->line);
+	free(cache);
+}
+
+uint64_t cache_hash(const char *str)
+{
+	/* zero marks an empty slot. */
+	uint64_t h = cache_hash_data(CACHE_BASIS, str, strlen(str));
+	return h ? h : 1;
+}
+
+uint64_t cache_hash_data(uint64_t h, const void *data, size_t size)
+{
+	/* FNV-1a */
+	for (const unsigned char *c = data; size > 0; c++, size--)
+		h = (h ^ *c) * 0x100000001B3;
+	return h;
+}
+
+uint64_t cache_key(const char *src, size_t size, size_t flags)
+{
+	uint64_t h = CACHE_BASIS, version = CACHE_VERSION;
+	char buf[0x1000];
+	size_t n;
+
+	/* the assembler itself is part of the key, rebuilding it invalidates the cache. */
+	FILE *fp = fopen("/proc/self/exe", "rb");
+	if (fp)
+	{
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+			h = cache_hash_data(h, buf, n);
+		fclose(fp);
+	}
+
+	h = cache_hash_data(h, &version, sizeof(version));
+	h = cache_hash_data(h, &flags, sizeof(flags));
+
+	/* comments and surrounding blanks do not change the object, line numbers might. */
+	for (const char *end = src + size, *line = src; line < end;)
+	{
+		const char *next = memchr(line, '\n', end - line), *last;
+		next = next ? next : end;
+		last = memchr(line, '#', next - line);
+		last = last ? last : next;
+
+		while (line < last && (*line == ' ' || *line == '\t'))
+			line++;
+		while (last > line && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+			last--;
+
+		h = cache_hash_data(h, line, last - line);
+		h = cache_hash_data(h, "\n", 1);
+		line = next + 1;
+	}
+
+	return h;
+}
+
+static size_t cache_copy(const char *from, const char *to)
+{
+	int in = open(from, O_RDONLY), out;
+	struct stat st;
+	char buf[0x10000];
+	ssize_t n;
+
+	if (in < 0)
+		return 0;
+
+	if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || fstat(in, &st) != 0)
+	{
+		error_print("Failed to open output file `%s`.\n", to);
+		error_exit();
+	}
+
+	/* share the blocks where the file system allows, copy otherwise. */
+	if (ioctl(out, FICLONE, in) != 0)
+		while ((n = read(in, buf, sizeof(buf))) > 0)
+			if (write(out, buf, n) != n)
+			{
+				error_print("Failed to write output file `%s`.\n", to);
+				error_exit();
+			}
+
+	close(in);
+	close(out);
+	return st.st_size;
+}
+
+size_t cache_fetch(const char *dir, uint64_t key, const char *out)
+{
+	char *path = calloc(strlen(dir) + 20, 1);
+	sprintf(path, "%s/%016llx.o", dir, (unsigned long long) key);
+	size_t size = cache_copy(path, out);
+	free(path);
+	return size;
+}
+
+void cache_store(const char *dir, uint64_t key, const char *out)
+{
+	char *path = calloc(strlen(dir) + 20, 1), *tmp = calloc(strlen(dir) + 40, 1);
+	sprintf(path, "%s/%016llx.o", dir, (unsigned long long) key);
+	sprintf(tmp, "%s.%d", path, getpid());
+	mkdir(dir, 0755);
+
+	/* concurrent jobs either see the whole object or none. */
+	if (cache_copy(out, tmp) == 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+
+	free(path);
+	free(tmp);
+}
+
+cache_line_t* cache_find(cache_t *cache, uint64_t hash, const char *str)
+{
+	/* lines with colliding hashes are told apart by their text. */
+	size_t mask = cache->slot_count - 1;
+	for (size_t i = hash & mask; cache->line[i].hash; i = (i + 1) & mask)
+		if (cache->line[i].hash == hash && strcmp(cache->line[i].str, str) == 0)
+			return &cache->line[i];
+
+	return 0;
+}
+
+cache_line_t* cache_add(cache_t *cache, uint64_t hash, const char *str)
+{
+	/* keep the table at most half full, so probes stay short. */
+	if (2 * (cache->line_count + 1) > cache->slot_count)
+	{
+		cache_line_t *old = cache->line;
+		size_t old_count = cache->slot_count;
+		cache->slot_count *= 2;
+		cache->line = calloc(cache->slot_count, sizeof(cache_line_t));
+		size_t mask = cache->slot_count - 1;
+
+		for (size_t i = 0; i < old_count; i++)
+			if (old[i].hash)
+			{
+				size_t j = old[i].hash & mask;
+				while (cache->line[j].hash)
+					j = (j + 1) & mask;
+				cache->line[j] = old[i];
+			}
+		free(old);
+	}
+
+	cache_line_t *cl = cache_find(cache, hash, str);
+	if (cl)
+		return cl;
+
+	size_t mask = cache->slot_count - 1, i = hash & mask;
+	while (cache->line[i].hash)
+		i = (i + 1) & mask;
+
+	cache->line_count++;
+	cache->line[i] = (cache_line_t) { .hash = hash, .str = strdup(str) };
+	return &cache->line[i];
+}
@@ -0,0 +1,313 @@
+#include "cost.h"
+#include <string.h>
+#include <strings.h>
+
+/*
+ * latencies, reciprocal throughputs and ports follow the published measurements
+ * (uops.info, agner fog) closely enough for estimates, not for exact figures.
+ * memory forms use simple addressing, stores count until the data can be forwarded.
+ */
+
+/* skylake: alu on 0, 1, 5 and 6, loads on 2 and 3, store data on 4 and its address on 2, 3 and 7. */
+static cost_t skylake[] =
+{
+	{ "lea", COST_REG, 1, 0.5, "15" },
+	{ "mov", COST_REG, 1, 0.25, "0156" },
+	{ "mov", COST_LOAD, 5, 0.5, "23" },
+	{ "mov", COST_STORE, 0, 1, "237 4" },
+	{ "push", COST_REG, 0, 1, "237 4" },
+	{ "pop", COST_REG, 5, 0.5, "23" },
+	{ "add", COST_REG, 1, 0.25, "0156" },
+	{ "add", COST_LOAD, 6, 0.5, "0156 23" },
+	{ "add", COST_STORE, 6, 1, "0156 23 237 4" },
+	{ "sub", COST_REG, 1, 0.25, "0156" },
+	{ "sub", COST_LOAD, 6, 0.5, "0156 23" },
+	{ "sub", COST_STORE, 6, 1, "0156 23 237 4" },
+	{ "inc", COST_REG, 1, 0.25, "0156" },
+	{ "inc", COST_STORE, 6, 1, "0156 23 237 4" },
+	{ "dec", COST_REG, 1, 0.25, "0156" },
+	{ "dec", COST_STORE, 6, 1, "0156 23 237 4" },
+	{ "imul", COST_REG, 3, 1, "1" },
+	{ "imul", COST_LOAD, 8, 1, "1 23" },
+	{ "idiv", COST_REG, 42, 24, "0 1 5 6 0156 0156 0156 0156 0156 0156" },
+	{ "idiv", COST_STORE, 46, 24, "0 1 5 6 0156 0156 0156 0156 0156 0156 23" },
+	{ "xor", COST_REG, 1, 0.25, "0156" },
+	{ "xor", COST_STORE, 6, 1, "0156 23 237 4" },
+	{ "cmp", COST_REG, 1, 0.25, "0156" },
+	{ "cmp", COST_STORE, 6, 0.5, "0156 23" },
+	{ "test", COST_REG, 1, 0.25, "0156" },
+	{ "test", COST_STORE, 6, 0.5, "0156 23" },
+	{ "setz", COST_REG, 1, 0.5, "06" },
+	{ "setz", COST_STORE, 0, 1, "06 237 4" },
+	{ "jmp", COST_REG, 0, 1, "6" },
+	{ "je", COST_REG, 0, 0.5, "06" },
+	{ "jne", COST_REG, 0, 0.5, "06" },
+	{ "jb", COST_REG, 0, 0.5, "06" },
+	{ "jae", COST_REG, 0, 0.5, "06" },
+	{ "jbe", COST_REG, 0, 0.5, "06" },
+	{ "ja", COST_REG, 0, 0.5, "06" },
+	{ "jl", COST_REG, 0, 0.5, "06" },
+	{ "jge", COST_REG, 0, 0.5, "06" },
+	{ "jle", COST_REG, 0, 0.5, "06" },
+	{ "jg", COST_REG, 0, 0.5, "06" },
+	{ "xchg", COST_REG, 2, 1, "0156 0156 0156" },
+	{ "xchg", COST_STORE, 21, 20, "0156 0156 0156 0156 23 237 4 0156" },
+	{ "xadd", COST_REG, 2, 0.75, "0156 0156 0156" },
+	{ "xadd", COST_STORE, 6, 1.25, "0156 0156 0156 23 237 4" },
+	{ "cmpxchg", COST_REG, 2, 0.75, "0156 0156 06 0156" },
+	{ "cmpxchg", COST_STORE, 8, 1.5, "0156 0156 06 0156 23 237 4" },
+	{ "cmpxchg16b", COST_STORE, 26, 25, "0156 0156 0156 0156 0156 0156 0156 0156 23 237 4" },
+	{ "pause", COST_REG, 140, 140, "0156 0156 0156 0156" },
+	{ "mfence", COST_REG, 33, 33, "23 4 0156" },
+	{ "lfence", COST_REG, 4, 4, "0156 0156" },
+	{ "sfence", COST_REG, 6, 6, "237 4" },
+	{ "prefetchnta", COST_STORE, 0, 0.5, "23" },
+	{ "prefetcht0", COST_STORE, 0, 0.5, "23" },
+	{ "prefetcht1", COST_STORE, 0, 0.5, "23" },
+	{ "prefetcht2", COST_STORE, 0, 0.5, "23" },
+	{ "prefetchw", COST_STORE, 0, 0.5, "23" },
+	{ "movnti", COST_STORE, 0, 1, "237 4" },
+	{ "clflush", COST_STORE, 0, 3, "237 4 0156 0156" },
+	{ "clflushopt", COST_STORE, 0, 3, "237 4 0156 0156" },
+	{ "rdtsc", COST_REG, 25, 25, "0156 0156 0156 0156 0156 0156 0156 0156" },
+	{ "rdtscp", COST_REG, 32, 32, "0156 0156 0156 0156 0156 0156 0156 0156 0156" },
+	{ "cpuid", COST_REG, 100, 100, "0156 0156 0156 0156 0156 0156 0156 0156" },
+	{ "int", COST_REG, 100, 100, "0156 0156 0156 0156" },
+	{ "syscall", COST_REG, 100, 100, "0156 0156 0156 0156" },
+	{ "call", COST_REG, 0, 1, "237 4 6" },
+	{ "call", COST_STORE, 0, 1, "23 237 4 6" },
+	{ "ret", COST_REG, 0, 1, "23 6" }
+};
+
+/* zen 2: alu on 0 to 3 (branches on 0 and 3, multiplies on 1), loads on 4 and 5, stores on 6. */
+static cost_t zen2[] =
+{
+	{ "lea", COST_REG, 1, 0.25, "0123" },
+	{ "mov", COST_REG, 1, 0.25, "0123" },
+	{ "mov", COST_LOAD, 4, 0.5, "45" },
+	{ "mov", COST_STORE, 0, 1, "6" },
+	{ "push", COST_REG, 0, 1, "6" },
+	{ "pop", COST_REG, 4, 0.5, "45" },
+	{ "add", COST_REG, 1, 0.25, "0123" },
+	{ "add", COST_LOAD, 5, 0.5, "0123 45" },
+	{ "add", COST_STORE, 7, 1, "0123 45 6" },
+	{ "sub", COST_REG, 1, 0.25, "0123" },
+	{ "sub", COST_LOAD, 5, 0.5, "0123 45" },
+	{ "sub", COST_STORE, 7, 1, "0123 45 6" },
+	{ "inc", COST_REG, 1, 0.25, "0123" },
+	{ "inc", COST_STORE, 7, 1, "0123 45 6" },
+	{ "dec", COST_REG, 1, 0.25, "0123" },
+	{ "dec", COST_STORE, 7, 1, "0123 45 6" },
+	{ "imul", COST_REG, 3, 1, "1" },
+	{ "imul", COST_LOAD, 7, 1, "1 45" },
+	{ "idiv", COST_REG, 45, 45, "0123 0123" },
+	{ "idiv", COST_STORE, 49, 45, "0123 0123 45" },
+	{ "xor", COST_REG, 1, 0.25, "0123" },
+	{ "xor", COST_STORE, 7, 1, "0123 45 6" },
+	{ "cmp", COST_REG, 1, 0.25, "0123" },
+	{ "cmp", COST_STORE, 5, 0.5, "0123 45" },
+	{ "test", COST_REG, 1, 0.25, "0123" },
+	{ "test", COST_STORE, 5, 0.5, "0123 45" },
+	{ "setz", COST_REG, 1, 0.25, "0123" },
+	{ "setz", COST_STORE, 0, 1, "0123 6" },
+	{ "jmp", COST_REG, 0, 0.5, "03" },
+	{ "je", COST_REG, 0, 0.5, "03" },
+	{ "jne", COST_REG, 0, 0.5, "03" },
+	{ "jb", COST_REG, 0, 0.5, "03" },
+	{ "jae", COST_REG, 0, 0.5, "03" },
+	{ "jbe", COST_REG, 0, 0.5, "03" },
+	{ "ja", COST_REG, 0, 0.5, "03" },
+	{ "jl", COST_REG, 0, 0.5, "03" },
+	{ "jge", COST_REG, 0, 0.5, "03" },
+	{ "jle", COST_REG, 0, 0.5, "03" },
+	{ "jg", COST_REG, 0, 0.5, "03" },
+	{ "xchg", COST_REG, 1, 1, "0123 0123" },
+	{ "xchg", COST_STORE, 8, 8, "0123 0123 45 6" },
+	{ "xadd", COST_REG, 1, 0.5, "0123 0123" },
+	{ "xadd", COST_STORE, 8, 1, "0123 0123 45 6" },
+	{ "cmpxchg", COST_REG, 1, 0.5, "0123 0123" },
+	{ "cmpxchg", COST_STORE, 8, 1, "0123 0123 45 6" },
+	{ "cmpxchg16b", COST_STORE, 10, 10, "0123 0123 0123 0123 45 45 6 6" },
+	{ "pause", COST_REG, 65, 65, "0123" },
+	{ "mfence", COST_REG, 38, 38, "45 6 0123" },
+	{ "lfence", COST_REG, 1, 1, "0123" },
+	{ "sfence", COST_REG, 1, 1, "6" },
+	{ "prefetchnta", COST_STORE, 0, 0.5, "45" },
+	{ "prefetcht0", COST_STORE, 0, 0.5, "45" },
+	{ "prefetcht1", COST_STORE, 0, 0.5, "45" },
+	{ "prefetcht2", COST_STORE, 0, 0.5, "45" },
+	{ "prefetchw", COST_STORE, 0, 0.5, "45" },
+	{ "movnti", COST_STORE, 0, 1, "6" },
+	{ "clflush", COST_STORE, 0, 4, "6 0123" },
+	{ "clflushopt", COST_STORE, 0, 4, "6 0123" },
+	{ "rdtsc", COST_REG, 36, 36, "0123 0123 0123 0123" },
+	{ "rdtscp", COST_REG, 64, 64, "0123 0123 0123 0123" },
+	{ "cpuid", COST_REG, 100, 100, "0123 0123 0123 0123" },
+	{ "int", COST_REG, 100, 100, "0123 0123 0123 0123" },
+	{ "syscall", COST_REG, 100, 100, "0123 0123 0123 0123" },
+	{ "call", COST_REG, 0, 0.5, "6 03" },
+	{ "call", COST_STORE, 0, 1, "45 6 03" },
+	{ "ret", COST_REG, 0, 0.5, "45 03" }
+};
+
+static uarch_t uarch[] =
+{
+	{ "skylake", 4, 8, 18, skylake, sizeof(skylake) / sizeof(cost_t) },
+	{ "zen2", 5, 7, 8, zen2, sizeof(zen2) / sizeof(cost_t) }
+};
+
+const uarch_t* cost_find_uarch(const char *name)
+{
+	for (size_t i = 0; i < sizeof(uarch) / sizeof(uarch_t); i++)
+		if (strcasecmp(uarch[i].name, name) == 0)
+			return &uarch[i];
+
+	return 0;
+}
+
+const cost_t* cost_lookup(const uarch_t *ua, const char *mnemonic, char form)
+{
+	/* loads with a memory destination are listed as such, e.g. `cmp [rbx], 2`. */
+	for (size_t i = 0; i < ua->cost_count; i++)
+		if (ua->cost[i].form == form && strcasecmp(ua->cost[i].mnemonic, mnemonic) == 0)
+			return &ua->cost[i];
+
+	return 0;
+}
+
+void cost_format(const cost_instr_t *ci, char *buf)
+{
+	if (!ci->cost)
+	{
+		sprintf(buf, "# no cost data");
+		return;
+	}
+
+	buf += sprintf(buf, "# lat %-3zu rthru %-6.2f", ci->lat, ci->rthru);
+
+	/* `0156 23` is listed as p0156 p23. */
+	for (const char *u = ci->cost->uops; *u; u += strcspn(u, " "), u += strspn(u, " "))
+		buf += sprintf(buf, " p%.*s", (int) strcspn(u, " "), u);
+}
+
+static size_t uop_count(const cost_instr_t *ci, double *pressure)
+{
+	if (!ci->cost)
+		return 1;
+
+	size_t count = 0;
+	for (const char *u = ci->cost->uops; *u; count++)
+	{
+		size_t len = strcspn(u, " ");
+		for (size_t i = 0; i < len; i++)
+			pressure[u[i] - '0'] += 1.0 / len;
+		u += len;
+		u += strspn(u, " ");
+	}
+
+	return count;
+}
+
+char* cost_loop(const uarch_t *ua, const cost_instr_t *body, size_t count, const char *name)
+{
+	double pressure[10] = { 0 }, ports = 0, front, rthru = 0, chain = 0;
+	size_t uops = 0, port = 0, via = 0, *mem = calloc(count, sizeof(size_t));
+
+	/* every port takes an equal share of the uops that may issue to it. */
+	for (size_t i = 0; i < count; i++)
+		uops += uop_count(&body[i], pressure);
+
+	for (size_t i = 0; i < ua->ports; i++)
+		if (pressure[i] > ports)
+		{
+			ports = pressure[i];
+			port = i;
+		}
+
+	front = (double) uops / ua->width;
+
+	/* instructions that are not fully pipelined bound the loop on their own. */
+	for (size_t i = 0; i < count; i++)
+	{
+		double sum = 0;
+		for (size_t j = 0; j < count; j++)
+			if (body[j].cost == body[i].cost)
+				sum += body[j].rthru;
+		if (body[i].cost && sum > rthru)
+			rthru = sum;
+	}
+
+	/* memory operands with the same text are assumed to alias, others not to. */
+	for (size_t i = 0; i < count; i++)
+	{
+		mem[i] = COST_MEM + i;
+		for (size_t j = 0; j < i; j++)
+			if (body[i].mem && body[j].mem && strcmp(body[i].mem, body[j].mem) == 0)
+				mem[i] = mem[j];
+	}
+
+	/*
+	 * run the body with unlimited resources, the loop-carried chain is what the
+	 * finishing times grow by per iteration, once the first iterations are done.
+	 */
+	size_t res = COST_MEM + count;
+	double *ready = calloc(res, sizeof(double)), *half = calloc(res, sizeof(double));
+	for (size_t it = 0; it < 16; it++)
+	{
+		if (it == 8)
+			memcpy(half, ready, res * sizeof(double));
+
+		for (size_t i = 0; i < count; i++)
+		{
+			const cost_instr_t *ci = &body[i];
+			double start = 0;
+
+			for (size_t j = 0; j < ci->read_count; j++)
+				start = ready[ci->read[j]] > start ? ready[ci->read[j]] : start;
+			if (ci->mem_read && ready[mem[i]] > start)
+				start = ready[mem[i]];
+
+			for (size_t j = 0; j < ci->write_count; j++)
+				ready[ci->write[j]] = start + ci->lat;
+			if (ci->mem_write)
+				ready[mem[i]] = start + ci->lat;
+		}
+	}
+
+	for (size_t i = 0; i < res; i++)
+		if ((ready[i] - half[i]) / 8 > chain)
+		{
+			chain = (ready[i] - half[i]) / 8;
+			via = i;
+		}
+
+	static const char *regs[] =
+	{
+		"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "flags"
+	};
+
+	double bound = front;
+	bound = ports > bound ? ports : bound;
+	bound = rthru > bound ? rthru : bound;
+	bound = chain > bound ? chain : bound;
+
+	char *report, via_name[64] = "none";
+	if (chain > 0 && via < COST_MEM)
+		sprintf(via_name, "%s", regs[via]);
+	else if (chain > 0)
+		snprintf(via_name, sizeof(via_name), "%s", body[via - COST_MEM].mem);
+
+	size_t len;
+	FILE *str = open_memstream(&report, &len);
+	fprintf(str, "# loop `%s` on %s: %zu instructions, %zu uops\n", name, ua->name, count, uops);
+	fprintf(str, "#   front-end %.2f, port p%zu %.2f, throughput %.2f, chain %.2f via %s\n",
+		front, port, ports, rthru, chain, via_name);
+	fprintf(str, "#   at least %.2f cycles per iteration", bound);
+	fclose(str);
+
+	free(ready);
+	free(half);
+	free(mem);
+	return report;
+}
@@ -0,0 +1,335 @@
+#include "dwarf.h"
+#include <string.h>
+
+static void dwarf_put(dwarf_section_t *sec, const void *data, size_t size)
+{
+	sec->data = realloc(sec->data, sec->size + size);
+	memcpy(sec->data + sec->size, data, size);
+	sec->size += size;
+}
+
+static void dwarf_byte(dwarf_section_t *sec, char byte)
+{
+	dwarf_put(sec, &byte, 1);
+}
+
+static void dwarf_uleb(dwarf_section_t *sec, size_t val)
+{
+	do
+	{
+		char byte = val & 0x7F;
+		val >>= 7;
+		dwarf_byte(sec, val ? byte | 0x80 : byte);
+	} while (val);
+}
+
+static void dwarf_sleb(dwarf_section_t *sec, long val)
+{
+	char more = 1;
+	while (more)
+	{
+		char byte = val & 0x7F;
+		val >>= 7;
+		more = !(val == 0 && !(byte & 0x40) || val == -1 && (byte & 0x40));
+		dwarf_byte(sec, more ? byte | 0x80 : byte);
+	}
+}
+
+static void dwarf_rel(dwarf_section_t *sec, size_t section, size_t add, char size, char pcrel)
+{
+	/* the field itself stays zero, the addend lives in the relocation. */
+	sec->rel = realloc(sec->rel, ++sec->rel_count * sizeof(dwarf_rel_t));
+	sec->rel[sec->rel_count - 1] = (dwarf_rel_t)
+	{
+		.offset = sec->size,
+		.section = section,
+		.add = add,
+		.size = size,
+		.pcrel = pcrel
+	};
+
+	size_t zero = 0;
+	dwarf_put(sec, &zero, size);
+}
+
+static void dwarf_patch(dwarf_section_t *sec, size_t offset, uint32_t val)
+{
+	memcpy(sec->data + offset, &val, sizeof(val));
+}
+
+void dwarf_build_line(dwarf_t *dw, asm_t *as, size_t first)
+{
+	dwarf_section_t *line = &dw->sec[DWARF_LINE];
+	const char lengths[] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+	uint16_t version = DWARF_VERSION;
+	uint32_t length = 0;
+
+	dwarf_put(line, &length, sizeof(length));
+	dwarf_put(line, &version, sizeof(version));
+	dwarf_put(line, &length, sizeof(length));
+
+	size_t header = line->size;
+	dwarf_byte(line, 1);
+	dwarf_byte(line, 1);
+	dwarf_byte(line, 1);
+	dwarf_byte(line, DWARF_LINE_BASE);
+	dwarf_byte(line, DWARF_LINE_RANGE);
+	dwarf_byte(line, DWARF_OPCODE_BASE);
+	dwarf_put(line, lengths, sizeof(lengths));
+
+	/* no include directories, the file is relative to the compilation directory. */
+	dwarf_byte(line, 0);
+	dwarf_put(line, as->file, strlen(as->file) + 1);
+	dwarf_uleb(line, 0);
+	dwarf_uleb(line, 0);
+	dwarf_uleb(line, 0);
+	dwarf_byte(line, 0);
+	dwarf_patch(line, header - sizeof(uint32_t), line->size - header);
+
+	/* one sequence per section, rows follow the lines in ascending order. */
+	for (size_t i = 0, j; i < as->dbg_count; i = j)
+	{
+		size_t section = as->dbg[i].section, addr = 0, loc = 1;
+
+		dwarf_byte(line, 0);
+		dwarf_uleb(line, 9);
+		dwarf_byte(line, DW_LNE_set_address);
+		dwarf_rel(line, first + section, 0, 8, 0);
+
+		for (j = i; j < as->dbg_count && as->dbg[j].section == section; j++)
+		{
+			long dl = as->dbg[j].loc + 1 - loc;
+			size_t da = as->dbg[j].addr - addr, op;
+
+			if (dl < DWARF_LINE_BASE || dl >= DWARF_LINE_BASE + DWARF_LINE_RANGE)
+			{
+				dwarf_byte(line, DW_LNS_advance_line);
+				dwarf_sleb(line, dl);
+				dl = 0;
+			}
+
+			/* special opcodes advance both and append a row in a single byte. */
+			op = dl - DWARF_LINE_BASE + DWARF_LINE_RANGE * da + DWARF_OPCODE_BASE;
+			if (op > 255)
+			{
+				dwarf_byte(line, DW_LNS_advance_pc);
+				dwarf_uleb(line, da);
+				op = dl - DWARF_LINE_BASE + DWARF_OPCODE_BASE;
+			}
+
+			dwarf_byte(line, op);
+			addr = as->dbg[j].addr;
+			loc = as->dbg[j].loc + 1;
+		}
+
+		dwarf_byte(line, DW_LNS_advance_pc);
+		dwarf_uleb(line, as->sec[section].size - addr);
+		dwarf_byte(line, 0);
+		dwarf_uleb(line, 1);
+		dwarf_byte(line, DW_LNE_end_sequence);
+	}
+
+	dwarf_patch(line, 0, line->size - sizeof(uint32_t));
+}
+
+dwarf_t* dwarf_init(asm_t *as)
+{
+	if (as->dbg_count == 0 && as->cfi_count == 0)
+		return 0;
+
+	dwarf_t *dw = calloc(1, sizeof(dwarf_t));
+	dw->sec[DWARF_ABBREV] = (dwarf_section_t) { ".debug_abbrev", SHT_PROGBITS, 0, 1 };
+	dw->sec[DWARF_INFO] = (dwarf_section_t) { ".debug_info", SHT_PROGBITS, 0, 1 };
+	dw->sec[DWARF_LINE] = (dwarf_section_t) { ".debug_line", SHT_PROGBITS, 0, 1 };
+	dw->sec[DWARF_RANGES] = (dwarf_section_t) { ".debug_ranges", SHT_PROGBITS, 0, 1 };
+	dw->sec[DWARF_FRAME] = (dwarf_section_t) { ".eh_frame", SHT_X86_64_UNWIND, SHF_ALLOC, 8 };
+
+	for (size_t i = 0; i < DWARF_COUNT; i++)
+		dw->sec[i].present = i == DWARF_FRAME ? as->cfi_count > 0 : as->dbg_count > 0;
+	return dw;
+}
+
+void dwarf_build(dwarf_t *dw, asm_t *as, const char *comp_dir, size_t first)
+{
+	if (as->dbg_count > 0)
+	{
+		dwarf_build_info(dw, as, comp_dir, first);
+		dwarf_build_line(dw, as, first);
+	}
+
+	if (as->cfi_count > 0)
+		dwarf_build_frame(dw, as, first);
+}
+
+void dwarf_build_info(dwarf_t *dw, asm_t *as, const char *comp_dir, size_t first)
+{
+	dwarf_section_t *abbrev = &dw->sec[DWARF_ABBREV], *info = &dw->sec[DWARF_INFO],
+		*ranges = &dw->sec[DWARF_RANGES];
+	const char attrs[] =
+	{
+		DW_AT_stmt_list, DW_FORM_sec_offset,
+		DW_AT_low_pc, DW_FORM_addr,
+		DW_AT_ranges, DW_FORM_sec_offset,
+		DW_AT_name, DW_FORM_string,
+		DW_AT_comp_dir, DW_FORM_string,
+		DW_AT_producer, DW_FORM_string,
+		DW_AT_language, DW_FORM_data2,
+		0, 0
+	};
+	uint16_t version = DWARF_VERSION, language = DW_LANG_Mips_Assembler;
+	uint32_t length = 0;
+	size_t zero = 0;
+
+	/* a single compilation unit without children describes the whole file. */
+	dwarf_uleb(abbrev, 1);
+	dwarf_uleb(abbrev, DW_TAG_compile_unit);
+	dwarf_byte(abbrev, DW_CHILDREN_no);
+	dwarf_put(abbrev, attrs, sizeof(attrs));
+	dwarf_byte(abbrev, 0);
+
+	dwarf_put(info, &length, sizeof(length));
+	dwarf_put(info, &version, sizeof(version));
+	dwarf_rel(info, dw->index[DWARF_ABBREV], 0, 4, 0);
+	dwarf_byte(info, sizeof(size_t));
+	dwarf_uleb(info, 1);
+	dwarf_rel(info, dw->index[DWARF_LINE], 0, 4, 0);
+	dwarf_put(info, &zero, sizeof(zero));
+	dwarf_rel(info, dw->index[DWARF_RANGES], 0, 4, 0);
+	dwarf_put(info, as->file, strlen(as->file) + 1);
+	dwarf_put(info, comp_dir, strlen(comp_dir) + 1);
+	dwarf_put(info, "asm", 4);
+	dwarf_put(info, &language, sizeof(language));
+	dwarf_patch(info, 0, info->size - sizeof(uint32_t));
+
+	/* the code may be spread over several sections, each gets a range. */
+	for (size_t i = 0; i < as->dbg_count; i++)
+		if (i == 0 || as->dbg[i].section != as->dbg[i - 1].section)
+		{
+			size_t section = as->dbg[i].section;
+			dwarf_rel(ranges, first + section, 0, 8, 0);
+			dwarf_rel(ranges, first + section, as->sec[section].size, 8, 0);
+		}
+
+	dwarf_put(ranges, &zero, sizeof(zero));
+	dwarf_put(ranges, &zero, sizeof(zero));
+}
+
+static void dwarf_align(dwarf_section_t *sec, size_t start)
+{
+	/* records are padded with nops to keep the next one aligned. */
+	while ((sec->size - start) % 8 != 0)
+		dwarf_byte(sec, DW_CFA_nop);
+	dwarf_patch(sec, start, sec->size - start - sizeof(uint32_t));
+}
+
+static void dwarf_advance(dwarf_section_t *sec, size_t delta)
+{
+	if (delta == 0)
+		return;
+	else if (delta < 0x40)
+		dwarf_byte(sec, DW_CFA_advance_loc | delta);
+	else if (delta <= 0xFF)
+	{
+		dwarf_byte(sec, DW_CFA_advance_loc1);
+		dwarf_byte(sec, delta);
+	}
+	else if (delta <= 0xFFFF)
+	{
+		uint16_t d = delta;
+		dwarf_byte(sec, DW_CFA_advance_loc2);
+		dwarf_put(sec, &d, sizeof(d));
+	}
+	else
+	{
+		uint32_t d = delta;
+		dwarf_byte(sec, DW_CFA_advance_loc4);
+		dwarf_put(sec, &d, sizeof(d));
+	}
+}
+
+void dwarf_build_frame(dwarf_t *dw, asm_t *as, size_t first)
+{
+	dwarf_section_t *frame = &dw->sec[DWARF_FRAME];
+	uint32_t length = 0;
+
+	/* the common entry has the cfa right above the return address. */
+	dwarf_put(frame, &length, sizeof(length));
+	dwarf_put(frame, &length, sizeof(length));
+	dwarf_byte(frame, 1);
+	dwarf_put(frame, "zR", 3);
+	dwarf_uleb(frame, 1);
+	dwarf_sleb(frame, -8);
+	dwarf_byte(frame, DWARF_RA);
+	dwarf_uleb(frame, 1);
+	dwarf_byte(frame, DW_EH_PE_pcrel_sdata4);
+	dwarf_byte(frame, DW_CFA_def_cfa);
+	dwarf_uleb(frame, DWARF_RSP);
+	dwarf_uleb(frame, 8);
+	dwarf_byte(frame, DW_CFA_offset | DWARF_RA);
+	dwarf_uleb(frame, 1);
+	dwarf_align(frame, 0);
+
+	size_t start = 0, begin = 0, addr = 0;
+	for (size_t i = 0; i < as->cfi_count; i++)
+	{
+		cfi_t *cfi = &as->cfi[i];
+		uint32_t cie;
+
+		if (cfi->type != CFI_STARTPROC && cfi->type != CFI_ENDPROC)
+			dwarf_advance(frame, cfi->addr - addr);
+		addr = cfi->addr;
+
+		switch (cfi->type)
+		{
+		case CFI_STARTPROC:
+			/* the range is only known at the end, the common entry sits at offset zero. */
+			start = frame->size;
+			begin = cfi->addr;
+			dwarf_put(frame, &length, sizeof(length));
+			cie = frame->size;
+			dwarf_put(frame, &cie, sizeof(cie));
+			dwarf_rel(frame, first + cfi->section, cfi->addr, 4, 1);
+			dwarf_put(frame, &length, sizeof(length));
+			dwarf_uleb(frame, 0);
+			break;
+		case CFI_ENDPROC:
+			dwarf_patch(frame, start + 12, cfi->addr - begin);
+			dwarf_align(frame, start);
+			break;
+		case CFI_DEF_CFA:
+			dwarf_byte(frame, DW_CFA_def_cfa);
+			dwarf_uleb(frame, cfi->reg);
+			dwarf_uleb(frame, cfi->val);
+			break;
+		case CFI_DEF_CFA_OFFSET:
+			dwarf_byte(frame, DW_CFA_def_cfa_offset);
+			dwarf_uleb(frame, cfi->val);
+			break;
+		case CFI_DEF_CFA_REGISTER:
+			dwarf_byte(frame, DW_CFA_def_cfa_register);
+			dwarf_uleb(frame, cfi->reg);
+			break;
+		case CFI_OFFSET:
+			dwarf_byte(frame, DW_CFA_offset | cfi->reg);
+			dwarf_uleb(frame, cfi->val / -8);
+			break;
+		case CFI_REMEMBER_STATE:
+			dwarf_byte(frame, DW_CFA_remember_state);
+			break;
+		case CFI_RESTORE_STATE:
+			dwarf_byte(frame, DW_CFA_restore_state);
+			break;
+		}
+	}
+}
+
+void dwarf_free(dwarf_t *dw)
+{
+	for (size_t i = 0; i < DWARF_COUNT; i++)
+	{
+		free(dw->sec[i].data);
+		free(dw->sec[i].rel);
+	}
+
+	free(dw);
+}
@@ -0,0 +1,35 @@
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+static error_handler_t *current;
+
+error_handler_t* error_catch(error_handler_t *handler)
+{
+	error_handler_t *prev = current;
+	current = handler;
+	return prev;
+}
+
+void error_print(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	/* messages that do not fit are cut off, the buffer stays terminated. */
+	if (!current)
+		vprintf(format, args);
+	else if (current->len + 1 < current->size)
+		current->len += vsnprintf(current->msg + current->len,
+			current->size - current->len, format, args);
+
+	va_end(args);
+}
+
+void error_exit(void)
+{
+	if (!current)
+		exit(1);
+
+	longjmp(current->env, 1);
+}
@@ -0,0 +1,273 @@
+#include "harness.h"
+#include <stdio.h>
+#include <string.h>
+
+/* the perf_event_attr of an instruction counter for the calling thread, user space only. */
+static void harness_attr(FILE *fp)
+{
+	unsigned char attr[128] = { 0 };
+	attr[4] = sizeof(attr);		/* size */
+	attr[8] = 1;			/* config: PERF_COUNT_HW_INSTRUCTIONS */
+	attr[40] = 0x60;		/* exclude_kernel, exclude_hv */
+
+	fprintf(fp, "bench_attr:\n");
+	for (size_t i = 0; i < sizeof(attr); i += 16)
+	{
+		fprintf(fp, "db %d", attr[i]);
+		for (size_t j = i + 1; j < i + 16; j++)
+			fprintf(fp, ", %d", attr[j]);
+		fprintf(fp, "\n");
+	}
+}
+
+/*
+ * each run is fenced by lfence/rdtscp on both sides, only the low half of the
+ * counter is used. an empty kernel runs first, its minimum is the overhead
+ * of the harness and subtracted from all results.
+ */
+static void harness_kernel(FILE *fp, size_t i, const char *name, size_t runs, char perf)
+{
+	if (perf)
+		fprintf(fp, "call bench_counter\nmov [bench_count0], rax\n");
+
+	fprintf(fp,
+		"lea rax, [bench_samples]\n"
+		"mov [bench_ptr], rax\n"
+		"xor rax, rax\n"
+		"mov [bench_i], rax\n"
+		"bench_loop_%zu:\n"
+		"lfence\n"
+		"rdtscp\n"
+		"lfence\n"
+		"mov [bench_t0], rax\n"
+		"call %s\n"
+		"rdtscp\n"
+		"lfence\n"
+		"mov rcx, [bench_t0]\n"
+		"sub eax, ecx\n"
+		"mov rdi, [bench_ptr]\n"
+		"mov [rdi], rax\n"
+		"add rdi, 8\n"
+		"mov [bench_ptr], rdi\n"
+		"mov rcx, [bench_i]\n"
+		"inc rcx\n"
+		"mov [bench_i], rcx\n"
+		"cmp rcx, %zu\n"
+		"jne bench_loop_%zu\n", i, name, runs, i);
+
+	if (perf)
+		fprintf(fp,
+			"call bench_counter\n"
+			"mov rcx, [bench_count0]\n"
+			"sub rax, rcx\n"
+			"mov [bench_count0], rax\n");
+
+	fprintf(fp, "call bench_sort\n");
+
+	if (i == 0)
+	{
+		fprintf(fp, "mov rax, [bench_samples]\nmov [bench_base], rax\n");
+		if (perf)
+			fprintf(fp, "mov rax, [bench_count0]\nmov [bench_base_count], rax\n");
+		return;
+	}
+
+	fprintf(fp,
+		"lea rsi, [bench_name_%zu]\n"
+		"mov rdx, %zu\n"
+		"call bench_write\n"
+		"mov rax, [bench_samples]\n"
+		"call bench_print_cycles\n"
+		"lea rsi, [bench_median]\n"
+		"mov rdx, 8\n"
+		"call bench_write\n"
+		"mov rax, [bench_samples+%zu]\n"
+		"call bench_print_cycles\n"
+		"lea rsi, [bench_cycles]\n"
+		"mov rdx, 7\n"
+		"call bench_write\n", i, strlen(name) + 6, runs / 2 * 8);
+
+	/* instructions per run, less those of the harness. */
+	if (perf)
+		fprintf(fp,
+			"mov rax, [bench_fd]\n"
+			"cmp rax, 0\n"
+			"jl bench_done_%zu\n"
+			"lea rsi, [bench_comma]\n"
+			"mov rdx, 2\n"
+			"call bench_write\n"
+			"mov rax, [bench_count0]\n"
+			"mov rcx, [bench_base_count]\n"
+			"sub rax, rcx\n"
+			"jae bench_count_%zu\n"
+			"xor rax, rax\n"
+			"bench_count_%zu:\n"
+			"xor edx, edx\n"
+			"mov rcx, %zu\n"
+			"idiv rcx\n"
+			"call bench_print_num\n"
+			"lea rsi, [bench_instr]\n"
+			"mov rdx, 13\n"
+			"call bench_write\n"
+			"bench_done_%zu:\n", i, i, i, runs, i);
+
+	fprintf(fp, "lea rsi, [bench_newline]\nmov rdx, 1\ncall bench_write\n");
+}
+
+char* harness_generate(asm_t **units, size_t count, size_t runs, char perf, size_t *size)
+{
+	char *src;
+	FILE *fp = open_memstream(&src, size);
+	size_t kernels = 0;
+
+	fprintf(fp, "section .data\n");
+	for (size_t u = 0; u < count; u++)
+		for (size_t k = 0; k < units[u]->bench_count; k++)
+			fprintf(fp, "bench_name_%zu: db _\"%s: min \"\n", ++kernels,
+				units[u]->bench[k]);
+
+	fprintf(fp,
+		"bench_median: db _\" median \"\n"
+		"bench_cycles: db _\" cycles\"\n"
+		"bench_comma: db _\", \"\n"
+		"bench_instr: db _\" instructions\"\n"
+		"bench_newline: db _\"\\n\"\n");
+	if (perf)
+		harness_attr(fp);
+
+	fprintf(fp,
+		"section .bss\n"
+		"bench_samples: resq %zu\n"
+		"bench_buf: resb 24\n"
+		"bench_buf_end: resq 1\n"
+		"bench_t0: resq 1\n"
+		"bench_i: resq 1\n"
+		"bench_ptr: resq 1\n"
+		"bench_base: resq 1\n"
+		"bench_fd: resq 1\n"
+		"bench_count: resq 1\n"
+		"bench_count0: resq 1\n"
+		"bench_base_count: resq 1\n"
+		"section .text\n", runs);
+
+	for (size_t u = 0; u < count; u++)
+		for (size_t k = 0; k < units[u]->bench_count; k++)
+			fprintf(fp, "extern %s\n", units[u]->bench[k]);
+
+	/* kernels may clobber any register, the driver keeps its state in memory. */
+	fprintf(fp,
+		"bench_empty:\n"
+		"ret\n"
+		"main::\n"
+		"push rbx\n"
+		"push rbp\n"
+		"push r12\n"
+		"push r13\n"
+		"push r14\n"
+		"push r15\n"
+		"sub rsp, 8\n");
+
+	if (perf)
+		fprintf(fp,
+			"lea rdi, [bench_attr]\n"
+			"xor rsi, rsi\n"
+			"xor rdx, rdx\n"
+			"dec rdx\n"
+			"mov r10, rdx\n"
+			"xor r8, r8\n"
+			"mov rax, %d\n"
+			"syscall\n"
+			"mov [bench_fd], rax\n", HARNESS_PERF_OPEN);
+
+	harness_kernel(fp, 0, "bench_empty", runs, perf);
+	kernels = 0;
+	for (size_t u = 0; u < count; u++)
+		for (size_t k = 0; k < units[u]->bench_count; k++)
+			harness_kernel(fp, ++kernels, units[u]->bench[k], runs, perf);
+
+	fprintf(fp,
+		"add rsp, 8\n"
+		"pop r15\n"
+		"pop r14\n"
+		"pop r13\n"
+		"pop r12\n"
+		"pop rbp\n"
+		"pop rbx\n"
+		"xor rax, rax\n"
+		"ret\n");
+
+	/* cycles less the overhead, never below zero. */
+	fprintf(fp,
+		"bench_print_cycles:\n"
+		"mov rcx, [bench_base]\n"
+		"sub rax, rcx\n"
+		"jae bench_print_num\n"
+		"xor rax, rax\n"
+		"bench_print_num:\n"
+		"lea rdi, [bench_buf_end]\n"
+		"mov rcx, 10\n"
+		"bench_digit:\n"
+		"xor edx, edx\n"
+		"idiv rcx\n"
+		"add rdx, 48\n"
+		"dec rdi\n"
+		"mov [rdi], dl\n"
+		"cmp rax, 0\n"
+		"jne bench_digit\n"
+		"mov rsi, rdi\n"
+		"lea rdx, [bench_buf_end]\n"
+		"sub rdx, rdi\n"
+		"bench_write:\n"
+		"mov rdi, 1\n"
+		"mov rax, 1\n"
+		"syscall\n"
+		"ret\n");
+
+	/* insertion sort of the samples, ascending. */
+	fprintf(fp,
+		"bench_sort:\n"
+		"lea rsi, [bench_samples]\n"
+		"mov rcx, 1\n"
+		"bench_outer:\n"
+		"cmp rcx, %zu\n"
+		"je bench_sorted\n"
+		"mov rdi, rcx\n"
+		"mov rdx, 8\n"
+		"imul rdi, rdx\n"
+		"add rdi, rsi\n"
+		"mov rax, [rdi]\n"
+		"bench_inner:\n"
+		"cmp rdi, rsi\n"
+		"je bench_place\n"
+		"mov rdx, [rdi-8]\n"
+		"cmp rdx, rax\n"
+		"jbe bench_place\n"
+		"mov [rdi], rdx\n"
+		"sub rdi, 8\n"
+		"jmp bench_inner\n"
+		"bench_place:\n"
+		"mov [rdi], rax\n"
+		"inc rcx\n"
+		"jmp bench_outer\n"
+		"bench_sorted:\n"
+		"ret\n", runs);
+
+	if (perf)
+		fprintf(fp,
+			"bench_counter:\n"
+			"mov rdi, [bench_fd]\n"
+			"cmp rdi, 0\n"
+			"jl bench_none\n"
+			"lea rsi, [bench_count]\n"
+			"mov rdx, 8\n"
+			"xor rax, rax\n"
+			"syscall\n"
+			"mov rax, [bench_count]\n"
+			"ret\n"
+			"bench_none:\n"
+			"xor rax, rax\n"
+			"ret\n");
+
+	fclose(fp);
+	return src;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include "jit.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static size_t jit_lookup(const char *name)
+{
+	return (size_t) dlsym(RTLD_DEFAULT, name);
+}
+
+static uint64_t jit_timestamp()
+{
+	/* perf record -k mono matches samples against this clock. */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+jit_t* jit_init()
+{
+	jit_t *jit = calloc(1, sizeof(jit_t));
+	jit->ln = linker_init(0, 0);
+	jit->ln->jit = 1;
+	jit->ln->external = jit_lookup;
+	return jit;
+}
+
+void jit_add(jit_t *jit, asm_t *as)
+{
+	linker_add(jit->ln, as);
+}
+
+void jit_load(jit_t *jit)
+{
+	linker_t *ln = jit->ln;
+
+	/* lay out once to learn the size, then again at the mapped address. */
+	linker_layout(ln, 0);
+	jit->size = ln->seg[BSS].addr + ln->seg[BSS].mem_size - ln->base;
+	jit->size = (jit->size + LINK_PAGE - 1) & -LINK_PAGE;
+	jit->mem = mmap(0, jit->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (jit->mem == MAP_FAILED)
+	{
+		error_print("Failed to map %d bytes for the program.\n", jit->size);
+		error_exit();
+	}
+
+	ln->base = (size_t) jit->mem;
+	linker_layout(ln, 0);
+	linker_copy(ln);
+	linker_relocate(ln);
+
+	/* segments keep their file offsets, so the image maps one to one. */
+	memcpy(jit->mem, ln->out, ln->out_count);
+
+	/* the code only becomes executable once it is no longer writable. */
+	for (enum segment_type t = TEXT; t < DATA; t++)
+	{
+		segment_t *seg = &ln->seg[t];
+		size_t size = (seg->mem_size + LINK_PAGE - 1) & -LINK_PAGE;
+		if (size > 0 && mprotect((char*) seg->addr, size,
+			t == TEXT ? PROT_READ | PROT_EXEC : PROT_READ) != 0)
+		{
+			error_print("Failed to protect the program image.\n");
+			error_exit();
+		}
+	}
+}
+
+int jit_run(jit_t *jit, int argc, char **argv)
+{
+	size_t u;
+	symbol_t *main = linker_find_global(jit->ln, "main", &u);
+
+	if (!main)
+	{
+		error_print("Program does not define `main`.\n");
+		error_exit();
+	}
+
+	jit_write_perf_map(jit);
+	jit_write_dump(jit);
+
+	int (*entry)(int, char**, char**) = (int (*)(int, char**, char**))
+		linker_resolve(jit->ln, u, main - &jit->ln->unit[u].as->sym[0]);
+	return entry(argc, argv, environ);
+}
+
+size_t jit_symbol_size(jit_t *jit, size_t u, size_t sym)
+{
+	asm_t *as = jit->ln->unit[u].as;
+	symbol_t *sy = &as->sym[sym];
+	size_t end = as->sec[sy->section].size;
+
+	if (sy->size > 0)
+		return sy->size;
+
+	/* otherwise a label extends up to the next one in its section. */
+	for (size_t i = 0; i < as->sym_count; i++)
+		if (as->sym[i].type != EXTERN && as->sym[i].section == sy->section
+			&& as->sym[i].addr > sy->addr && as->sym[i].addr < end)
+			end = as->sym[i].addr;
+
+	return end - sy->addr;
+}
+
+void jit_write_perf_map(jit_t *jit)
+{
+	char name[64];
+	sprintf(name, "/tmp/perf-%d.map", getpid());
+	FILE *fp = fopen(name, "w");
+
+	if (!fp)
+		return;
+
+	for (size_t i = 0; i < jit->ln->unit_count; i++)
+	{
+		asm_t *as = jit->ln->unit[i].as;
+
+		for (size_t j = 0; j < as->sym_count; j++)
+		{
+			symbol_t *sy = &as->sym[j];
+			size_t size;
+			if (sy->type == EXTERN || !(as->sec[sy->section].flags & SEC_EXEC)
+				|| !(size = jit_symbol_size(jit, i, j)))
+				continue;
+
+			fprintf(fp, "%zx %zx %s\n", linker_resolve(jit->ln, i, j), size, sy->name);
+		}
+	}
+
+	fclose(fp);
+}
+
+void jit_write_dump(jit_t *jit)
+{
+	char name[64];
+	sprintf(name, "/tmp/jit-%d.dump", getpid());
+	FILE *fp = fopen(name, "w+");
+
+	if (!fp)
+		return;
+
+	jit_header_t header =
+	{
+		.magic = JIT_MAGIC,
+		.version = JIT_VERSION,
+		.total_size = sizeof(jit_header_t),
+		.elf_mach = EM_X86_64,
+		.pid = getpid(),
+		.timestamp = jit_timestamp()
+	};
+	fwrite(&header, sizeof(header), 1, fp);
+
+	/* perf only picks up the dump if it sees it mapped executable. */
+	void *marker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+		MAP_PRIVATE, fileno(fp), 0);
+
+	size_t index = 0;
+	for (size_t i = 0; i < jit->ln->unit_count; i++)
+	{
+		asm_t *as = jit->ln->unit[i].as;
+
+		for (size_t j = 0; j < as->sym_count; j++)
+		{
+			symbol_t *sy = &as->sym[j];
+			size_t size;
+			if (sy->type == EXTERN || !(as->sec[sy->section].flags & SEC_EXEC)
+				|| !(size = jit_symbol_size(jit, i, j)))
+				continue;
+
+			size_t addr = linker_resolve(jit->ln, i, j), len = strlen(sy->name) + 1;
+			jit_code_load_t rec =
+			{
+				.id = JIT_CODE_LOAD,
+				.total_size = sizeof(jit_code_load_t) + len + size,
+				.timestamp = jit_timestamp(),
+				.pid = getpid(),
+				.tid = syscall(SYS_gettid),
+				.vma = addr,
+				.code_addr = addr,
+				.code_size = size,
+				.code_index = index++
+			};
+			fwrite(&rec, sizeof(rec), 1, fp);
+			fwrite(sy->name, len, 1, fp);
+			fwrite((char*) addr, size, 1, fp);
+		}
+	}
+
+	fclose(fp);
+	if (marker != MAP_FAILED)
+		munmap(marker, sysconf(_SC_PAGESIZE));
+}
@@ -3,27 +3,67 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
 
 lexer_t* lexer_init(const char *file)
 {
-	lexer_t *lex =  calloc(1, sizeof(lexer_t));
+	/* `-` reads the program from stdin as it arrives. */
+	if (strcmp(file, "-") == 0)
+		return lexer_init_stream(stdin);
+
+	size_t size;
+	char *fi = lexer_read_file(file, &size);
+	lexer_t *lex = lexer_init_buffer(fi, size);
+	free(fi);
+	return lex;
+}
+
+char* lexer_read_file(const char *file, size_t *size)
+{
 	FILE *fp = fopen(file, "r");
 
 	if (!fp)
 	{
-		printf("Failed to open input file `%s`.\n", file);
-		exit(1);
+		error_print("Failed to open input file `%s`.\n", file);
+		error_exit();
 	}
 
 	/* determine eof offset. */
 	fseek(fp, 0, SEEK_END);
-	size_t size = ftell(fp);
+	*size = ftell(fp);
 	fseek(fp, 0, SEEK_SET);
 
 	/* read in the file. */
-	char *fi = calloc(size + 1, sizeof(char));
-	fread(fi, 1, size, fp);
+	char *fi = calloc(*size + 1, sizeof(char));
+	fread(fi, 1, *size, fp);
 	fclose(fp);
+	return fi;
+}
+
+lexer_t* lexer_init_stream(FILE *fp)
+{
+	lexer_t *lex = calloc(1, sizeof(lexer_t));
+	lex->fp = fp;
+	lex->chunk_size = LEXER_CHUNK;
+	lex->chunk = malloc(lex->chunk_size);
+	lex->loc = calloc(1, sizeof(loc_t));
+	lex->cur = lex->loc;
+
+	if ((lex->loc->str = lexer_read_line(lex)))
+		lex->loc_count = 1;
+
+	return lex;
+}
+
+lexer_t* lexer_init_buffer(const char *buf, size_t len)
+{
+	lexer_t *lex =  calloc(1, sizeof(lexer_t));
+	char *fi = calloc(len + 2, sizeof(char));
+	memcpy(fi, buf, len);
+
+	/* the last line need not be terminated. */
+	if (len > 0 && fi[len - 1] != '\n')
+		fi[len] = '\n';
 
 	/* create our loc mapping. */
 	char *it = strchr(fi, '\n'), *pit = fi;
@@ -51,12 +91,18 @@ lexer_t* lexer_duplicate(lexer_t *lex)
 	return dup;
 }
 
-char* lexer_advance(lexer_t *lex)
+static char* lexer_next(lexer_t *lex)
 {
+	/* nothing to read from empty input, or once seeked past the end. */
+	if (lex->loc_count == 0 || !lex->fp && lex->cur == &lex->loc[lex->loc_count])
+		return 0;
+
 	char *next = lex->cur->next, *end;
+	lex->first = 0;
 	
 	if (!lex->cur->dup)
 	{
+		lex->first = 1;
 		lex->cur->dup = strdup(lex->cur->str);
 		char *end = strchr(lex->cur->dup, '#');
 		if (end != 0) *end = '\0';
@@ -65,6 +111,9 @@ char* lexer_advance(lexer_t *lex)
 	}
 	else if (next)
 	{
+		/* the split off string literal is kept like the expanded tokens. */
+		lex->expanded = realloc(lex->expanded, ++lex->expanded_count * sizeof(char*));
+		lex->expanded[lex->expanded_count - 1] = next;
 		lex->cur->next = 0;
 		return next;
 	}
@@ -98,12 +147,434 @@ char* lexer_advance(lexer_t *lex)
 		return token;
 	}
 
+	if (lex->fp)
+		return lexer_next_line(lex) ? lexer_next(lex) : 0;
+
 	return ++lex->cur <= &lex->loc[lex->loc_count - 1] ?
-		lexer_advance(lex) : 0;
+		lexer_next(lex) : 0;
+}
+
+/* the tokens of all lines up to the `close` matching an `open` that was just read. */
+static lexer_macro_t lexer_record(lexer_t *lex, const char *open, const char *close)
+{
+	lexer_macro_t body = { 0 };
+	size_t depth = 0, loc = lexer_loc(lex);
+	char *token;
+
+	while (lexer_peek(lex))
+		lexer_next(lex);
+
+	while ((token = lexer_next(lex)))
+	{
+		if (lex->first && strcmp(token, close) == 0 && depth-- == 0)
+		{
+			while (lexer_peek(lex))
+				lexer_next(lex);
+			return body;
+		}
+
+		if (lex->first)
+		{
+			depth += strcmp(token, open) == 0;
+			body.line = realloc(body.line, ++body.line_count * sizeof(lexer_line_t));
+			body.line[body.line_count - 1] = (lexer_line_t) { .loc = lexer_loc(lex) };
+		}
+
+		lexer_line_t *line = &body.line[body.line_count - 1];
+		line->tok = realloc(line->tok, ++line->tok_count * sizeof(char*));
+		line->tok[line->tok_count - 1] = strdup(token);
+	}
+
+	error_print("Missing %s for %s in line %zu.\n", close, open, loc + 1);
+	error_exit();
+}
+
+static lexer_macro_t* lexer_find_macro(lexer_t *lex, const char *name)
+{
+	for (size_t i = 0; i < lex->macro_count; i++)
+		if (strcmp(lex->macro[i].name, name) == 0)
+			return &lex->macro[i];
+
+	return 0;
+}
+
+static void lexer_push(lexer_t *lex, lexer_frame_t frame)
+{
+	/* bodies repeated zero times are skipped entirely. */
+	if (frame.count == 0)
+		return;
+
+	if (lex->frame_count == LEXER_DEPTH)
+	{
+		error_print("Expansion nested deeper than %d levels.\n", LEXER_DEPTH);
+		error_exit();
+	}
+
+	frame.cur = frame.begin;
+	lex->frame = realloc(lex->frame, ++lex->frame_count * sizeof(lexer_frame_t));
+	lex->frame[lex->frame_count - 1] = frame;
+}
+
+/* replaces the iteration and the arguments in a token, the result is kept with the lexer. */
+static char* lexer_subst(lexer_t *lex, char *token)
+{
+	if (!strchr(token, '%'))
+		return token;
+
+	char *res, *end;
+	size_t size;
+	FILE *fp = open_memstream(&res, &size);
+
+	for (char *it = token; *it; it++)
+	{
+		if (*it != '%' || !(it[1] == 'i' || isdigit(it[1])))
+		{
+			fputc(*it, fp);
+			continue;
+		}
+
+		/* the innermost %rep or macro supplies the value. */
+		lexer_frame_t *fr = &lex->frame[lex->frame_count];
+		while (fr-- > lex->frame && (it[1] == 'i' ? !fr->rep : fr->rep));
+
+		if (fr < lex->frame)
+		{
+			error_print("Used `%.2s` outside of a %s.\n", it, it[1] == 'i' ? "%rep" : "macro");
+			error_exit();
+		}
+
+		if (it[1] == 'i')
+		{
+			size_t val = fr->iter;
+			it++;
+			if (it[1] == '*' && isdigit(it[2]))
+			{
+				val *= strtoul(it + 2, &end, 0);
+				it = end - 1;
+			}
+
+			fprintf(fp, "%zu", val);
+			continue;
+		}
+
+		size_t n = strtoul(it + 1, &end, 10);
+		if (n == 0 || n > fr->arg_count)
+		{
+			error_print("Macro argument `%%%zu` does not exist.\n", n);
+			error_exit();
+		}
+
+		fputs(fr->arg[n - 1], fp);
+		it = end - 1;
+	}
+
+	fclose(fp);
+	lex->expanded = realloc(lex->expanded, ++lex->expanded_count * sizeof(char*));
+	lex->expanded[lex->expanded_count - 1] = res;
+	return res;
+}
+
+/* starts expanding a directive or macro call found at the start of a line. */
+static char lexer_directive(lexer_t *lex, char *token, char **rest, size_t rest_count)
+{
+	lexer_macro_t *macro = lexer_find_macro(lex, token);
+
+	if (strcmp(token, "%endrep") == 0 || strcmp(token, "%endmacro") == 0)
+	{
+		error_print("Encountered %s without its opening directive.\n", token);
+		error_exit();
+	}
+	else if (macro)
+	{
+		if (rest_count != macro->params)
+		{
+			error_print("Macro `%s` expects %zu arguments, got %zu.\n", token,
+				macro->params, rest_count);
+			error_exit();
+		}
+
+		lexer_push(lex, (lexer_frame_t)
+		{
+			.line = macro->line,
+			.end = macro->line_count,
+			.count = 1,
+			.arg = rest,
+			.arg_count = rest_count
+		});
+		return 1;
+	}
+
+	return 0;
+}
+
+static char* lexer_expand(lexer_t *lex)
+{
+	lexer_frame_t *fr = &lex->frame[lex->frame_count - 1];
+	char *token;
+
+	while (fr->cur < fr->end && fr->tok == fr->line[fr->cur].tok_count)
+	{
+		fr->cur++;
+		fr->tok = 0;
+	}
+
+	if (fr->cur == fr->end)
+	{
+		if (++fr->iter < fr->count)
+			fr->cur = fr->begin;
+		else
+			lex->frame_count--;
+		return lexer_advance(lex);
+	}
+
+	lexer_line_t *line = &fr->line[fr->cur];
+	if (fr->tok > 0)
+	{
+		token = fr->next ? fr->next : lexer_subst(lex, line->tok[fr->tok]);
+		fr->next = 0;
+		fr->tok++;
+		return token;
+	}
+
+	token = line->tok[0];
+	if (strcmp(token, "%macro") == 0)
+	{
+		error_print("Macros cannot be defined inside of an expansion, line %zu.\n",
+			line->loc + 1);
+		error_exit();
+	}
+	else if (strcmp(token, "%rep") == 0)
+	{
+		/* nested bodies are replayed from the lines of their parent. */
+		size_t depth = 0, end = fr->cur + 1, begin = end;
+		for (; end < fr->end; end++)
+			if (strcmp(fr->line[end].tok[0], "%rep") == 0)
+				depth++;
+			else if (strcmp(fr->line[end].tok[0], "%endrep") == 0 && depth-- == 0)
+				break;
+
+		if (end == fr->end || line->tok_count != 2)
+		{
+			error_print("Invalid %%rep in line %zu.\n", line->loc + 1);
+			error_exit();
+		}
+
+		size_t count = strtoul(lexer_subst(lex, line->tok[1]), 0, 0);
+		lexer_line_t *lines = fr->line;
+		fr->cur = end;
+		fr->tok = fr->line[end].tok_count;
+
+		lexer_push(lex, (lexer_frame_t)
+		{
+			.line = lines,
+			.begin = begin,
+			.end = end,
+			.count = count,
+			.rep = 1
+		});
+		return lexer_advance(lex);
+	}
+
+	if (lexer_find_macro(lex, token) || strcmp(token, "%endrep") == 0
+		|| strcmp(token, "%endmacro") == 0)
+	{
+		char **rest = calloc(line->tok_count, sizeof(char*));
+		for (size_t i = 1; i < line->tok_count; i++)
+			rest[i - 1] = lexer_subst(lex, line->tok[i]);
+
+		fr->tok = line->tok_count;
+		if (lexer_directive(lex, token, rest, line->tok_count - 1))
+			return lexer_advance(lex);
+
+		free(rest);
+	}
+
+	fr->tok = 1;
+	return lexer_subst(lex, token);
+}
+
+char* lexer_advance(lexer_t *lex)
+{
+	if (lex->frame_count > 0)
+		return lexer_expand(lex);
+
+	char *token = lexer_next(lex);
+	if (!token || !lex->first)
+		return token;
+
+	/* directives and macro calls are only recognized at the start of a line. */
+	if (strcmp(token, "%rep") == 0 || strcmp(token, "%macro") == 0)
+	{
+		char *arg = lexer_peek(lex) ? lexer_next(lex) : 0;
+		size_t val = arg ? strtoul(arg, 0, 0) : 0;
+
+		if (!arg || token[1] == 'm' && !lexer_peek(lex))
+		{
+			error_print("Invalid %s in line %zu.\n", token, lexer_loc(lex) + 1);
+			error_exit();
+		}
+
+		lexer_macro_t body;
+		if (token[1] == 'm')
+		{
+			char *name = strdup(arg);
+			val = strtoul(lexer_next(lex), 0, 0);
+			body = lexer_record(lex, "%macro", "%endmacro");
+			body.name = name;
+			body.params = val;
+			lex->macro = realloc(lex->macro, ++lex->macro_count * sizeof(lexer_macro_t));
+			lex->macro[lex->macro_count - 1] = body;
+			return lexer_advance(lex);
+		}
+
+		body = lexer_record(lex, "%rep", "%endrep");
+		lex->block = realloc(lex->block, ++lex->block_count * sizeof(lexer_macro_t));
+		lex->block[lex->block_count - 1] = body;
+		lexer_push(lex, (lexer_frame_t)
+		{
+			.line = body.line,
+			.end = body.line_count,
+			.count = val,
+			.rep = 1
+		});
+		return lexer_advance(lex);
+	}
+
+	lexer_macro_t *macro = lexer_find_macro(lex, token);
+	if (!macro && strcmp(token, "%endrep") != 0 && strcmp(token, "%endmacro") != 0)
+		return token;
+
+	/* arguments are copied, lines of streams do not stay around. */
+	char **rest = 0;
+	size_t rest_count = 0;
+	while (lexer_peek(lex))
+	{
+		rest = realloc(rest, ++rest_count * sizeof(char*));
+		rest[rest_count - 1] = strdup(lexer_next(lex));
+	}
+
+	lexer_directive(lex, token, rest, rest_count);
+	return lexer_advance(lex);
+}
+
+char* lexer_read_line(lexer_t *lex)
+{
+	char *line, *end;
+
+	while (1)
+	{
+		/* hand out complete lines while the chunk holds some. */
+		end = memchr(lex->chunk + lex->chunk_off, '\n', lex->chunk_count - lex->chunk_off);
+		if (end)
+		{
+			line = strndup(lex->chunk + lex->chunk_off, end - lex->chunk - lex->chunk_off);
+			lex->chunk_off = end + 1 - lex->chunk;
+			return line;
+		}
+
+		/* move the partial line to the front, lines longer than a chunk grow it. */
+		lex->chunk_count -= lex->chunk_off;
+		memmove(lex->chunk, lex->chunk + lex->chunk_off, lex->chunk_count);
+		lex->chunk_off = 0;
+		if (lex->chunk_count == lex->chunk_size)
+			lex->chunk = realloc(lex->chunk, lex->chunk_size *= 2);
+
+		/* take whatever the pipe has, instead of waiting for a full chunk. */
+		ssize_t n = read(fileno(lex->fp), lex->chunk + lex->chunk_count,
+			lex->chunk_size - lex->chunk_count);
+
+		if (n < 0)
+		{
+			error_print("Failed to read from input stream.\n");
+			error_exit();
+		}
+		else if (n == 0)
+		{
+			/* the last line need not be terminated. */
+			if (lex->chunk_count == 0)
+				return 0;
+
+			line = strndup(lex->chunk, lex->chunk_count);
+			lex->chunk_count = 0;
+			return line;
+		}
+
+		lex->chunk_count += n;
+	}
+}
+
+char lexer_next_line(lexer_t *lex)
+{
+	/* the previous line is done with, tokens are copied where they are kept. */
+	free(lex->loc->str);
+	free(lex->loc->dup);
+	free(lex->loc->next);
+	*lex->loc = (loc_t) { lexer_read_line(lex), 0, 0, 0 };
+	lex->base++;
+
+	if (!lex->loc->str)
+		return 0;
+
+	lex->loc_count++;
+	return 1;
+}
+
+void lexer_free(lexer_t *lex)
+{
+	for (size_t i = 0; i < (lex->fp ? 1 : lex->loc_count); i++)
+	{
+		free(lex->loc[i].dup);
+		free(lex->loc[i].next);
+	}
+
+	/* all lines of a buffer share the allocation of the first. */
+	if (lex->fp || lex->loc_count > 0)
+		free(lex->loc[0].str);
+
+	for (size_t i = 0; i < lex->macro_count + lex->block_count; i++)
+	{
+		lexer_macro_t *body = i < lex->macro_count ?
+			&lex->macro[i] : &lex->block[i - lex->macro_count];
+		for (size_t j = 0; j < body->line_count; j++)
+		{
+			for (size_t k = 0; k < body->line[j].tok_count; k++)
+				free(body->line[j].tok[k]);
+			free(body->line[j].tok);
+		}
+		free(body->line);
+		free(body->name);
+	}
+
+	for (size_t i = 0; i < lex->expanded_count; i++)
+		free(lex->expanded[i]);
+
+	free(lex->macro);
+	free(lex->block);
+	free(lex->frame);
+	free(lex->expanded);
+	free(lex->chunk);
+	free(lex->loc);
+	free(lex);
+}
+
+void lexer_seek(lexer_t *lex, size_t loc)
+{
+	/* lines skipped over are never tokenized. */
+	lex->cur = &lex->loc[loc];
 }
 
 char* lexer_peek(lexer_t *lex)
 {
+	if (lex->frame_count > 0)
+	{
+		lexer_frame_t *fr = &lex->frame[lex->frame_count - 1];
+		if (fr->cur == fr->end || fr->tok == 0 || fr->tok >= fr->line[fr->cur].tok_count)
+			return 0;
+		if (!fr->next)
+			fr->next = lexer_subst(lex, fr->line[fr->cur].tok[fr->tok]);
+		return fr->next;
+	}
+
 	if (lex->cur->next)
 		return lex->cur->next;
 
@@ -112,6 +583,12 @@ char* lexer_peek(lexer_t *lex)
 
 size_t lexer_loc(lexer_t *lex)
 {
-	return lex->cur - &lex->loc[0];
+	if (lex->frame_count > 0)
+	{
+		lexer_frame_t *fr = &lex->frame[lex->frame_count - 1];
+		return fr->line[fr->cur < fr->end ? fr->cur : fr->end - 1].loc;
+	}
+
+	return lex->base + (lex->cur - &lex->loc[0]);
 }
 
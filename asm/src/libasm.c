@@ -0,0 +1,157 @@
+#include "libasm.h"
+#include "obj.h"
+#include <string.h>
+
+/* streams are read if given, otherwise the buffer. */
+static asm_t* libasm_run(const char *buf, size_t len, FILE *fp, FILE *listing,
+	char *error, size_t error_size)
+{
+	error_handler_t handler = { .msg = error, .size = error_size }, *prev;
+	lexer_t *volatile lex = 0;
+	asm_t *volatile as = 0;
+
+	if (error_size > 0)
+		error[0] = 0;
+
+	/* errors unwind to here, with the message left in the caller's buffer. */
+	prev = error_catch(&handler);
+	if (setjmp(handler.env))
+	{
+		error_catch(prev);
+		if (as)
+			libasm_free(as);
+		else if (lex)
+			lexer_free(lex);
+		return 0;
+	}
+
+	lex = fp ? lexer_init_stream(fp) : lexer_init_buffer(buf, len);
+	as = asm_init(lex);
+	as->listing = listing;
+	asm_full_pass(as);
+	error_catch(prev);
+	return as;
+}
+
+asm_t* libasm_assemble(const char *buf, size_t len, FILE *listing, char *error, size_t error_size)
+{
+	return libasm_run(buf, len, 0, listing, error, error_size);
+}
+
+asm_t* libasm_assemble_stream(FILE *fp, FILE *listing, char *error, size_t error_size)
+{
+	return libasm_run(0, 0, fp, listing, error, error_size);
+}
+
+void libasm_free(asm_t *as)
+{
+	lexer_free(as->lex);
+
+	for (size_t i = 0; i < as->str_count; i++)
+		free(as->str[i]);
+	free(as->str);
+
+	for (size_t i = 0; i < as->sym_count; i++)
+		free(as->sym[i].name);
+	free(as->sym);
+
+	for (size_t i = 0; i < as->cur.op_count; i++)
+		free(as->cur.op[i].sub);
+	free(as->cur.op);
+
+	for (size_t i = 0; i < as->cost_count; i++)
+		free(as->cost[i].loop);
+	free(as->cost);
+
+	for (size_t i = 0; i < as->bench_count; i++)
+		free(as->bench[i]);
+	free(as->bench);
+
+	free(as->rel);
+	free(as->def_rel);
+	free(as->def_attr);
+	free(as->sec);
+	free(as->out);
+	free(as->fix);
+	free(as->dbg);
+	free(as->cfi);
+	free(as->patch);
+	free(as);
+}
+
+size_t libasm_section_count(asm_t *as)
+{
+	return as->sec_count;
+}
+
+size_t libasm_symbol_count(asm_t *as)
+{
+	return as->sym_count;
+}
+
+size_t libasm_reloc_count(asm_t *as)
+{
+	return as->rel_count;
+}
+
+char libasm_section(asm_t *as, size_t i, libasm_section_t *sec)
+{
+	if (i >= as->sec_count)
+		return 0;
+
+	/* zero-fill sections have a size, but no contents. */
+	section_t *se = &as->sec[i];
+	sec->name = se->name;
+	sec->data = se->flags & SEC_NOBITS ? 0 : as->out + se->addr;
+	sec->size = se->flags & SEC_NOBITS ? se->reserved : se->size;
+	sec->flags = se->flags;
+	sec->entsize = se->entsize;
+	return 1;
+}
+
+char libasm_symbol(asm_t *as, size_t i, libasm_symbol_t *sym)
+{
+	symbol_t *sy = asm_iterate_symbols(as, i);
+
+	if (!sy)
+		return 0;
+
+	sym->name = sy->name;
+	sym->type = sy->type;
+	sym->section = sy->section;
+	sym->addr = sy->addr;
+	sym->size = sy->size;
+	sym->flags = sy->flags;
+	return 1;
+}
+
+char libasm_reloc(asm_t *as, size_t i, libasm_reloc_t *rel)
+{
+	reloc_t *re = asm_iterate_relocs(as, i);
+
+	if (!re)
+		return 0;
+
+	/* addends follow the elf convention, relative ones count from the field. */
+	rel->type = re->type;
+	rel->symbol = re->sym;
+	rel->section = re->section;
+	rel->addr = re->addr;
+	rel->addend = re->type == ABSOLUTE ? re->add : re->add - 4;
+	rel->size = re->type == ABSOLUTE ? re->size : 4;
+	rel->sign = re->sign;
+	return 1;
+}
+
+size_t libasm_write_elf(asm_t *as, char *buf, size_t size)
+{
+	char *out;
+	size_t len = asm_to_obj(as, &out);
+
+	/* the required size is returned either way, so callers can retry. */
+	if (len <= size)
+		memcpy(buf, out, len);
+
+	free(out);
+	return len;
+}
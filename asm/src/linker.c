@@ -0,0 +1,937 @@
+#include "linker.h"
+#include <stdio.h>
+#include <string.h>
+
+/* offset of the rel32 of the call to main inside the start stub. */
+#define STUB_CALL 10
+
+/* _start for programs that only define main, exits with its return value. */
+static const char stub[] =
+{
+	0x48, 0x8B, 0x3C, 0x24,		/* mov rdi, [rsp] */
+	0x48, 0x8D, 0x74, 0x24, 0x08,	/* lea rsi, [rsp+8] */
+	0xE8, 0x00, 0x00, 0x00, 0x00,	/* call main */
+	0x48, 0x89, 0xC7,		/* mov rdi, rax */
+	0xB8, 0x3C, 0x00, 0x00, 0x00,	/* mov eax, 60 */
+	0x0F, 0x05			/* syscall */
+};
+
+/* symbols are bound at load time, so a plt entry is a single indirect jump. */
+static const char plt_entry[LINK_PLT_ENTRY] =
+{
+	0xFF, 0x25, 0x00, 0x00, 0x00, 0x00,	/* jmp [rip + slot] */
+	0xCC, 0xCC				/* int3 */
+};
+
+static const struct
+{
+	const char *name;
+	size_t type;
+	size_t flags;
+	size_t align;
+	size_t entsize;
+} outputs[OUT_COUNT] =
+{
+	[OUT_TEXT] = { ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0 },
+	[OUT_PLT] = { ".plt", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, LINK_PLT_ENTRY },
+	[OUT_RODATA] = { ".rodata", SHT_PROGBITS, SHF_ALLOC, 16, 0 },
+	[OUT_GNU_HASH] = { ".gnu.hash", SHT_GNU_HASH, SHF_ALLOC, 8, 0 },
+	[OUT_DYNSYM] = { ".dynsym", SHT_DYNSYM, SHF_ALLOC, 8, sizeof(Elf64_Sym) },
+	[OUT_DYNSTR] = { ".dynstr", SHT_STRTAB, SHF_ALLOC, 1, 0 },
+	[OUT_RELA_DYN] = { ".rela.dyn", SHT_RELA, SHF_ALLOC, 8, sizeof(Elf64_Rela) },
+	[OUT_RELA_PLT] = { ".rela.plt", SHT_RELA, SHF_ALLOC | SHF_INFO_LINK, 8, sizeof(Elf64_Rela) },
+	[OUT_DATA] = { ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 16, 0 },
+	[OUT_DYNAMIC] = { ".dynamic", SHT_DYNAMIC, SHF_ALLOC | SHF_WRITE, 8, sizeof(Elf64_Dyn) },
+	[OUT_GOT] = { ".got", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8, 8 },
+	[OUT_GOT_PLT] = { ".got.plt", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8, 8 },
+	[OUT_BSS] = { ".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 16, 0 }
+};
+
+/* the output collecting the assembled sections of each segment. */
+static const enum output_type user_output[] = { OUT_TEXT, OUT_RODATA, OUT_DATA, OUT_BSS };
+
+static size_t align_by(size_t addr, size_t al)
+{
+	return (addr + (al - 1)) & -al;
+}
+
+static enum segment_type segment_of(section_t *sec)
+{
+	if (sec->flags & SEC_EXEC)
+		return TEXT;
+	else if (sec->flags & SEC_NOBITS)
+		return BSS;
+	else if (sec->flags & SEC_WRITE)
+		return DATA;
+	return RODATA;
+}
+
+static enum segment_type segment_of_output(enum output_type o)
+{
+	if (o < OUT_RODATA)
+		return TEXT;
+	else if (o < OUT_DATA)
+		return RODATA;
+	else if (o < OUT_BSS)
+		return DATA;
+	return BSS;
+}
+
+static size_t section_align(section_t *sec)
+{
+	return sec->flags & SEC_MERGE && sec->entsize ? sec->entsize : 16;
+}
+
+static unsigned int gnu_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	for (; *name; name++)
+		h = h * 33 + (unsigned char) *name;
+
+	return h;
+}
+
+static int compare_bucket(const void *a, const void *b)
+{
+	const dynsym_t *x = a, *y = b;
+	return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+static void add_rela(linker_t *ln, enum output_type o, size_t *count,
+	size_t offset, size_t type, size_t sym, size_t add)
+{
+	Elf64_Rela *rela = (Elf64_Rela*) (ln->out + ln->sec[o].off) + (*count)++;
+	rela->r_offset = offset;
+	rela->r_info = ELF64_R_INFO(sym, type);
+	rela->r_addend = add;
+}
+
+linker_t* linker_init(char huge, char shared)
+{
+	linker_t *ln = calloc(1, sizeof(linker_t));
+	ln->huge = huge;
+	ln->shared = shared;
+	ln->base = shared ? 0 : LINK_BASE;
+	ln->dynstr_count = 1;
+	return ln;
+}
+
+void linker_add(linker_t *ln, asm_t *as)
+{
+	/* there is no thread pointer to set up, thread-local data only works in objects. */
+	for (size_t i = 0; i < as->sec_count; i++)
+		if (as->sec[i].flags & SEC_TLS)
+		{
+			error_print("Thread-local section %s is only supported in objects.\n",
+				as->sec[i].name);
+			error_exit();
+		}
+
+	for (size_t i = 0; i < as->rel_count; i++)
+		if (as->rel[i].type == TLS_OFFSET || as->rel[i].type == TLS_GOT_RELATIVE)
+		{
+			error_print("Thread-local access to `%s` is only supported in objects.\n",
+				as->sym[as->rel[i].sym].name);
+			error_exit();
+		}
+
+	ln->unit = realloc(ln->unit, ++ln->unit_count * sizeof(unit_t));
+	unit_t *unit = &ln->unit[ln->unit_count - 1];
+	unit->as = as;
+	unit->addr = calloc(as->sec_count, sizeof(size_t));
+	unit->off = calloc(as->sec_count, sizeof(size_t));
+	unit->got = malloc(as->sym_count * sizeof(size_t));
+	unit->plt = malloc(as->sym_count * sizeof(size_t));
+	unit->dyn = malloc(as->sym_count * sizeof(size_t));
+}
+
+size_t linker_to_elf(linker_t *ln, char **out)
+{
+	const size_t phnum = ln->shared ? BSS + 2 : BSS + 1;
+	size_t header = sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr);
+
+	linker_layout(ln, header);
+	linker_copy(ln);
+	linker_relocate(ln);
+
+	if (ln->shared)
+		linker_write_dynamic(ln);
+
+	Elf64_Ehdr *elf = (Elf64_Ehdr*) ln->out;
+	elf->e_ident[EI_MAG0] = 0x7F;
+	elf->e_ident[EI_MAG1] = 'E';
+	elf->e_ident[EI_MAG2] = 'L';
+	elf->e_ident[EI_MAG3] = 'F';
+	elf->e_ident[EI_CLASS] = ELFCLASS64;
+	elf->e_ident[EI_DATA] = ELFDATA2LSB;
+	elf->e_ident[EI_VERSION] = EV_CURRENT;
+	elf->e_type = ln->shared ? ET_DYN : ET_EXEC;
+	elf->e_machine = EM_X86_64;
+	elf->e_version = EV_CURRENT;
+	elf->e_entry = ln->entry;
+	elf->e_phoff = sizeof(Elf64_Ehdr);
+	elf->e_ehsize = sizeof(Elf64_Ehdr);
+	elf->e_phentsize = sizeof(Elf64_Phdr);
+	elf->e_shentsize = sizeof(Elf64_Shdr);
+	elf->e_shnum = ln->sec_count + 4;
+	elf->e_shstrndx = elf->e_shnum - 1;
+
+	/* one loadable segment per permission, bss is part of the data segment. */
+	Elf64_Phdr *ph = (Elf64_Phdr*) (ln->out + elf->e_phoff);
+	for (enum segment_type t = TEXT; t < BSS; t++)
+	{
+		segment_t *seg = &ln->seg[t];
+		size_t mem_size = seg->mem_size;
+
+		/* bss follows the data at an alignment, the padding is part of the segment. */
+		if (t == DATA && ln->seg[BSS].mem_size > 0)
+			mem_size = ln->seg[BSS].addr + ln->seg[BSS].mem_size - seg->addr;
+
+		/* empty segments are simply left out. */
+		if (mem_size == 0)
+			continue;
+
+		ph->p_type = PT_LOAD;
+		ph->p_flags = t == TEXT ? PF_R | PF_X : (t == DATA ? PF_R | PF_W : PF_R);
+		ph->p_offset = seg->off;
+		ph->p_vaddr = ph->p_paddr = seg->addr;
+		ph->p_filesz = seg->size;
+		ph->p_memsz = mem_size;
+		ph->p_align = t == TEXT && ln->huge ? LINK_HUGE_PAGE : LINK_PAGE;
+		ph++;
+	}
+
+	if (ln->shared)
+	{
+		ph->p_type = PT_DYNAMIC;
+		ph->p_flags = PF_R | PF_W;
+		ph->p_offset = ln->sec[OUT_DYNAMIC].off;
+		ph->p_vaddr = ph->p_paddr = ln->sec[OUT_DYNAMIC].addr;
+		ph->p_filesz = ph->p_memsz = ln->sec[OUT_DYNAMIC].size;
+		ph->p_align = 8;
+		ph++;
+	}
+
+	ph->p_type = PT_GNU_STACK;
+	ph->p_flags = PF_R | PF_W;
+	ph->p_align = 16;
+	elf->e_phnum = ph + 1 - (Elf64_Phdr*) (ln->out + elf->e_phoff);
+
+	/* section headers are not needed to run, but tools rely on them. */
+	size_t size = align_by(ln->out_count, 8), symtab = ln->sec_count + 1;
+	elf->e_shoff = size;
+	size += elf->e_shnum * sizeof(Elf64_Shdr);
+	ln->out = realloc(ln->out, size);
+	memset(ln->out + ln->out_count, 0, size - ln->out_count);
+
+	for (enum output_type o = OUT_TEXT; o < OUT_COUNT; o++)
+	{
+		output_t *out = &ln->sec[o];
+		if (!out->index)
+			continue;
+
+		Elf64_Shdr *sh = (Elf64_Shdr*) (ln->out + ((Elf64_Ehdr*) ln->out)->e_shoff) + out->index;
+		sh->sh_type = outputs[o].type;
+		sh->sh_flags = outputs[o].flags;
+		sh->sh_addr = out->addr;
+		sh->sh_offset = out->off;
+		sh->sh_size = out->size;
+		sh->sh_addralign = outputs[o].align;
+		sh->sh_entsize = outputs[o].entsize;
+
+		switch (o)
+		{
+		case OUT_DYNSYM:
+			sh->sh_link = ln->sec[OUT_DYNSTR].index;
+			sh->sh_info = 1;
+			break;
+		case OUT_GNU_HASH:
+		case OUT_RELA_DYN:
+			sh->sh_link = ln->sec[OUT_DYNSYM].index;
+			break;
+		case OUT_RELA_PLT:
+			sh->sh_link = ln->sec[OUT_DYNSYM].index;
+			sh->sh_info = ln->sec[OUT_GOT_PLT].index;
+			break;
+		case OUT_DYNAMIC:
+			sh->sh_link = ln->sec[OUT_DYNSTR].index;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* the first symbol is always the null symbol. */
+	Elf64_Sym *esy;
+	size_t locals = 1, name = 1, sym_off = size, str_off;
+	ln->out = realloc(ln->out, size + sizeof(Elf64_Sym));
+	memset(ln->out + size, 0, sizeof(Elf64_Sym));
+	size += sizeof(Elf64_Sym);
+
+	/* local symbols first, then the global ones. */
+	for (char b = 0; b < 2; b++)
+		for (size_t i = 0; i < ln->unit_count; i++)
+			for (size_t j = 0; j < ln->unit[i].as->sym_count; j++)
+			{
+				symbol_t *sy = &ln->unit[i].as->sym[j];
+				if (sy->type == EXTERN || b == (sy->type == LABEL)
+					|| !(ln->unit[i].as->sec[sy->section].flags & SEC_ALLOC))
+					continue;
+
+				ln->out = realloc(ln->out, size + sizeof(Elf64_Sym));
+				esy = (Elf64_Sym*) (ln->out + size);
+				memset(esy, 0, sizeof(Elf64_Sym));
+				size += sizeof(Elf64_Sym);
+
+				enum segment_type t = segment_of(&ln->unit[i].as->sec[sy->section]);
+				esy->st_name = name;
+				esy->st_value = linker_resolve(ln, i, j);
+				esy->st_size = sy->size;
+				esy->st_shndx = ln->sec[user_output[t]].index;
+				esy->st_info = ELF64_ST_INFO(b ? (sy->flags & SYM_WEAK ? STB_WEAK :
+					STB_GLOBAL) : STB_LOCAL, t == TEXT ? STT_FUNC : STT_OBJECT);
+				esy->st_other = sy->flags & SYM_HIDDEN ? STV_HIDDEN : STV_DEFAULT;
+				name += strlen(sy->name) + 1;
+				if (!b)
+					locals++;
+			}
+
+	/* names appear in the same order as the symbols. */
+	str_off = size;
+	ln->out = realloc(ln->out, size + 1);
+	ln->out[size++] = '\0';
+	for (char b = 0; b < 2; b++)
+		for (size_t i = 0; i < ln->unit_count; i++)
+			for (size_t j = 0; j < ln->unit[i].as->sym_count; j++)
+			{
+				symbol_t *sy = &ln->unit[i].as->sym[j];
+				if (sy->type == EXTERN || b == (sy->type == LABEL)
+					|| !(ln->unit[i].as->sec[sy->section].flags & SEC_ALLOC))
+					continue;
+
+				size_t len = strlen(sy->name) + 1;
+				ln->out = realloc(ln->out, size + len);
+				memcpy(ln->out + size, sy->name, len);
+				size += len;
+			}
+
+	/* the output sections come first, then the symbol and string tables. */
+	size_t shstr_off = size;
+	for (size_t i = 0; i < ln->sec_count + 4; i++)
+	{
+		const char *sec_name = "";
+		if (i == symtab)
+			sec_name = ".symtab";
+		else if (i == symtab + 1)
+			sec_name = ".strtab";
+		else if (i == symtab + 2)
+			sec_name = ".shstrtab";
+		else if (i > 0)
+			for (enum output_type o = OUT_TEXT; o < OUT_COUNT; o++)
+				if (ln->sec[o].index == i)
+					sec_name = outputs[o].name;
+
+		size_t len = strlen(sec_name) + 1;
+		ln->out = realloc(ln->out, size + len);
+		Elf64_Shdr *sh = (Elf64_Shdr*) (ln->out + ((Elf64_Ehdr*) ln->out)->e_shoff) + i;
+		sh->sh_name = size - shstr_off;
+		memcpy(ln->out + size, sec_name, len);
+		size += len;
+	}
+
+	elf = (Elf64_Ehdr*) ln->out;
+	Elf64_Shdr *sh = (Elf64_Shdr*) (ln->out + elf->e_shoff);
+	sh[symtab].sh_type = SHT_SYMTAB;
+	sh[symtab].sh_offset = sym_off;
+	sh[symtab].sh_size = str_off - sym_off;
+	sh[symtab].sh_link = symtab + 1;
+	sh[symtab].sh_info = locals;
+	sh[symtab].sh_entsize = sizeof(Elf64_Sym);
+	sh[symtab].sh_addralign = 8;
+	sh[symtab + 1].sh_type = SHT_STRTAB;
+	sh[symtab + 1].sh_offset = str_off;
+	sh[symtab + 1].sh_size = shstr_off - str_off;
+	sh[symtab + 2].sh_type = SHT_STRTAB;
+	sh[symtab + 2].sh_offset = shstr_off;
+	sh[symtab + 2].sh_size = size - shstr_off;
+
+	*out = ln->out;
+	return size;
+}
+
+void linker_copy(linker_t *ln)
+{
+	/* copy all sections with contents into the image. */
+	for (size_t i = 0; i < ln->unit_count; i++)
+		for (size_t s = 0; s < ln->unit[i].as->sec_count; s++)
+		{
+			section_t *sec = &ln->unit[i].as->sec[s];
+			if (sec->flags & SEC_ALLOC && !(sec->flags & SEC_NOBITS))
+				memcpy(ln->out + ln->unit[i].off[s],
+					ln->unit[i].as->out + sec->addr, sec->size);
+		}
+
+	if (ln->stub)
+		memcpy(ln->out + ln->stub - ln->seg[TEXT].addr, stub, sizeof(stub));
+}
+
+void linker_scan(linker_t *ln)
+{
+	ln->got_count = ln->plt_count = ln->rela_count = ln->dyn_count = 0;
+	ln->dynstr_count = 1;
+	ln->textrel = 0;
+
+	for (size_t i = 0; i < ln->unit_count; i++)
+	{
+		unit_t *unit = &ln->unit[i];
+		memset(unit->got, 0xFF, unit->as->sym_count * sizeof(size_t));
+		memset(unit->plt, 0xFF, unit->as->sym_count * sizeof(size_t));
+		memset(unit->dyn, 0xFF, unit->as->sym_count * sizeof(size_t));
+	}
+
+	for (size_t i = 0; i < ln->unit_count; i++)
+	{
+		unit_t *unit = &ln->unit[i];
+
+		for (size_t j = 0; j < unit->as->rel_count; j++)
+		{
+			reloc_t *re = &unit->as->rel[j];
+			section_t *sec = &unit->as->sec[re->section];
+			symbol_t *sy = &unit->as->sym[re->sym];
+			if (!(sec->flags & SEC_ALLOC))
+				continue;
+
+			/* shared objects import whatever they do not define. */
+			char defined = linker_defined(ln, i, re->sym);
+			char import = (ln->shared || ln->jit) && !defined;
+			if (ln->shared && !defined)
+				linker_import(ln, i, re->sym);
+
+			switch (re->type)
+			{
+			case ABSOLUTE:
+				/* only full addresses can be fixed up by the dynamic linker. */
+				if (!ln->shared)
+					break;
+
+				if (re->size != 8)
+				{
+					error_print("Relocation against `%s` cannot be used in a shared object.\n",
+						sy->name);
+					error_exit();
+				}
+
+				ln->rela_count++;
+				if (!(sec->flags & SEC_WRITE))
+					ln->textrel = 1;
+				break;
+			case RELATIVE:
+				if (ln->shared && !defined)
+				{
+					error_print("Relative reference to undefined symbol `%s`, use @plt or @gotpcrel.\n",
+						sy->name);
+					error_exit();
+				}
+				break;
+			case PLT_RELATIVE:
+				if (import && unit->plt[re->sym] == ~0)
+					unit->plt[re->sym] = ln->plt_count++;
+				break;
+			case GOT_RELATIVE:
+			case GOT_RELATIVE_REX:
+				/* every symbol loaded through the GOT gets its own slot. */
+				if (unit->got[re->sym] == ~0)
+				{
+					unit->got[re->sym] = ln->got_count++;
+					if (ln->shared)
+						ln->rela_count++;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	ln->import_count = ln->dyn_count;
+	if (!ln->shared)
+		return;
+
+	/* every global label that is not hidden is exported. */
+	size_t u;
+	for (size_t i = 0; i < ln->unit_count; i++)
+		for (size_t j = 0; j < ln->unit[i].as->sym_count; j++)
+		{
+			symbol_t *sy = &ln->unit[i].as->sym[j];
+			if (sy->type != GLOBAL_LABEL || sy->flags & SYM_HIDDEN
+				|| !(ln->unit[i].as->sec[sy->section].flags & SEC_ALLOC)
+				|| linker_find_global(ln, sy->name, &u) != sy)
+				continue;
+
+			ln->dyn = realloc(ln->dyn, ++ln->dyn_count * sizeof(dynsym_t));
+			dynsym_t *dyn = &ln->dyn[ln->dyn_count - 1];
+			dyn->name = sy->name;
+			dyn->unit = i;
+			dyn->sym = j;
+			dyn->hash = gnu_hash(sy->name);
+			ln->dynstr_count += strlen(sy->name) + 1;
+		}
+
+	/*
+	 * about two symbols per bucket keeps the chains short, while eight
+	 * bits per symbol keep the bloom filter at a few percent false positives.
+	 */
+	size_t exports = ln->dyn_count - ln->import_count;
+	ln->bucket_count = exports / 2 + 1;
+	for (ln->bloom_count = 1; ln->bloom_count * 64 < exports * 8; ln->bloom_count <<= 1);
+
+	/* the hashed symbols must be sorted by bucket. */
+	for (size_t i = ln->import_count; i < ln->dyn_count; i++)
+		ln->dyn[i].bucket = ln->dyn[i].hash % ln->bucket_count;
+	qsort(ln->dyn + ln->import_count, exports, sizeof(dynsym_t), compare_bucket);
+}
+
+void linker_import(linker_t *ln, size_t u, size_t sym)
+{
+	unit_t *unit = &ln->unit[u];
+	symbol_t *sy = &unit->as->sym[sym];
+
+	if (unit->dyn[sym] != ~0)
+		return;
+
+	/* all units share one dynamic symbol per name. */
+	for (size_t i = 0; i < ln->dyn_count; i++)
+		if (strcmp(ln->dyn[i].name, sy->name) == 0)
+		{
+			unit->dyn[sym] = i;
+			return;
+		}
+
+	ln->dyn = realloc(ln->dyn, ++ln->dyn_count * sizeof(dynsym_t));
+	dynsym_t *dyn = &ln->dyn[ln->dyn_count - 1];
+	dyn->name = sy->name;
+	dyn->unit = u;
+	dyn->sym = sym;
+	dyn->hash = 0;
+	dyn->bucket = 0;
+	unit->dyn[sym] = ln->dyn_count - 1;
+	ln->dynstr_count += strlen(sy->name) + 1;
+}
+
+void linker_layout(linker_t *ln, size_t header)
+{
+	size_t u;
+
+	/* a program without _start gets one that calls main. */
+	ln->stub = !ln->shared && !ln->jit && !linker_find_global(ln, "_start", &u)
+		&& linker_find_global(ln, "main", &u);
+
+	/* the layout can be redone, e.g. once the final base address is known. */
+	free(ln->out);
+	memset(ln->sec, 0, sizeof(ln->sec));
+	ln->sec_count = 0;
+
+	linker_scan(ln);
+
+	ln->sec[OUT_PLT].size = ln->plt_count * LINK_PLT_ENTRY;
+	ln->sec[OUT_GOT].size = ln->got_count * sizeof(size_t);
+	if (ln->plt_count > 0)
+		ln->sec[OUT_GOT_PLT].size = (LINK_GOT_PLT + ln->plt_count) * sizeof(size_t);
+	if (ln->shared)
+	{
+		size_t exports = ln->dyn_count - ln->import_count;
+		ln->sec[OUT_GNU_HASH].size = 4 * sizeof(int) + ln->bloom_count * sizeof(size_t)
+			+ (ln->bucket_count + exports) * sizeof(int);
+		ln->sec[OUT_DYNSYM].size = (ln->dyn_count + 1) * sizeof(Elf64_Sym);
+		ln->sec[OUT_DYNSTR].size = ln->dynstr_count;
+		ln->sec[OUT_RELA_DYN].size = ln->rela_count * sizeof(Elf64_Rela);
+		ln->sec[OUT_RELA_PLT].size = ln->plt_count * sizeof(Elf64_Rela);
+		ln->sec[OUT_DYNAMIC].size = linker_dynamic(ln, 0) * sizeof(Elf64_Dyn);
+	}
+
+	size_t off = header, pos;
+	for (enum segment_type t = TEXT; t <= BSS; t++)
+	{
+		segment_t *seg = &ln->seg[t], *prev = t > TEXT ? &ln->seg[t - 1] : 0;
+
+		/*
+		 * segments start on a new page, both in the file and in memory.
+		 * if the text is backed by huge pages, nothing else may share them.
+		 */
+		if (t == TEXT)
+		{
+			seg->off = 0;
+			seg->addr = ln->base;
+		}
+		else if (t == BSS)
+		{
+			seg->off = off;
+			seg->addr = align_by(prev->addr + prev->mem_size, 16);
+		}
+		else
+		{
+			off = align_by(off, LINK_PAGE);
+			seg->off = off;
+			seg->addr = align_by(prev->addr + prev->mem_size, t == RODATA
+				&& ln->huge ? LINK_HUGE_PAGE : LINK_PAGE);
+		}
+
+		pos = t == TEXT ? header : 0;
+		for (enum output_type o = OUT_TEXT; o < OUT_COUNT; o++)
+		{
+			output_t *out = &ln->sec[o];
+			if (segment_of_output(o) != t)
+				continue;
+
+			pos = align_by(pos, outputs[o].align);
+			out->addr = seg->addr + pos;
+			out->off = seg->off + pos;
+
+			if (o != user_output[t])
+			{
+				pos += out->size;
+				continue;
+			}
+
+			if (o == OUT_TEXT && ln->stub)
+			{
+				ln->stub = out->addr;
+				pos += sizeof(stub);
+			}
+
+			for (size_t i = 0; i < ln->unit_count; i++)
+				for (size_t s = 0; s < ln->unit[i].as->sec_count; s++)
+				{
+					section_t *sec = &ln->unit[i].as->sec[s];
+					if (!(sec->flags & SEC_ALLOC) || segment_of(sec) != t)
+						continue;
+
+					pos = align_by(pos, section_align(sec));
+					ln->unit[i].addr[s] = seg->addr + pos;
+					ln->unit[i].off[s] = seg->off + pos;
+					pos += t == BSS ? sec->reserved : sec->size;
+				}
+
+			out->size = seg->addr + pos - out->addr;
+		}
+
+		seg->mem_size = pos;
+		seg->size = t == BSS ? 0 : pos;
+		off = seg->off + seg->size;
+	}
+
+	/* the assembled sections always get a header, the others only if used. */
+	for (enum output_type o = OUT_TEXT; o < OUT_COUNT; o++)
+		if (o == user_output[segment_of_output(o)] || ln->sec[o].size > 0)
+			ln->sec[o].index = ++ln->sec_count;
+
+	ln->out_count = ln->seg[DATA].off + ln->seg[DATA].size;
+	ln->out = calloc(ln->out_count, 1);
+
+	symbol_t *start = linker_find_global(ln, "_start", &u);
+	if (ln->stub)
+		ln->entry = ln->stub;
+	else if (start)
+		ln->entry = linker_resolve(ln, u, start - &ln->unit[u].as->sym[0]);
+	else if (!ln->shared && !ln->jit)
+	{
+		error_print("Program defines neither `_start` nor `main`.\n");
+		error_exit();
+	}
+}
+
+size_t linker_dynamic(linker_t *ln, Elf64_Dyn *dyn)
+{
+	output_t *sec = ln->sec;
+	char rela = ln->rela_count > 0, plt = ln->plt_count > 0;
+	size_t count = 0;
+
+	/* tag, value and whether the entry is needed. */
+	const size_t tags[][3] =
+	{
+		{ DT_GNU_HASH, sec[OUT_GNU_HASH].addr, 1 },
+		{ DT_STRTAB, sec[OUT_DYNSTR].addr, 1 },
+		{ DT_SYMTAB, sec[OUT_DYNSYM].addr, 1 },
+		{ DT_STRSZ, sec[OUT_DYNSTR].size, 1 },
+		{ DT_SYMENT, sizeof(Elf64_Sym), 1 },
+		{ DT_RELA, sec[OUT_RELA_DYN].addr, rela },
+		{ DT_RELASZ, sec[OUT_RELA_DYN].size, rela },
+		{ DT_RELAENT, sizeof(Elf64_Rela), rela },
+		{ DT_PLTGOT, sec[OUT_GOT_PLT].addr, plt },
+		{ DT_JMPREL, sec[OUT_RELA_PLT].addr, plt },
+		{ DT_PLTRELSZ, sec[OUT_RELA_PLT].size, plt },
+		{ DT_PLTREL, DT_RELA, plt },
+		{ DT_TEXTREL, 0, ln->textrel },
+		/* references were bound to our own definitions at link time. */
+		{ DT_FLAGS, DF_BIND_NOW | DF_SYMBOLIC | (ln->textrel ? DF_TEXTREL : 0), 1 },
+		{ DT_FLAGS_1, DF_1_NOW, 1 },
+		{ DT_NULL, 0, 1 }
+	};
+
+	for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++)
+	{
+		if (!tags[i][2])
+			continue;
+
+		if (dyn)
+		{
+			dyn[count].d_tag = tags[i][0];
+			dyn[count].d_un.d_val = tags[i][1];
+		}
+		count++;
+	}
+
+	return count;
+}
+
+symbol_t* linker_find_global(linker_t *ln, const char *name, size_t *u)
+{
+	symbol_t *res = 0;
+
+	for (size_t i = 0; i < ln->unit_count; i++)
+		for (size_t j = 0; j < ln->unit[i].as->sym_count; j++)
+		{
+			symbol_t *sym = &ln->unit[i].as->sym[j];
+			if (sym->type != GLOBAL_LABEL || strcmp(sym->name, name) != 0)
+				continue;
+
+			/* weak definitions give way to the first strong one. */
+			if (res && !(res->flags & SYM_WEAK) && !(sym->flags & SYM_WEAK))
+			{
+				error_print("Multiple definitions of symbol `%s`.\n", name);
+				error_exit();
+			}
+
+			if (!res || (res->flags & SYM_WEAK && !(sym->flags & SYM_WEAK)))
+			{
+				res = sym;
+				*u = i;
+			}
+		}
+
+	return res;
+}
+
+char linker_defined(linker_t *ln, size_t u, size_t sym)
+{
+	symbol_t *sy = &ln->unit[u].as->sym[sym];
+	size_t def;
+
+	return sy->type != EXTERN || linker_find_global(ln, sy->name, &def);
+}
+
+size_t linker_resolve(linker_t *ln, size_t u, size_t sym)
+{
+	symbol_t *sy = &ln->unit[u].as->sym[sym];
+
+	if (sy->type != EXTERN)
+	{
+		if (!(ln->unit[u].as->sec[sy->section].flags & SEC_ALLOC))
+		{
+			error_print("Symbol `%s` is not part of the program image.\n", sy->name);
+			error_exit();
+		}
+
+		return ln->unit[u].addr[sy->section] + sy->addr;
+	}
+
+	size_t def;
+	symbol_t *res = linker_find_global(ln, sy->name, &def);
+	if (res)
+		return linker_resolve(ln, def, res - &ln->unit[def].as->sym[0]);
+
+	/* when loading in-process, the host may provide the symbol. */
+	if (ln->external && (def = ln->external(sy->name)))
+		return def;
+
+	/* undefined weak symbols resolve to zero. */
+	if (sy->flags & SYM_WEAK)
+		return 0;
+
+	error_print("Undefined reference to `%s`.\n", sy->name);
+	error_exit();
+	return 0;
+}
+
+void linker_relocate(linker_t *ln)
+{
+	output_t *got = &ln->sec[OUT_GOT], *got_plt = &ln->sec[OUT_GOT_PLT];
+	output_t *plt = &ln->sec[OUT_PLT];
+	size_t rela = 0, jump = 0;
+
+	for (size_t i = 0; i < ln->unit_count; i++)
+	{
+		unit_t *unit = &ln->unit[i];
+
+		for (size_t j = 0; j < unit->as->rel_count; j++)
+		{
+			reloc_t *re = &unit->as->rel[j];
+			if (!(unit->as->sec[re->section].flags & SEC_ALLOC))
+				continue;
+
+			/* imports of shared objects are only known at load time. */
+			char import = (ln->shared || ln->jit) && !linker_defined(ln, i, re->sym);
+			size_t p = unit->addr[re->section] + re->addr, size = 4;
+			long long s = import && ln->shared ? 0 : linker_resolve(ln, i, re->sym), v;
+
+			switch (re->type)
+			{
+			case ABSOLUTE:
+				v = s + (long long) re->add;
+				size = re->size;
+
+				if (!ln->shared)
+					break;
+				else if (import)
+					add_rela(ln, OUT_RELA_DYN, &rela, p, R_X86_64_64,
+						unit->dyn[re->sym] + 1, re->add);
+				else
+					add_rela(ln, OUT_RELA_DYN, &rela, p, R_X86_64_RELATIVE, 0, v);
+				break;
+			case RELATIVE:
+				v = s + (long long) re->add - 4 - (long long) p;
+				break;
+			case PLT_RELATIVE:
+				if (import)
+					s = plt->addr + unit->plt[re->sym] * LINK_PLT_ENTRY;
+				v = s + (long long) re->add - 4 - (long long) p;
+				break;
+			case GOT_RELATIVE:
+			case GOT_RELATIVE_REX:
+				v = got->addr + unit->got[re->sym] * sizeof(size_t)
+					+ (long long) re->add - 4 - (long long) p;
+				break;
+			default:
+				error_print("Unhandled relocation type.\n");
+				error_exit();
+			}
+
+			/* make sure the value survives the truncation. */
+			if ((size == 4 && (re->type == ABSOLUTE && !re->sign ?
+					v < 0 || v > 0xFFFFFFFFLL : v != (int) v))
+				|| (size == 2 && (v < -0x8000 || v > 0xFFFF))
+				|| (size == 1 && (v < -0x80 || v > 0xFF)))
+			{
+				error_print("Relocation against `%s` truncated to fit.\n",
+					unit->as->sym[re->sym].name);
+				error_exit();
+			}
+
+			memcpy(ln->out + unit->off[re->section] + re->addr, &v, size);
+		}
+
+		/* static programs get a GOT that is fully resolved at link time. */
+		for (size_t j = 0; j < unit->as->sym_count; j++)
+		{
+			if (unit->got[j] == ~0)
+				continue;
+
+			size_t slot = unit->got[j] * sizeof(size_t), v = 0;
+			if (ln->shared && !linker_defined(ln, i, j))
+				add_rela(ln, OUT_RELA_DYN, &rela, got->addr + slot,
+					R_X86_64_GLOB_DAT, unit->dyn[j] + 1, 0);
+			else
+			{
+				v = linker_resolve(ln, i, j);
+				if (ln->shared)
+					add_rela(ln, OUT_RELA_DYN, &rela, got->addr + slot,
+						R_X86_64_RELATIVE, 0, v);
+			}
+
+			memcpy(ln->out + got->off + slot, &v, sizeof(size_t));
+		}
+
+		/* plt entries jump through their slot in .got.plt. */
+		for (size_t j = 0; j < unit->as->sym_count; j++)
+		{
+			if (unit->plt[j] == ~0)
+				continue;
+
+			size_t entry = unit->plt[j] * LINK_PLT_ENTRY;
+			size_t slot = (LINK_GOT_PLT + unit->plt[j]) * sizeof(size_t);
+			int rel = got_plt->addr + slot - (plt->addr + entry + 6);
+			memcpy(ln->out + plt->off + entry, plt_entry, LINK_PLT_ENTRY);
+			memcpy(ln->out + plt->off + entry + 2, &rel, sizeof(int));
+
+			if (ln->shared)
+				add_rela(ln, OUT_RELA_PLT, &jump, got_plt->addr + slot,
+					R_X86_64_JUMP_SLOT, unit->dyn[j] + 1, 0);
+			else
+			{
+				size_t v = linker_resolve(ln, i, j);
+				memcpy(ln->out + got_plt->off + slot, &v, sizeof(size_t));
+			}
+		}
+	}
+
+	if (ln->stub)
+	{
+		size_t u;
+		symbol_t *main = linker_find_global(ln, "main", &u);
+		int v = linker_resolve(ln, u, main - &ln->unit[u].as->sym[0])
+			- (ln->stub + STUB_CALL + 4);
+		memcpy(ln->out + ln->stub - ln->seg[TEXT].addr + STUB_CALL, &v, 4);
+	}
+}
+
+void linker_write_dynamic(linker_t *ln)
+{
+	size_t exports = ln->dyn_count - ln->import_count, name = 1;
+	Elf64_Sym *esy = (Elf64_Sym*) (ln->out + ln->sec[OUT_DYNSYM].off) + 1;
+	char *str = ln->out + ln->sec[OUT_DYNSTR].off;
+
+	/* imports come first and are not part of the hash table. */
+	for (size_t i = 0; i < ln->dyn_count; i++, esy++)
+	{
+		dynsym_t *dyn = &ln->dyn[i];
+		symbol_t *sy = &ln->unit[dyn->unit].as->sym[dyn->sym];
+		char bind = sy->flags & SYM_WEAK ? STB_WEAK : STB_GLOBAL;
+
+		esy->st_name = name;
+		strcpy(str + name, dyn->name);
+		name += strlen(dyn->name) + 1;
+
+		if (i < ln->import_count)
+		{
+			esy->st_info = ELF64_ST_INFO(bind, STT_NOTYPE);
+			esy->st_shndx = SHN_UNDEF;
+			continue;
+		}
+
+		enum segment_type t = segment_of(&ln->unit[dyn->unit].as->sec[sy->section]);
+		esy->st_info = ELF64_ST_INFO(bind, t == TEXT ? STT_FUNC : STT_OBJECT);
+		esy->st_shndx = ln->sec[user_output[t]].index;
+		esy->st_value = linker_resolve(ln, dyn->unit, dyn->sym);
+		esy->st_size = sy->size;
+	}
+
+	/* header, bloom filter, buckets and chains of the gnu hash table. */
+	unsigned int *head = (unsigned int*) (ln->out + ln->sec[OUT_GNU_HASH].off);
+	size_t *bloom = (size_t*) (head + 4);
+	unsigned int *bucket = (unsigned int*) (bloom + ln->bloom_count);
+	unsigned int *chain = bucket + ln->bucket_count;
+	head[0] = ln->bucket_count;
+	head[1] = ln->import_count + 1;
+	head[2] = ln->bloom_count;
+	head[3] = LINK_BLOOM_SHIFT;
+
+	for (size_t i = 0; i < exports; i++)
+	{
+		dynsym_t *dyn = &ln->dyn[ln->import_count + i];
+		bloom[(dyn->hash / 64) & (ln->bloom_count - 1)] |= (size_t) 1 << (dyn->hash % 64)
+			| (size_t) 1 << ((dyn->hash >> LINK_BLOOM_SHIFT) % 64);
+
+		if (!bucket[dyn->bucket])
+			bucket[dyn->bucket] = ln->import_count + 1 + i;
+
+		/* the lowest bit marks the end of a chain. */
+		chain[i] = (dyn->hash & ~1) | (i + 1 == exports || dyn[1].bucket != dyn->bucket);
+	}
+
+	linker_dynamic(ln, (Elf64_Dyn*) (ln->out + ln->sec[OUT_DYNAMIC].off));
+
+	/* the first .got.plt entry points at the dynamic section. */
+	if (ln->plt_count > 0)
+		memcpy(ln->out + ln->sec[OUT_GOT_PLT].off, &ln->sec[OUT_DYNAMIC].addr, sizeof(size_t));
+}
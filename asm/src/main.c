@@ -1,20 +1,325 @@
-
 #include "obj.h"
+#include "linker.h"
+#include "jit.h"
+#include "harness.h"
+#include "peephole.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static asm_t* bench_driver(asm_t **units, size_t count, size_t runs, char perf)
+{
+	size_t kernels = 0, size;
+	for (size_t i = 0; i < count; i++)
+		kernels += units[i]->bench_count;
+
+	if (kernels == 0)
+	{
+		printf("No kernels marked with bench_begin to benchmark.\n");
+		exit(1);
+	}
+
+	char *src = harness_generate(units, count, runs, perf, &size);
+	asm_t *as = asm_init(lexer_init_buffer(src, size));
+	as->file = "<bench>";
+	asm_full_pass(as);
+	free(src);
+	return as;
+}
+
+/* one symbol per line, as written by perf scripts or other linkers, `#` starts a comment. */
+static char** read_order(const char *file, size_t *count)
+{
+	size_t size;
+	char *src = lexer_read_file(file, &size), **order = 0;
+	*count = 0;
+
+	for (char *line = strtok(src, "\n"); line; line = strtok(0, "\n"))
+	{
+		line += strspn(line, " \t");
+		size_t len = strcspn(line, " \t\r#");
+		if (len == 0)
+			continue;
+
+		order = realloc(order, ++*count * sizeof(char*));
+		order[*count - 1] = strndup(line, len);
+	}
+
+	free(src);
+	return order;
+}
+
+/* -O rewrites the program before it is assembled, which needs all of it up front. */
+static char* read_input(const char *file, char optimize, char info, size_t *size)
+{
+	if (strcmp(file, "-") == 0)
+	{
+		printf("Optimizing requires the program as a file, not `-`.\n");
+		exit(1);
+	}
+
+	char *src = lexer_read_file(file, size);
+	if (!optimize)
+		return src;
+
+	char *opt = peephole_run(src, *size, file, info ? stderr : 0, size);
+	free(src);
+	return opt;
+}
+
+static lexer_t* open_input(const char *file, char optimize, char info)
+{
+	if (!optimize)
+		return lexer_init(file);
+
+	size_t size;
+	char *src = read_input(file, optimize, info, &size);
+	lexer_t *lex = lexer_init_buffer(src, size);
+	free(src);
+	return lex;
+}
 
 int main(int argc, char** argv)
 {
-	if (argc != 2 && argc != 3)
+	char function_sections = 0, link = 0, huge = 0, shared = 0, jit = 0,
+		incremental = 0, debug = 0, infer_cfi = 0, show_stats = 0, optimize = 0,
+		opt_info = 0, *cache_dir = 0;
+	const uarch_t *analyze = 0;
+	size_t bench = 0, bench_perf = 0, order_count = 0;
+	char **order = 0;
+	asm_t **units = calloc(argc, sizeof(asm_t*));
+
+	/* consume options first, the remaining arguments are positional. */
+	for (; argc > 1 && argv[1][0] == '-' && argv[1][1]; argc--, argv++)
+		if (strcmp(argv[1], "-ffunction-sections") == 0)
+			function_sections = 1;
+		else if (strcmp(argv[1], "-static") == 0)
+			link = 1;
+		else if (strcmp(argv[1], "-shared") == 0)
+			link = shared = 1;
+		else if (strcmp(argv[1], "-jit") == 0)
+			jit = 1;
+		else if (strcmp(argv[1], "-fhuge-text") == 0)
+			huge = 1;
+		else if (strcmp(argv[1], "-g") == 0)
+			debug = 1;
+		else if (strcmp(argv[1], "-finfer-cfi") == 0)
+			infer_cfi = 1;
+		else if (strcmp(argv[1], "-fincremental") == 0)
+			incremental = 1;
+		else if (strncmp(argv[1], "-fcache-dir=", 12) == 0)
+			cache_dir = argv[1] + 12;
+		else if (strcmp(argv[1], "-fbench") == 0)
+			bench = HARNESS_RUNS;
+		else if (strcmp(argv[1], "-fbench-perf") == 0)
+			bench_perf = 1;
+		else if (strncmp(argv[1], "-fbench=", 8) == 0)
+		{
+			if ((bench = strtoul(argv[1] + 8, 0, 0)) == 0)
+			{
+				printf("Invalid number of benchmark runs `%s`.\n", argv[1] + 8);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[1], "-fsymbol-ordering-file=", 23) == 0)
+			order = read_order(argv[1] + 23, &order_count);
+		else if (strcmp(argv[1], "-O") == 0)
+			optimize = 1;
+		else if (strcmp(argv[1], "-fopt-info") == 0)
+			opt_info = 1;
+		else if (strcmp(argv[1], "--stats") == 0)
+			show_stats = 1;
+		else if (strcmp(argv[1], "-fanalyze") == 0)
+			analyze = cost_find_uarch("skylake");
+		else if (strncmp(argv[1], "-fanalyze=", 10) == 0)
+		{
+			if (!(analyze = cost_find_uarch(argv[1] + 10)))
+			{
+				printf("Unknown microarchitecture `%s`.\n", argv[1] + 10);
+				exit(1);
+			}
+		}
+		else
+		{
+			printf("Unknown option `%s` to asm program.\n", argv[1]);
+			exit(1);
+		}
+
+	if (show_stats)
+	{
+#ifdef ASM_STATS
+		stats_enable();
+#else
+		printf("Statistics are not compiled in, rebuild with STATS=1.\n");
+		exit(1);
+#endif
+	}
+
+	/* kernels between bench_begin and bench_end are timed by a generated main. */
+	if (bench_perf && !bench)
+		bench = HARNESS_RUNS;
+	if (bench && !jit && !link)
+	{
+		printf("Benchmarks require either -static or -jit.\n");
+		exit(1);
+	}
+
+	/* run all inputs in-process, arguments after `--` are passed to main. */
+	if (jit)
+	{
+		jit_t *jt = jit_init();
+		size_t i = 1;
+		for (; i < argc && strcmp(argv[i], "--") != 0; i++)
+		{
+			asm_t *as = asm_init(open_input(argv[i], optimize, opt_info));
+			as->function_sections = function_sections;
+			as->debug = debug;
+			as->cfi_infer = infer_cfi;
+			as->order = order;
+			as->order_count = order_count;
+			as->file = argv[i];
+			asm_full_pass(as);
+			jit_add(jt, as);
+			units[i - 1] = as;
+		}
+
+		if (i == 1)
+		{
+			printf("Invalid arguments to asm program.\n");
+			exit(1);
+		}
+
+		if (bench)
+			jit_add(jt, bench_driver(units, i - 1, bench, bench_perf));
+
+		/* the program sees the first input as its name. */
+		char **args = i < argc ? &argv[i] : &argv[i - 1];
+		int count = i < argc ? argc - i : 1;
+		args[0] = argv[1];
+		jit_load(jt);
+		if (optimize && opt_info)
+			peephole_report(stderr);
+		if (show_stats)
+			STATS_REPORT(stderr);
+		return jit_run(jt, count, args);
+	}
+
+	/* link all inputs into an executable or shared object, the last argument names it. */
+	if (link)
+	{
+		if (argc < 3)
+		{
+			printf("Invalid arguments to asm program.\n");
+			exit(1);
+		}
+
+		linker_t *ln = linker_init(huge, shared);
+		for (size_t i = 1; i < argc - 1; i++)
+		{
+			asm_t *as = asm_init(open_input(argv[i], optimize, opt_info));
+			as->listing = stdout;
+			as->analyze = analyze;
+			as->function_sections = function_sections;
+			as->debug = debug;
+			as->cfi_infer = infer_cfi;
+			as->order = order;
+			as->order_count = order_count;
+			as->file = argv[i];
+			asm_full_pass(as);
+			linker_add(ln, as);
+			units[i - 1] = as;
+		}
+
+		if (bench)
+			linker_add(ln, bench_driver(units, argc - 2, bench, bench_perf));
+
+		char *out;
+		STATS_BEGIN(STATS_WRITE);
+		size_t size = linker_to_elf(ln, &out);
+		STATS_END(STATS_WRITE);
+		FILE *fp = fopen(argv[argc - 1], "wb");
+
+		if (!fp)
+		{
+			printf("Failed to open output file `%s`.\n", argv[argc - 1]);
+			exit(1);
+		}
+
+		fwrite(out, size, 1, fp);
+		fclose(fp);
+		chmod(argv[argc - 1], 0755);
+		printf("Wrote %d bytes to `%s`.\n", size, argv[argc - 1]);
+		if (optimize && opt_info)
+			peephole_report(stderr);
+		if (show_stats)
+			STATS_REPORT(stderr);
+		return 0;
+	}
+
+	if (argc != 2 && argc != 3 || incremental && argc != 3)
 	{
 		printf("Invalid arguments to asm program.\n");
 		exit(1);
 	}
 
-	lexer_t* lex = lexer_init(argv[1]);
+	/* identical sources assemble to identical objects, reuse those of earlier runs. */
+	size_t src_size;
+	char *src = 0;
+	uint64_t key;
+	if (cache_dir && argc == 3 && strcmp(argv[1], "-") != 0 || optimize)
+		src = read_input(argv[1], optimize, opt_info, &src_size);
+
+	if (src && cache_dir && argc == 3)
+	{
+		key = cache_key(src, src_size, function_sections | debug << 1
+			| infer_cfi << 2);
+
+		/* debug information names the source and where it was assembled. */
+		char *cwd = getcwd(0, 0);
+		if (debug && cwd)
+			key = cache_hash_data(cache_hash_data(key, argv[1], strlen(argv[1])),
+				cwd, strlen(cwd));
+		free(cwd);
+
+		for (size_t i = 0; i < order_count; i++)
+			key = cache_hash_data(key, order[i], strlen(order[i]) + 1);
+
+		size_t size = cache_fetch(cache_dir, key, argv[2]);
+		if (size > 0)
+		{
+			printf("Wrote %d bytes to `%s`.\n", size, argv[2]);
+			return 0;
+		}
+	}
+
+	lexer_t* lex = src ? lexer_init_buffer(src, src_size) : lexer_init(argv[1]);
 	asm_t* as = asm_init(lex);
+	as->listing = stdout;
+	as->analyze = analyze;
+	as->function_sections = function_sections;
+	as->debug = debug;
+	as->cfi_infer = infer_cfi;
+	as->order = order;
+	as->order_count = order_count;
+	as->file = argv[1];
+
+	/* the encodings of the previous run are kept next to the object. */
+	char *cache = 0;
+	if (incremental)
+	{
+		cache = calloc(strlen(argv[2]) + 7, 1);
+		sprintf(cache, "%s.cache", argv[2]);
+		as->cache = cache_load(cache);
+		as->listing = 0;
+	}
+
 	asm_full_pass(as);
 
+	if (cache)
+		cache_save(as->cache, cache);
+
 	if (argc == 3)
 	{
 		char *out;
@@ -31,8 +336,14 @@ int main(int argc, char** argv)
 		fwrite(out, size, 1, fp);
 		fclose(fp);
 		printf("Wrote %d bytes to `%s`.\n", size, argv[2]);
+
+		if (src && cache_dir)
+			cache_store(cache_dir, key, argv[2]);
 	}
 
+	if (optimize && opt_info)
+		peephole_report(stderr);
+	if (show_stats)
+		STATS_REPORT(stderr);
 	return 0;
 }
-
@@ -1,20 +1,87 @@
-
 #include "obj.h"
+#include "dwarf.h"
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #define ELF_SHEADER(elf) ((Elf64_Shdr *)((size_t)elf + elf->e_shoff))
 #define ELF_SECTION(elf, ind) (&ELF_SHEADER(elf)[ind])
 
+/* index of the string table and of the first section we assembled. */
+#define ELF_STRTAB 1
+#define ELF_FIRST 2
+
 size_t asm_to_obj(asm_t *as, char **out)
 {
 	/* other object file formats can be added here. */
-	return asm_to_elf_obj(as, out);
+	STATS_BEGIN(STATS_WRITE);
+	size_t size = asm_to_elf_obj(as, out);
+	STATS_END(STATS_WRITE);
+	return size;
 }
 
 size_t asm_to_elf_obj(asm_t *as, char **out)
 {
-	const char* sections[] = { "", ".strtab", ".text", ".data", ".symtab", ".rela.text" };
+	/* each section with relocations gets its own relocation section. */
+	size_t *rela = alloca(as->sec_count * sizeof(size_t)), rela_count = 0;
+	size_t symtab = ELF_FIRST + as->sec_count;
+	memset(rela, 0, as->sec_count * sizeof(size_t));
+
+	for (size_t i = 0; i < as->rel_count; i++)
+		rela[asm_iterate_relocs(as, i)->section] = 1;
+
+	for (size_t i = 0; i < as->sec_count; i++)
+		if (rela[i])
+			rela[i] = symtab + 1 + rela_count++;
+
+	/* debug and unwind information follows, along with its own relocation sections. */
+	size_t debug = symtab + 1 + rela_count, debug_rela[DWARF_COUNT] = { 0 }, nsec = 0;
+	size_t shnum = debug;
+	dwarf_t *dw = dwarf_init(as);
+	if (dw)
+	{
+		for (size_t i = 0; i < DWARF_COUNT; i++)
+			if (dw->sec[i].present)
+				dw->index[i] = shnum++;
+
+		/* relocations in these sections are against section symbols. */
+		nsec = as->sec_count + shnum - debug;
+
+		char *cwd = getcwd(0, 0);
+		dwarf_build(dw, as, cwd ? cwd : ".", ELF_FIRST);
+		free(cwd);
+
+		for (size_t i = 0; i < DWARF_COUNT; i++)
+			if (dw->sec[i].rel_count > 0)
+				debug_rela[i] = shnum++;
+	}
+
+	char **sections = alloca(shnum * sizeof(char*));
+	sections[0] = "";
+	sections[ELF_STRTAB] = ".strtab";
+	sections[symtab] = ".symtab";
+	for (size_t i = 0; i < as->sec_count; i++)
+	{
+		sections[ELF_FIRST + i] = as->sec[i].name;
+
+		if (rela[i])
+		{
+			sections[rela[i]] = calloc(strlen(as->sec[i].name) + 6, 1);
+			sprintf(sections[rela[i]], ".rela%s", as->sec[i].name);
+		}
+	}
+
+	for (size_t i = 0; dw && i < DWARF_COUNT; i++)
+	{
+		if (dw->sec[i].present)
+			sections[dw->index[i]] = (char*) dw->sec[i].name;
+
+		if (debug_rela[i])
+		{
+			sections[debug_rela[i]] = calloc(strlen(dw->sec[i].name) + 6, 1);
+			sprintf(sections[debug_rela[i]], ".rela%s", dw->sec[i].name);
+		}
+	}
 
 	size_t size = sizeof(Elf64_Ehdr);
 	Elf64_Ehdr *elf = calloc(1, size);
@@ -32,8 +99,8 @@ size_t asm_to_elf_obj(asm_t *as, char **out)
 	elf->e_shoff = size;
 	elf->e_ehsize = size;
 	elf->e_shentsize = sizeof(Elf64_Shdr);
-	elf->e_shnum = sizeof(sections) / sizeof(char*);
-	elf->e_shstrndx = 1;
+	elf->e_shnum = shnum;
+	elf->e_shstrndx = ELF_STRTAB;
 
 	/* create our sections here */
 	for (size_t i = 0; i < elf->e_shnum; i++)
@@ -72,54 +139,86 @@ size_t asm_to_elf_obj(asm_t *as, char **out)
 		size += len;
 	}
 
-	section_t *text_s = asm_find_section(as, ".text"),
-		  *data_s = asm_find_section(as, ".data");
-
-	Elf64_Shdr *text = ELF_SECTION(elf, 2);
-	text->sh_type = SHT_PROGBITS;
-	text->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
-	text->sh_offset = size + (text_s ? text_s->addr : 0);
-	text->sh_size = text_s ? text_s->size : 0;
-	
-	Elf64_Shdr *data = ELF_SECTION(elf, 3);
-	data->sh_type = SHT_PROGBITS;
-	data->sh_flags = SHF_ALLOC | SHF_WRITE;
-	data->sh_offset = size + (data_s ? data_s->addr : 0);
-	data->sh_size = data_s ? data_s->size : 0;
+	for (size_t i = 0; i < as->sec_count; i++)
+	{
+		se = &as->sec[i];
+		sec = ELF_SECTION(elf, ELF_FIRST + i);
+		sec->sh_offset = size + se->addr;
+
+		/* zero-fill sections do not occupy any space in the file. */
+		if (se->flags & SEC_NOBITS)
+		{
+			sec->sh_type = SHT_NOBITS;
+			sec->sh_size = se->reserved;
+		}
+		else
+		{
+			sec->sh_type = SHT_PROGBITS;
+			sec->sh_size = se->size;
+		}
+
+		if (se->flags & SEC_ALLOC)
+		{
+			sec->sh_flags |= SHF_ALLOC;
+			sec->sh_addralign = 16;
+		}
+		if (se->flags & SEC_WRITE)
+			sec->sh_flags |= SHF_WRITE;
+		if (se->flags & SEC_EXEC)
+			sec->sh_flags |= SHF_EXECINSTR;
+
+		/* the linker folds identical entries of mergeable sections. */
+		if (se->flags & SEC_MERGE)
+		{
+			sec->sh_flags |= SHF_MERGE;
+			sec->sh_entsize = se->entsize;
+			sec->sh_addralign = se->entsize;
+		}
+		if (se->flags & SEC_STRINGS)
+			sec->sh_flags |= SHF_STRINGS;
+		if (se->flags & SEC_TLS)
+			sec->sh_flags |= SHF_TLS;
+	}
 
 	elf = realloc(elf, size + as->out_count);
 	memcpy((char*) elf + size, as->out, as->out_count);
 	size += as->out_count;
 
-	Elf64_Shdr *sym = ELF_SECTION(elf, 4);
+	Elf64_Shdr *sym = ELF_SECTION(elf, symtab);
+	Elf64_Sym *esy;
 	sym->sh_type = SHT_SYMTAB;
 	sym->sh_offset = size;
-	sym->sh_size = (as->sym_count + 1) * sizeof(Elf64_Sym);
+	sym->sh_size = (as->sym_count + nsec + 1) * sizeof(Elf64_Sym);
 	sym->sh_link = elf->e_shstrndx;
-	sym->sh_info = 1;
+	sym->sh_info = nsec + 1;
 	sym->sh_entsize = sizeof(Elf64_Sym);
-	
+
 	elf = realloc(elf, size + sym->sh_size);
-	sym = ELF_SECTION(elf, 4);
+	sym = ELF_SECTION(elf, symtab);
 	memset((char*) elf + size, 0, sym->sh_size);
+
+	for (size_t i = 0; i < nsec; i++)
+	{
+		esy = (Elf64_Sym*) ((char*) elf + size) + 1 + i;
+		esy->st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+		esy->st_shndx = i < as->sec_count ? ELF_FIRST + i : debug + i - as->sec_count;
+	}
 	size += sym->sh_size;
 
-	Elf64_Sym *esy;
 	size_t *sy2esy = alloca(as->sym_count * sizeof(size_t));
 	size_t ind = 0;
 	for (char b = 0; b < 2; b++)
 		for (size_t i = 0; i < as->sym_count; i++)
 		{
 			sy = asm_iterate_symbols(as, i);
-			se = &as->sec[sy->section];
 			esy = (Elf64_Sym*) ((char*) elf + size - (as->sym_count - ind) * sizeof(Elf64_Sym));
-			
+
 			if (b == (sy->type == LABEL))
 				continue;
-			
+
 			esy->st_name = string_ind[i];
 			esy->st_value = sy->addr;
-			esy->st_size = 1;
+			esy->st_size = sy->size;
 			esy->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
 			sy2esy[i] = ind++;
 
@@ -129,67 +228,157 @@ size_t asm_to_elf_obj(asm_t *as, char **out)
 				esy->st_info = ELF64_ST_INFO(STB_LOCAL, STT_FUNC);
 				sym->sh_info++;
 			case GLOBAL_LABEL:
-				if (se == text_s)
-					esy->st_shndx = 2;
-				else if (se == data_s)
-				{
+				se = &as->sec[sy->section];
+				if (se->flags & SEC_TLS)
+					esy->st_info = (esy->st_info & ~0xF) | ELF64_ST_TYPE(STT_TLS);
+				else if (!(se->flags & SEC_EXEC))
 					esy->st_info = (esy->st_info & ~0xF) | ELF64_ST_TYPE(STT_OBJECT);
-					esy->st_shndx = 3;
-				}
-				else
-				{
-					printf("Encountered label (%s:%s) outside of defined sections!\n",
-							se->name, sy->name);
-					exit(1);
-				}
+				esy->st_shndx = ELF_FIRST + sy->section;
 				break;
 			case EXTERN:
+				/* the linker rejects thread-local accesses to symbols of any other type. */
+				if (sy->flags & SYM_TLS)
+					esy->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_TLS);
 				esy->st_shndx = SHN_UNDEF;
 				break;
 			default:
 				break;
 			}
+
+			if (sy->flags & SYM_WEAK)
+				esy->st_info = ELF64_ST_INFO(STB_WEAK, ELF64_ST_TYPE(esy->st_info));
+			if (sy->flags & SYM_HIDDEN)
+				esy->st_other = STV_HIDDEN;
 		}
-	
-	Elf64_Shdr *rel = ELF_SECTION(elf, 5);
-	rel->sh_type = SHT_RELA;
-	rel->sh_offset = size;
-	rel->sh_size = as->rel_count * sizeof(Elf64_Rela);
-	rel->sh_link = 4;
-	rel->sh_info = 2;
-	rel->sh_entsize = sizeof(Elf64_Rela);
-	
-	elf = realloc(elf, size + rel->sh_size);
-	rel = ELF_SECTION(elf, 5);
-	memset((char*) elf + size, 0, rel->sh_size);
-	size += rel->sh_size;
 
 	Elf64_Rela *erel;
+	Elf64_Shdr *rel;
 	reloc_t *re;
-	for (size_t i = 0; i < as->rel_count; i++)
+	for (size_t s = 0; s < as->sec_count; s++)
+	{
+		if (!rela[s])
+			continue;
+
+		rel = ELF_SECTION(elf, rela[s]);
+		rel->sh_type = SHT_RELA;
+		rel->sh_flags = SHF_INFO_LINK;
+		rel->sh_offset = size;
+		rel->sh_link = symtab;
+		rel->sh_info = ELF_FIRST + s;
+		rel->sh_entsize = sizeof(Elf64_Rela);
+
+		for (size_t i = 0; i < as->rel_count; i++)
+		{
+			re = asm_iterate_relocs(as, i);
+			if (re->section != s)
+				continue;
+
+			elf = realloc(elf, size + sizeof(Elf64_Rela));
+			rel = ELF_SECTION(elf, rela[s]);
+			rel->sh_size += sizeof(Elf64_Rela);
+			erel = (Elf64_Rela*) ((char*) elf + size);
+			size += sizeof(Elf64_Rela);
+
+			erel->r_offset = re->addr;
+			size_t sy_ind = sy2esy[re->sym] + nsec + 1;
+
+			switch (re->type)
+			{
+			case ABSOLUTE:
+				if (re->size == 8)
+					erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_64);
+				else if (re->size == 4)
+					erel->r_info = ELF64_R_INFO(sy_ind, re->sign ?
+						R_X86_64_32S : R_X86_64_32);
+				else if (re->size == 2)
+					erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_16);
+				else
+					erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_8);
+				erel->r_addend = re->add;
+				break;
+			case RELATIVE:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_PC32);
+				erel->r_addend = re->add - 4;
+				break;
+			case PLT_RELATIVE:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_PLT32);
+				erel->r_addend = re->add - 4;
+				break;
+			case GOT_RELATIVE:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_GOTPCRELX);
+				erel->r_addend = re->add - 4;
+				break;
+			case GOT_RELATIVE_REX:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_REX_GOTPCRELX);
+				erel->r_addend = re->add - 4;
+				break;
+			case TLS_OFFSET:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_TPOFF32);
+				erel->r_addend = re->add;
+				break;
+			case TLS_GOT_RELATIVE:
+				erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_GOTTPOFF);
+				erel->r_addend = re->add - 4;
+				break;
+			default:
+				error_print("Unhandled relocation type.\n");
+				error_exit();
+			}
+		}
+	}
+
+	for (size_t i = 0; dw && i < DWARF_COUNT; i++)
 	{
-		re = asm_iterate_relocs(as, i);
-		erel = (Elf64_Rela*) ((char*) elf + size - (as->rel_count - i) * sizeof(Elf64_Rela));
-		erel->r_offset = re->addr;
-		size_t sy_ind = sy2esy[re->sym] + 1;
+		dwarf_section_t *ds = &dw->sec[i];
+		if (!ds->present)
+			continue;
+
+		/* keep the unwind tables aligned within the file. */
+		size_t pad = (ds->align - size % ds->align) % ds->align;
+		elf = realloc(elf, size + pad + ds->size);
+		memset((char*) elf + size, 0, pad);
+		size += pad;
+		memcpy((char*) elf + size, ds->data, ds->size);
+
+		sec = ELF_SECTION(elf, dw->index[i]);
+		sec->sh_type = ds->type;
+		sec->sh_flags = ds->flags;
+		sec->sh_offset = size;
+		sec->sh_size = ds->size;
+		sec->sh_addralign = ds->align;
+		size += ds->size;
+
+		if (!debug_rela[i])
+			continue;
 
-		switch (re->type)
+		sec = ELF_SECTION(elf, debug_rela[i]);
+		sec->sh_type = SHT_RELA;
+		sec->sh_flags = SHF_INFO_LINK;
+		sec->sh_offset = size;
+		sec->sh_size = ds->rel_count * sizeof(Elf64_Rela);
+		sec->sh_link = symtab;
+		sec->sh_info = dw->index[i];
+		sec->sh_entsize = sizeof(Elf64_Rela);
+
+		elf = realloc(elf, size + ds->rel_count * sizeof(Elf64_Rela));
+		for (size_t j = 0; j < ds->rel_count; j++)
 		{
-		case ABSOLUTE:
-			erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_64);
-			erel->r_addend = re->add;
-			break;
-		case RELATIVE:
-			erel->r_info = ELF64_R_INFO(sy_ind, R_X86_64_PC32);
-			erel->r_addend = re->add - 4;
-			break;
-		default:
-			printf("Unhandled relocation type.\n");
-			exit(1);
+			dwarf_rel_t *dr = &ds->rel[j];
+			size_t sy_ind = dr->section < debug ? dr->section - ELF_FIRST + 1
+				: as->sec_count + dr->section - debug + 1;
+
+			erel = (Elf64_Rela*) ((char*) elf + size);
+			erel->r_offset = dr->offset;
+			erel->r_info = ELF64_R_INFO(sy_ind, dr->pcrel ? R_X86_64_PC32
+				: dr->size == 8 ? R_X86_64_64 : R_X86_64_32);
+			erel->r_addend = dr->add;
+			size += sizeof(Elf64_Rela);
 		}
 	}
 
+	if (dw)
+		dwarf_free(dw);
+
 	*out = (char*) elf;
 	return size;
 }
-
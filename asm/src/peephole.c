@@ -0,0 +1,396 @@
+#include "peephole.h"
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+/* instructions by their effect on the flags, everything unlisted is assumed to read them. */
+#define PEEP_WRITES "add sub cmp test xor and or neg"
+#define PEEP_KEEPS "mov lea push pop nop xchg movzx movsx lfence mfence sfence"
+
+static char peep_jump_next(peephole_t *ph, size_t i);
+static char peep_mov_pair(peephole_t *ph, size_t i);
+static char peep_zero_mov(peephole_t *ph, size_t i);
+static char peep_inc_dec(peephole_t *ph, size_t i);
+static char peep_cmp_zero(peephole_t *ph, size_t i);
+
+static peep_rule_t rules[] =
+{
+	{ "jump-next", peep_jump_next, 5, 1 },
+	{ "mov-pair", peep_mov_pair, 3, 1 },
+	{ "zero-mov", peep_zero_mov, 5, 1 },
+	{ "inc-dec", peep_inc_dec, 1, 0 },
+	{ "cmp-zero", peep_cmp_zero, 1, 0 }
+};
+
+static char is_one_of(const char *mnemonic, const char *list)
+{
+	size_t len = strlen(mnemonic);
+	for (const char *it = list; *it; it += strspn(it, " "))
+	{
+		size_t word = strcspn(it, " ");
+		if (word == len && strncmp(it, mnemonic, len) == 0)
+			return 1;
+		it += word;
+	}
+
+	return 0;
+}
+
+static peep_line_t peep_parse(const char *text, size_t loc)
+{
+	peep_line_t pl = { .text = strdup(text), .loc = loc };
+	char *buf = strdup(text), *it = buf, quote = 0;
+
+	/* comments start at `#` outside of string literals. */
+	for (char *c = buf; *c; c++)
+		if (*c == '"')
+			quote = !quote;
+		else if (*c == '#' && !quote)
+		{
+			*c = '\0';
+			break;
+		}
+
+	for (it += strspn(it, " \t"); *it; it += strspn(it, " \t"))
+	{
+		size_t len = strcspn(it, " \t"), name = len;
+		if (it[len - 1] != ':')
+			break;
+
+		while (name > 0 && it[name - 1] == ':')
+			name--;
+		pl.label = realloc(pl.label, ++pl.label_count * sizeof(char*));
+		pl.label[pl.label_count - 1] = strndup(it, name);
+		it += len;
+	}
+
+	if (*it)
+	{
+		size_t len = strcspn(it, " \t");
+		pl.mnemonic = strndup(it, len);
+		pl.upper = isupper(*it) != 0;
+		for (char *c = pl.mnemonic; *c; c++)
+			*c = tolower(*c);
+
+		/* only the first two operands are kept, but all are counted. */
+		for (it += len; *it; it += *it == ',')
+		{
+			it += strspn(it, " \t");
+			size_t op = strcspn(it, ",");
+			while (op > 0 && isspace(it[op - 1]))
+				op--;
+			if (op == 0)
+				break;
+
+			if (pl.op_count < 2)
+				pl.op[pl.op_count] = strndup(it, op);
+			pl.op_count++;
+			it += strcspn(it, ",");
+		}
+	}
+
+	free(buf);
+	return pl;
+}
+
+static void peep_free(peep_line_t *pl)
+{
+	for (size_t i = 0; i < pl->label_count; i++)
+		free(pl->label[i]);
+	for (size_t i = 0; i < pl->op_count && i < 2; i++)
+		free(pl->op[i]);
+	free(pl->label);
+	free(pl->mnemonic);
+	free(pl->text);
+}
+
+/* operands are equal if they only differ in case and spacing. */
+static char peep_same(const char *a, const char *b)
+{
+	for (;; a++, b++)
+	{
+		a += strspn(a, " \t");
+		b += strspn(b, " \t");
+		if (tolower(*a) != tolower(*b))
+			return 0;
+		if (!*a)
+			return 1;
+	}
+}
+
+static reg_t* peep_reg(const char *op)
+{
+	return op[0] == '[' ? 0 : asm_find_reg(op);
+}
+
+static char peep_uses(const char *mem, reg_t *r)
+{
+	char name[8];
+	for (const char *it = mem; *it; it++)
+	{
+		size_t len = strspn(it, "abcdefghijklmnopqrstuvwxyz"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+		if (len == 0)
+			continue;
+
+		if (len < sizeof(name))
+		{
+			memcpy(name, it, len);
+			name[len] = '\0';
+			reg_t *u = asm_find_reg(name);
+			if (u && u->val == r->val && u->extended == r->extended)
+				return 1;
+		}
+
+		it += len - 1;
+	}
+
+	return 0;
+}
+
+static char peep_imm(const char *op, long val)
+{
+	char *end;
+	long v = strtol(op, &end, 0);
+	return end != op && *end == '\0' && v == val;
+}
+
+/*
+ * whether the flags in `mask` may be read before they are written again on
+ * the path falling through from line `i`. calls and returns end the search,
+ * flags are not preserved across them. jumps and unknown instructions do not.
+ */
+static char peep_flags_live(peephole_t *ph, size_t i, char mask)
+{
+	for (size_t j = i + 1; j < ph->line_count; j++)
+	{
+		const char *m = ph->line[j].mnemonic;
+		if (!m || is_one_of(m, PEEP_KEEPS))
+			continue;
+
+		if (is_one_of(m, "call ret") || is_one_of(m, PEEP_WRITES))
+			return 0;
+		else if (is_one_of(m, "inc dec"))
+		{
+			if (!(mask &= PEEP_CF))
+				return 0;
+			continue;
+		}
+
+		return 1;
+	}
+
+	return 1;
+}
+
+static void peep_replace(peephole_t *ph, size_t i, const char *format, ...)
+{
+	peep_line_t *pl = &ph->line[i];
+	char ins[128] = { 0 };
+	size_t indent = 0;
+
+	if (format)
+	{
+		va_list args;
+		va_start(args, format);
+		vsnprintf(ins, sizeof(ins), format, args);
+		va_end(args);
+
+		indent = strspn(pl->text, " \t");
+		for (char *c = ins; *c && pl->upper; c++)
+			*c = toupper(*c);
+	}
+
+	if (ph->info && format)
+		fprintf(ph->info, "%s:%zu: %s: `%s` to `%s`\n", ph->file, pl->loc + 1,
+			ph->rule, pl->text + strspn(pl->text, " \t"), ins);
+	else if (ph->info)
+		fprintf(ph->info, "%s:%zu: %s: removed `%s`\n", ph->file, pl->loc + 1,
+			ph->rule, pl->text + strspn(pl->text, " \t"));
+
+	char *text = calloc(indent + strlen(ins) + 1, sizeof(char));
+	memcpy(text, pl->text, indent);
+	strcat(text, ins);
+
+	size_t loc = pl->loc;
+	peep_free(pl);
+	*pl = peep_parse(text, loc);
+	free(text);
+}
+
+/* jmp or jcc to a label that directly follows. */
+static char peep_jump_next(peephole_t *ph, size_t i)
+{
+	peep_line_t *pl = &ph->line[i];
+	if (pl->mnemonic[0] != 'j' || pl->op_count != 1)
+		return 0;
+
+	for (size_t j = i + 1; j < ph->line_count; j++)
+	{
+		for (size_t k = 0; k < ph->line[j].label_count; k++)
+			if (strcmp(ph->line[j].label[k], pl->op[0]) == 0)
+			{
+				peep_replace(ph, i, 0);
+				return 1;
+			}
+
+		if (ph->line[j].mnemonic)
+			return 0;
+	}
+
+	return 0;
+}
+
+/* `mov a, b` followed by `mov b, a`, the second one is dropped unless it is a branch target. */
+static char peep_mov_pair(peephole_t *ph, size_t i)
+{
+	peep_line_t *a = &ph->line[i], *b;
+	size_t j = i + 1;
+	if (strcmp(a->mnemonic, "mov") != 0 || a->op_count != 2)
+		return 0;
+
+	while (j < ph->line_count && !ph->line[j].mnemonic && !ph->line[j].label_count)
+		j++;
+	if (j == ph->line_count)
+		return 0;
+
+	b = &ph->line[j];
+	if (b->label_count || strcmp(b->mnemonic, "mov") != 0 || b->op_count != 2
+		|| !peep_same(a->op[0], b->op[1]) || !peep_same(a->op[1], b->op[0]))
+		return 0;
+
+	reg_t *dst = peep_reg(a->op[0]), *src = peep_reg(a->op[1]);
+	if (!dst && a->op[0][0] != '[' || !src && a->op[1][0] != '[' || !dst && !src)
+		return 0;
+
+	/* 32 bit moves clear the upper half, the second one is not redundant. */
+	if (dst && dst->size == REG32 || src && src->size == REG32)
+		return 0;
+
+	/* a load that changes its own base would store somewhere else. */
+	if (dst && !src && peep_uses(a->op[1], dst))
+		return 0;
+
+	peep_replace(ph, j, 0);
+	return 1;
+}
+
+/* `mov reg, 0` to `xor reg32, reg32`, which clobbers the flags. */
+static char peep_zero_mov(peephole_t *ph, size_t i)
+{
+	peep_line_t *pl = &ph->line[i];
+	if (strcmp(pl->mnemonic, "mov") != 0 || pl->op_count != 2)
+		return 0;
+
+	reg_t *r = peep_reg(pl->op[0]);
+	if (!r || !(r->size & (REG32 | REG64)) || !peep_imm(pl->op[1], 0)
+		|| peep_flags_live(ph, i, PEEP_CF | PEEP_FLAGS))
+		return 0;
+
+	/* writing the lower half clears the upper one. */
+	char name[8];
+	if (r->size == REG32)
+		strcpy(name, r->mnemonic);
+	else if (r->extended)
+		sprintf(name, "%sd", r->mnemonic);
+	else
+		sprintf(name, "e%s", r->mnemonic + 1);
+
+	peep_replace(ph, i, "xor %s, %s", name, name);
+	return 1;
+}
+
+/* `add reg, 1` and `sub reg, 1` to inc and dec, which leave the carry alone. */
+static char peep_inc_dec(peephole_t *ph, size_t i)
+{
+	peep_line_t *pl = &ph->line[i];
+	if (!is_one_of(pl->mnemonic, "add sub") || pl->op_count != 2)
+		return 0;
+
+	reg_t *r = peep_reg(pl->op[0]);
+	if (!r || r->size != REG64 || !peep_imm(pl->op[1], 1)
+		|| peep_flags_live(ph, i, PEEP_CF))
+		return 0;
+
+	peep_replace(ph, i, "%s %s", pl->mnemonic[0] == 'a' ? "inc" : "dec", r->mnemonic);
+	return 1;
+}
+
+/* `cmp reg, 0` to `test reg, reg`, both only differ in the auxiliary carry. */
+static char peep_cmp_zero(peephole_t *ph, size_t i)
+{
+	peep_line_t *pl = &ph->line[i];
+	if (strcmp(pl->mnemonic, "cmp") != 0 || pl->op_count != 2)
+		return 0;
+
+	reg_t *r = peep_reg(pl->op[0]);
+	if (!r || !(r->size & (REG8 | REG32 | REG64)) || !peep_imm(pl->op[1], 0))
+		return 0;
+
+	peep_replace(ph, i, "test %s, %s", r->mnemonic, r->mnemonic);
+	return 1;
+}
+
+char* peephole_run(const char *src, size_t size, const char *file, FILE *info,
+	size_t *out_size)
+{
+	peephole_t ph = { .file = file, .info = info };
+	char *buf = strndup(src, size), *it = buf, *out;
+
+	for (char *end; *it; it = end + 1)
+	{
+		if ((end = strchr(it, '\n')))
+			*end = '\0';
+
+		ph.line = realloc(ph.line, ++ph.line_count * sizeof(peep_line_t));
+		ph.line[ph.line_count - 1] = peep_parse(it, ph.line_count - 1);
+
+		if (!end)
+			break;
+	}
+
+	/* the first rule that fires wins, lines with labels are left alone. */
+	for (size_t i = 0; i < ph.line_count; i++)
+		for (size_t r = 0; r < sizeof(rules) / sizeof(peep_rule_t); r++)
+		{
+			if (!ph.line[i].mnemonic || ph.line[i].label_count)
+				break;
+
+			ph.rule = rules[r].name;
+			if (rules[r].apply(&ph, i))
+			{
+				rules[r].fired++;
+				break;
+			}
+		}
+
+	FILE *fp = open_memstream(&out, out_size);
+	for (size_t i = 0; i < ph.line_count; i++)
+	{
+		fprintf(fp, "%s\n", ph.line[i].text);
+		peep_free(&ph.line[i]);
+	}
+
+	fclose(fp);
+	free(ph.line);
+	free(buf);
+	return out;
+}
+
+void peephole_report(FILE *fp)
+{
+	size_t fired = 0, bytes = 0, cycles = 0;
+	fprintf(fp, "%-12s %8s %8s %8s\n", "rule", "fired", "bytes", "cycles");
+
+	for (size_t r = 0; r < sizeof(rules) / sizeof(peep_rule_t); r++)
+	{
+		peep_rule_t *ru = &rules[r];
+		fprintf(fp, "%-12s %8zu %8zu %8zu\n", ru->name, ru->fired,
+			ru->fired * ru->size, ru->fired * ru->lat);
+		fired += ru->fired;
+		bytes += ru->fired * ru->size;
+		cycles += ru->fired * ru->lat;
+	}
+
+	fprintf(fp, "%-12s %8zu %8zu %8zu\n", "total", fired, bytes, cycles);
+}
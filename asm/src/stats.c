@@ -0,0 +1,132 @@
+#define STATS_NO_WRAP
+#include "stats.h"
+#include "op.h"
+#include <inttypes.h>
+#include <strings.h>
+#include <malloc.h>
+
+#ifdef ASM_STATS
+stats_t stats;
+
+void stats_enable()
+{
+	stats.enabled = 1;
+}
+
+void stats_instr(size_t op)
+{
+	if (op >= stats.instr_count)
+	{
+		stats.instr = realloc(stats.instr, (op + 1) * sizeof(size_t));
+		memset(stats.instr + stats.instr_count, 0, (op + 1 - stats.instr_count)
+			* sizeof(size_t));
+		stats.instr_count = op + 1;
+	}
+
+	stats.instr[op]++;
+}
+
+void* stats_malloc(size_t size)
+{
+	stats.allocs++;
+	stats.alloc_bytes += size;
+	return malloc(size);
+}
+
+void* stats_calloc(size_t count, size_t size)
+{
+	stats.allocs++;
+	stats.alloc_bytes += count * size;
+	return calloc(count, size);
+}
+
+void* stats_realloc(void *ptr, size_t size)
+{
+	/* only the growth counts, arrays are mostly extended one element at a time. */
+	size_t usable = ptr ? malloc_usable_size(ptr) : 0;
+	stats.allocs++;
+	stats.alloc_bytes += size > usable ? size - usable : 0;
+	return realloc(ptr, size);
+}
+
+char* stats_strdup(const char *str)
+{
+	stats.allocs++;
+	stats.alloc_bytes += strlen(str) + 1;
+	return strdup(str);
+}
+
+char* stats_strndup(const char *str, size_t len)
+{
+	stats.allocs++;
+	stats.alloc_bytes += strnlen(str, len) + 1;
+	return strndup(str, len);
+}
+
+static const char *phase_name[] =
+{
+	"lex",
+	"match",
+	"encode",
+	"section close",
+	"elf write"
+};
+
+void stats_report(FILE *fp)
+{
+	uint64_t total = 0;
+	size_t instr = 0;
+
+	for (size_t i = 0; i < STATS_PHASES; i++)
+		total += stats.cycles[i];
+
+	/* matching is part of encoding, it is listed below with its share of it. */
+	total -= stats.cycles[STATS_MATCH];
+	fprintf(fp, "%-14s %12s %9s\n", "phase", "cycles", "share");
+	for (size_t i = 0; i < STATS_PHASES; i++)
+	{
+		if (i == STATS_MATCH)
+			continue;
+
+		fprintf(fp, "%-14s %12" PRIu64 " %8.1f%%\n", phase_name[i], stats.cycles[i],
+			total ? 100.0 * stats.cycles[i] / total : 0.0);
+
+		if (i == STATS_ENCODE)
+			fprintf(fp, "  %-12s %12" PRIu64 " %8.1f%%\n", phase_name[STATS_MATCH],
+				stats.cycles[STATS_MATCH], stats.cycles[i] ?
+				100.0 * stats.cycles[STATS_MATCH] / stats.cycles[i] : 0.0);
+	}
+
+	/* forms of the same mnemonic are summed up, each under its first entry. */
+	fprintf(fp, "\n%-14s %8s\n", "mnemonic", "count");
+	for (size_t i = 0; i < stats.instr_count; i++)
+	{
+		size_t count = 0, first = 1;
+		instr += stats.instr[i];
+
+		for (size_t j = 0; j < i; j++)
+			if (strcasecmp(op[j].mnemonic, op[i].mnemonic) == 0)
+				first = 0;
+
+		for (size_t j = i; j < stats.instr_count && first; j++)
+			if (strcasecmp(op[j].mnemonic, op[i].mnemonic) == 0)
+				count += stats.instr[j];
+
+		if (count)
+			fprintf(fp, "%-14s %8zu\n", op[i].mnemonic, count);
+	}
+
+	fprintf(fp, "\ninstructions    %12zu\n", instr);
+	fprintf(fp, "op table probes %12zu (%.1f per instruction)\n", stats.op_probes,
+		instr ? (double) stats.op_probes / instr : 0.0);
+	fprintf(fp, "symbol lookups  %12zu\n", stats.sym_lookups);
+	fprintf(fp, "symbol probes   %12zu (%.1f per lookup, at most %zu)\n", stats.sym_probes,
+		stats.sym_lookups ? (double) stats.sym_probes / stats.sym_lookups : 0.0,
+		stats.sym_probe_max);
+	fprintf(fp, "fixups resolved %12zu\n", stats.fix_resolved);
+	fprintf(fp, "relocations     %12zu\n", stats.fix_reloc);
+	fprintf(fp, "deferred        %12zu\n", stats.fix_deferred);
+	fprintf(fp, "allocations     %12zu\n", stats.allocs);
+	fprintf(fp, "bytes allocated %12zu\n", stats.alloc_bytes);
+}
+#endif
@@ -30,11 +30,27 @@
 #define R14B "R14B"
 #define R15B "R15B"
 
+/* the statements a variable is live in, and where it is kept meanwhile. */
+typedef struct
+{
+	size_t start, end;
+	char used, calls;
+	const char *reg;
+	size_t slot;
+} interval_t;
+
 typedef struct
 {
 	node_t *ast, *scope;
 	char *scratch, *cur, indent, ar_base;
 	const char *id;
+
+	/* variables of the current procedure, allocated by linear scan. */
+	interval_t *live;
+	size_t *calls;
+	size_t calls_count;
+	size_t slots;
+	size_t depth;
 } codegen_t;
 
 codegen_t* codegen_init(node_t *ast);
@@ -52,6 +68,8 @@ void codegen_dbg(codegen_t *cg, node_t *node);
 void codegen_if(codegen_t *cg, node_t *node);
 
 void codegen_ar_expr(codegen_t *cg, node_t *node);
+void codegen_liveness(codegen_t *cg, node_t *node, size_t from, size_t *pos);
+void codegen_allocate(codegen_t *cg, node_t *node);
 char* codegen_resolve(codegen_t *cg, size_t sym);
 
 void codegen_emit(codegen_t *cg, const char *format, ...);
@@ -0,0 +1,24 @@
+
+#ifndef COMP_FOLD_H
+#define COMP_FOLD_H
+
+#include "ast.h"
+
+typedef struct
+{
+	node_t *ast, *scope;
+
+	/* top-level variables assigned once, to a constant, are replaced by it. */
+	size_t *assigns;
+	char *known;
+	long long *val;
+} fold_t;
+
+void fold_full_pass(node_t *ast);
+void fold_count(fold_t *fd, node_t *node);
+void fold_scope(fold_t *fd, node_t *node);
+node_t* fold_node(fold_t *fd, node_t *node);
+node_t* fold_ar_expr(fold_t *fd, node_t *node);
+
+#endif /* COMP_FOLD_H */
+
@@ -6,8 +6,12 @@
 #include <sys/param.h>
 
 static const char* systemv_regs[] = { RDI, RSI, RDX, RCX, R8, R9 };
-static const char* ar_regs[] = { RAX, RBX, R10, R11, R12, R13, R14, R15 };
-static const char* arl_regs[] = { AL, BL, R10B, R11B, R12B, R13B, R14B, R15B };
+static const char* ar_regs[] = { RAX, R10, R11 };
+static const char* arl_regs[] = { AL, R10B, R11B };
+
+/* variables live across a call are only kept in callee-saved registers. */
+static const char* callee_regs[] = { RBX, R12, R13, R14, R15 };
+static const char* caller_regs[] = { RDI, RSI, RCX, R8, R9 };
 
 static size_t align_by(long long addr, char al)
 {
@@ -67,37 +71,51 @@ void codegen_eval_node(codegen_t *cg, node_t *node)
 
 void codegen_scope(codegen_t *cg, node_t *node)
 {
-	cg->scope = node;
-	size_t stack = 0;
-	for (size_t i = 0; i < node->scope.sym_count; i++)
-		if (!node->scope.sym[i].ext)
-			stack += sizeof(long long);
-	stack = align_by(stack, 16);
-
 	/* produce other scopes first. */
 	for (size_t i = 0; i < node->children_count; i++)
 		if (node->children[i]->type == scope)
 			codegen_eval_node(cg, node->children[i]);
 
+	cg->scope = node;
+	codegen_allocate(cg, node);
+
+	/* callee-saved registers are pushed below the slots of spilled variables. */
+	const char *saved[sizeof(callee_regs) / sizeof(char*)];
+	size_t saved_count = 0;
+	for (size_t i = 0; i < sizeof(callee_regs) / sizeof(char*); i++)
+		for (size_t j = 0; j < node->scope.sym_count; j++)
+			if (cg->live[j].reg && strcmp(cg->live[j].reg, callee_regs[i]) == 0)
+			{
+				saved[saved_count++] = callee_regs[i];
+				break;
+			}
+
+	size_t stack = align_by(sizeof(long long) * (cg->slots + saved_count), 16)
+		- sizeof(long long) * saved_count;
+	char frame = stack > 0 || saved_count > 0 || cg->calls_count > 0;
+
 	/* write procedure prologue. */
 	cg->id = "main";
 	if (node->scope.parent)
 		cg->id = node->scope.parent->scope.sym[node->scope.self].name;
 	codegen_emit(cg, "");
 	codegen_emit_label(cg, "%s:", cg->id);
-	if (stack > 0)
+	if (frame)
 	{
 		codegen_emit(cg, "PUSH RBP");
 		codegen_emit(cg, "MOV RBP, RSP");
-		codegen_emit(cg, "SUB RSP, %d", stack);
 	}
+	if (stack > 0)
+		codegen_emit(cg, "SUB RSP, %d", stack);
+	for (size_t i = 0; i < saved_count; i++)
+		codegen_emit(cg, "PUSH %s", saved[i]);
 
-	/* adjust calling convention until we have register allocation. */
+	/* arguments stay in their register unless they are live across a call. */
+	char *r;
 	for (size_t i = 0; i < node->scope.sym_count; i++)
-		if (node->scope.sym[i].arg)
-			codegen_emit(cg, "MOV %s, %s",
-				codegen_resolve(cg, i),
-				systemv_regs[i]);
+		if (node->scope.sym[i].arg && cg->live[i].used
+			&& strcmp(r = codegen_resolve(cg, i), systemv_regs[i]) != 0)
+			codegen_emit(cg, "MOV %s, %s", r, systemv_regs[i]);
 
 	/* write procedure body. */
 	for (size_t i = 0; i < node->children_count; i++)
@@ -107,55 +125,102 @@ void codegen_scope(codegen_t *cg, node_t *node)
 	/* write procedure epilogue. */
 	codegen_emit(cg, "");
 	codegen_emit_label(cg, "_%s_exit", cg->id);
+	for (size_t i = saved_count; i-- > 0;)
+		codegen_emit(cg, "POP %s", saved[i]);
 	if (stack > 0)
-	{
 		codegen_emit(cg, "ADD RSP, %d", stack);
+	if (frame)
 		codegen_emit(cg, "POP RBP");
-	}
 	codegen_emit(cg, "RET");
 	cg->scope = cg->ast;
 }
 
+/*
+ * the temporaries below the base do not survive a call, and the last one
+ * leaves no room for a second operand. they are saved on the stack and the
+ * node is evaluated from the first temporary instead.
+ */
+static void codegen_rebase(codegen_t *cg, node_t *node)
+{
+	size_t base = cg->ar_base;
+	for (size_t i = 0; i < base; i++)
+		codegen_emit(cg, "PUSH %s", ar_regs[i]);
+	cg->depth += base;
+
+	cg->ar_base = 0;
+	codegen_eval_node(cg, node);
+	cg->ar_base = base;
+
+	codegen_emit(cg, "MOV %s, RAX", ar_regs[base]);
+	for (size_t i = base; i-- > 0;)
+		codegen_emit(cg, "POP %s", ar_regs[i]);
+	cg->depth -= base;
+}
+
 void codegen_call(codegen_t *cg, node_t *node)
 {
+	if (cg->ar_base > 0)
+	{
+		codegen_rebase(cg, node);
+		return;
+	}
+
 	symbol_t *sym = &cg->ast->scope.sym[node->call.sym];
-	if (sym->vaarg)
-		codegen_emit(cg, "MOV RAX, %d", node->children_count);
+	if (node->children_count > sizeof(systemv_regs) / sizeof(char*))
+	{
+		printf("Passing arguments on the stack is not implemented!\n");
+		exit(1);
+	}
+
+	/* expressions may call themselves, so they are evaluated onto the stack first. */
+	for (size_t i = 0; i < node->children_count; i++)
+		if (node->children[i]->type != constant
+			&& node->children[i]->type != str_constant
+			&& node->children[i]->type != variable)
+		{
+			codegen_eval_node(cg, node->children[i]);
+			codegen_emit(cg, "PUSH RAX");
+			cg->depth++;
+		}
 
+	/* variables read here are never kept in argument registers. */
 	char *r;
 	for (size_t i = 0; i < node->children_count; i++)
-		if (i < sizeof(systemv_regs) / sizeof(char*))
+		switch (node->children[i]->type)
 		{
-			switch (node->children[i]->type)
-			{
-			case constant:
-				codegen_emit(cg, "MOV %s, %d", systemv_regs[i],
-					node->children[i]->constant.val);
-				break;
-			case str_constant:
-				codegen_emit(cg, "LEA %s, [strs+%d]", systemv_regs[i],
-					node->children[i]->str_constant.offset);
-				break;
-			case variable:
-				r = codegen_resolve(cg,	node->children[i]->variable.sym);
-				if (strcmp(r, systemv_regs[i]) != 0)
-					codegen_emit(cg, "MOV %s, %s", systemv_regs[i], r);
-				break;
-			default:
-				/* warning! cannot clobber systemv regs! */
-				codegen_eval_node(cg, node->children[i]);
-				codegen_emit(cg, "MOV %s, RAX",
-					systemv_regs[i]);
-				break;
-			}
+		case constant:
+			codegen_emit(cg, "MOV %s, %d", systemv_regs[i],
+				node->children[i]->constant.val);
+			break;
+		case str_constant:
+			codegen_emit(cg, "LEA %s, [strs+%d]", systemv_regs[i],
+				node->children[i]->str_constant.offset);
+			break;
+		case variable:
+			r = codegen_resolve(cg,	node->children[i]->variable.sym);
+			if (strcmp(r, systemv_regs[i]) != 0)
+				codegen_emit(cg, "MOV %s, %s", systemv_regs[i], r);
+			break;
 		}
-		else
+
+	for (size_t i = node->children_count; i-- > 0;)
+		if (node->children[i]->type != constant
+			&& node->children[i]->type != str_constant
+			&& node->children[i]->type != variable)
 		{
-			printf("Passing arguments on the stack is not implemented!\n");
-			exit(1);
+			codegen_emit(cg, "POP %s", systemv_regs[i]);
+			cg->depth--;
 		}
 
+	if (sym->vaarg)
+		codegen_emit(cg, "MOV RAX, %d", node->children_count);
+
+	/* pushes of enclosing expressions must not misalign the stack. */
+	if (cg->depth % 2)
+		codegen_emit(cg, "SUB RSP, 8");
 	codegen_emit(cg, "CALL %s", sym->name);
+	if (cg->depth % 2)
+		codegen_emit(cg, "ADD RSP, 8");
 }
 
 void codegen_constant(codegen_t *cg, node_t *node)
@@ -276,18 +341,44 @@ void codegen_if(codegen_t *cg, node_t *node)
 	codegen_emit_label(cg, "\n_%s_if_%d_end", cg->id, id);
 }
 
+/* x86 ISA is stupid. */
+static void codegen_divide(codegen_t *cg, const char *dst, const char *src)
+{
+	char or = strcmp(dst, RAX) != 0;
+	codegen_emit(cg, "PUSH RDX");
+	if (or)
+	{
+		codegen_emit(cg, "PUSH RAX");
+		codegen_emit(cg, "MOV RAX, %s", dst);
+	}
+	codegen_emit(cg, "XOR RDX, RDX");
+	codegen_emit(cg, "IDIV %s", src);
+	if (or)
+	{
+		codegen_emit(cg, "MOV %s, RAX", dst);
+		codegen_emit(cg, "POP RAX");
+	}
+	codegen_emit(cg, "POP RDX");
+}
+
 /*
  * For arithmetic expressions, see the algorithm
  * in the dragon book (2nd edition) page 569.
  */
 static size_t step(node_t *node)
 {
-	if (node->type == variable || node->type == constant)
+	if (node->type != add && node->type != sub && node->type != mul
+		&& node->type != divi && node->type != eq)
 		return 1;
 	return MAX(step(node->children[0]),
 		step(node->children[1])) + 1;
 }
 
+/*
+ * the left operand is evaluated into the base temporary. leaves on the right
+ * are used in place, as an immediate or from where their variable is kept,
+ * everything else goes into the next temporary.
+ */
 void codegen_ar_expr(codegen_t *cg, node_t *node)
 {
 	if (node->children_count != 2)
@@ -296,129 +387,244 @@ void codegen_ar_expr(codegen_t *cg, node_t *node)
 		exit(1);
 	}
 
-	size_t left = step(node->children[0]),
-	       right = step(node->children[1]),
-	       s = sizeof(ar_regs) / sizeof(char*);
+	if (cg->ar_base + 1 == sizeof(ar_regs) / sizeof(char*))
+	{
+		codegen_rebase(cg, node);
+		return;
+	}
 
-	char lgtr = left >= s,
-	     rgtr = right >= s,
-	     c = left <= right,
-	     or;
+	node_t *left = node->children[0], *right = node->children[1];
+	const char *dst = ar_regs[cg->ar_base];
+	char *src = 0;
 
-	if (lgtr || rgtr)
+	/* the operands of commutative operations are swapped to need fewer temporaries. */
+	if (node->type != sub && node->type != divi && step(left) < step(right))
 	{
-		char gtr = c ? lgtr : rgtr;
-		cg->ar_base = 0;
-		codegen_eval_node(cg, node->children[c ? 1 : 0]);
-		codegen_emit(cg, "PUSH %s", ar_regs[0]);
-		cg->ar_base = gtr ? 0 : (c ? left : right);
-		codegen_eval_node(cg, node->children[c ? 0 : 1]);
-		codegen_emit(cg, "POP %s", ar_regs[0]);
-		switch (node->type)
-		{
-		case add:
-			codegen_emit(cg, "ADD %s, %s",
-				ar_regs[0], ar_regs[1]);
-			break;
-		case sub:
-			codegen_emit(cg, "SUB %s, %s",
-				ar_regs[0], ar_regs[1]);
-			break;
-		case mul:
-			codegen_emit(cg, "IMUL %s, %s",
-				ar_regs[0], ar_regs[1]);
-			break;
-		/* x86 ISA is stupid. */
-		case divi:
-			or = strcmp(ar_regs[0], RAX) != 0;
-			codegen_emit(cg, "PUSH RDX");
-			if (or)
-			{
-				codegen_emit(cg, "PUSH RAX");
-				codegen_emit(cg, "MOV RAX, %s", ar_regs[0]);
-			}
-			codegen_emit(cg, "XOR RDX, RDX");
-			codegen_emit(cg, "IDIV %s",
-				ar_regs[1]);
-			if (or)
-			{
-				codegen_emit(cg, "MOV %s, RAX", ar_regs[0]);
-				codegen_emit(cg, "POP RAX");
-			}
-			codegen_emit(cg, "POP RDX");
-			break;
-		case eq:
-			codegen_emit(cg, "CMP %s, %s",
-				ar_regs[0], ar_regs[1]);
-			codegen_emit(cg, "SETZ %s", arl_regs[0]);
-			break;
-		default:
-			printf("Unhandled type `%d` in ar_expr.\n",
-				node->type);
-			exit(1);
-		}
+		left = node->children[1];
+		right = node->children[0];
 	}
-	else
+
+	codegen_eval_node(cg, left);
+
+	if (right->type == constant && (int) right->constant.val == right->constant.val
+		&& (node->type == add || node->type == sub || node->type == eq))
+	{
+		src = alloca(32);
+		sprintf(src, "%lld", right->constant.val);
+	}
+	else if (right->type == variable)
+		src = codegen_resolve(cg, right->variable.sym);
+
+	/* division only takes a register. */
+	if (!src || node->type == divi && *src == '[')
 	{
 		cg->ar_base++;
-		codegen_eval_node(cg, node->children[c ? 1 : 0]);
+		codegen_eval_node(cg, right);
 		cg->ar_base--;
-		codegen_eval_node(cg, node->children[c ? 0 : 1]);
-	
-		switch (node->type)
+		src = (char*) ar_regs[cg->ar_base + 1];
+	}
+
+	switch (node->type)
+	{
+	case add:
+		codegen_emit(cg, "ADD %s, %s", dst, src);
+		break;
+	case sub:
+		codegen_emit(cg, "SUB %s, %s", dst, src);
+		break;
+	case mul:
+		codegen_emit(cg, "IMUL %s, %s", dst, src);
+		break;
+	case divi:
+		codegen_divide(cg, dst, src);
+		break;
+	case eq:
+		/* only the memory operand may come first. */
+		if (*src == '[')
+			codegen_emit(cg, "CMP %s, %s", src, dst);
+		else
+			codegen_emit(cg, "CMP %s, %s", dst, src);
+		codegen_emit(cg, "MOV %s, 0", dst);
+		codegen_emit(cg, "SETZ %s", arl_regs[cg->ar_base]);
+		break;
+	default:
+		printf("Unhandled type `%d` in ar_expr.\n",
+			node->type);
+		exit(1);
+	}
+}
+
+static void codegen_live_node(codegen_t *cg, node_t *node, size_t pos)
+{
+	if (node->type == variable)
+	{
+		interval_t *iv = &cg->live[node->variable.sym];
+		if (!iv->used)
+			iv->start = pos;
+		iv->end = pos;
+		iv->used = 1;
+	}
+	else if (node->type == call && (cg->calls_count == 0
+		|| cg->calls[cg->calls_count - 1] != pos))
+	{
+		cg->calls = realloc(cg->calls, ++cg->calls_count * sizeof(size_t));
+		cg->calls[cg->calls_count - 1] = pos;
+	}
+
+	for (size_t i = 0; i < node->children_count; i++)
+		codegen_live_node(cg, node->children[i], pos);
+}
+
+/*
+ * numbers the statements of a scope in the order they are emitted. without
+ * loops, a variable is live from its first to its last mention.
+ */
+void codegen_liveness(codegen_t *cg, node_t *node, size_t from, size_t *pos)
+{
+	for (size_t i = from; i < node->children_count; i++)
+	{
+		node_t *child = node->children[i];
+		if (child->type == scope || child->type == dbg)
+			continue;
+
+		++*pos;
+		if (child->type != ifo)
 		{
-		case add:
-			codegen_emit(cg, "ADD %s, %s",
-				ar_regs[cg->ar_base],
-				ar_regs[cg->ar_base + 1]);
-			break;
-		case sub:
-			codegen_emit(cg, "SUB %s, %s",
-				ar_regs[cg->ar_base],
-				ar_regs[cg->ar_base + 1]);
-			break;
-		case mul:
-			codegen_emit(cg, "IMUL %s, %s",
-				ar_regs[cg->ar_base],
-				ar_regs[cg->ar_base + 1]);
-			break;
-		/* x86 ISA is stupid. */
-		case divi:
-			or = strcmp(ar_regs[cg->ar_base], RAX) != 0;
-			codegen_emit(cg, "PUSH RDX");
-			if (or)
-			{
-				codegen_emit(cg, "PUSH RAX");
-				codegen_emit(cg, "MOV RAX, %s", ar_regs[cg->ar_base]);
-			}
-			codegen_emit(cg, "XOR RDX, RDX");
-			codegen_emit(cg, "IDIV %s",
-				ar_regs[cg->ar_base + 1]);
-			if (or)
+			codegen_live_node(cg, child, *pos);
+			continue;
+		}
+
+		size_t start;
+		for (start = 0; child->children[start]->type == dbg; start++);
+		codegen_live_node(cg, child->children[start], *pos);
+		codegen_liveness(cg, child, start + 1, pos);
+	}
+}
+
+static char codegen_taken(codegen_t *cg, size_t *active, size_t count, const char *reg)
+{
+	for (size_t i = 0; i < count; i++)
+		if (cg->live[active[i]].reg && strcmp(cg->live[active[i]].reg, reg) == 0)
+			return 1;
+	return 0;
+}
+
+static char codegen_allowed(codegen_t *cg, node_t *node, size_t sym, const char *reg)
+{
+	/* arguments must not be moved into the register of another argument. */
+	if (cg->live[sym].start == 0)
+		for (size_t i = 0; i < node->scope.sym_count; i++)
+			if (i != sym && node->scope.sym[i].arg && strcmp(systemv_regs[i], reg) == 0)
+				return 0;
+
+	for (size_t i = 0; i < sizeof(callee_regs) / sizeof(char*); i++)
+		if (strcmp(callee_regs[i], reg) == 0)
+			return 1;
+
+	return !cg->live[sym].calls;
+}
+
+/*
+ * linear scan, see Poletto and Sarkar (1999). once no register is free, the
+ * interval that ends last is spilled to a slot below the frame pointer.
+ */
+void codegen_allocate(codegen_t *cg, node_t *node)
+{
+	size_t count = node->scope.sym_count, pos = 0, order_count = 0, active_count = 0;
+	size_t *order = calloc(count, sizeof(size_t)), *active = calloc(count, sizeof(size_t));
+
+	free(cg->live);
+	cg->live = calloc(count, sizeof(interval_t));
+	cg->calls_count = 0;
+	cg->slots = 0;
+	cg->depth = 0;
+	codegen_liveness(cg, node, 0, &pos);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		interval_t *iv = &cg->live[i];
+		if (node->scope.sym[i].arg && iv->used)
+			iv->start = 0;
+
+		for (size_t j = 0; j < cg->calls_count; j++)
+			iv->calls |= iv->start < cg->calls[j] && cg->calls[j] <= iv->end;
+	}
+
+	/* sorted by start, an insertion keeps the argument order on ties. */
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!cg->live[i].used)
+			continue;
+
+		size_t j = order_count++;
+		for (; j > 0 && cg->live[order[j - 1]].start > cg->live[i].start; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (size_t i = 0; i < order_count; i++)
+	{
+		interval_t *iv = &cg->live[order[i]];
+
+		/* a register read by the statement that writes another is free again. */
+		size_t kept = 0;
+		for (size_t j = 0; j < active_count; j++)
+			if (cg->live[active[j]].end > iv->start)
+				active[kept++] = active[j];
+		active_count = kept;
+
+		const char *hint = node->scope.sym[order[i]].arg && order[i]
+			< sizeof(systemv_regs) / sizeof(char*) ? systemv_regs[order[i]] : 0;
+		const char *pref[sizeof(caller_regs) / sizeof(char*)
+			+ sizeof(callee_regs) / sizeof(char*) + 1];
+		size_t pref_count = 0;
+
+		if (hint)
+			pref[pref_count++] = hint;
+		for (size_t j = 0; j < sizeof(caller_regs) / sizeof(char*); j++)
+			pref[pref_count++] = caller_regs[j];
+		for (size_t j = 0; j < sizeof(callee_regs) / sizeof(char*); j++)
+			pref[pref_count++] = callee_regs[j];
+
+		for (size_t j = 0; j < pref_count && !iv->reg; j++)
+			if (codegen_allowed(cg, node, order[i], pref[j])
+				&& (j > 0 || !hint || strcmp(hint, RDX) != 0)
+				&& !codegen_taken(cg, active, active_count, pref[j]))
+				iv->reg = pref[j];
+
+		if (!iv->reg)
+		{
+			size_t spill = -1;
+			for (size_t j = 0; j < active_count; j++)
+				if (cg->live[active[j]].reg
+					&& codegen_allowed(cg, node, order[i], cg->live[active[j]].reg)
+					&& (spill == -1 || cg->live[active[j]].end > cg->live[spill].end))
+					spill = active[j];
+
+			if (spill != -1 && cg->live[spill].end > iv->end)
 			{
-				codegen_emit(cg, "MOV %s, RAX", ar_regs[cg->ar_base]);
-				codegen_emit(cg, "POP RAX");
+				iv->reg = cg->live[spill].reg;
+				cg->live[spill].reg = 0;
+				cg->live[spill].slot = cg->slots++;
 			}
-			codegen_emit(cg, "POP RDX");
-			break;
-		case eq:
-			codegen_emit(cg, "CMP %s, %s",
-				ar_regs[cg->ar_base], ar_regs[cg->ar_base + 1]);
-			codegen_emit(cg, "SETZ %s", arl_regs[cg->ar_base]);
-			break;
-		default:
-			printf("Unhandled type `%d` in ar_expr.\n",
-				node->type);
-			exit(1);
+			else
+				iv->slot = cg->slots++;
 		}
+
+		active[active_count++] = order[i];
 	}
+
+	free(order);
+	free(active);
 }
 
 char* codegen_resolve(codegen_t *cg, size_t sym)
 {
-	/* TODO: add register allocation? */
+	if (cg->live[sym].reg)
+		return strdup(cg->live[sym].reg);
+
 	char scratch[255] = { 0 };
-	sprintf(scratch, "[RSP-%d]", sizeof(long long) * sym);
+	sprintf(scratch, "[RBP-%d]", sizeof(long long) * (cg->live[sym].slot + 1));
 	return strdup(scratch);
 }
 
@@ -0,0 +1,189 @@
+
+#include "fold.h"
+#include <stdio.h>
+#include <string.h>
+
+static node_t* constant_of(long long val)
+{
+	node_t *node = ast_init_node(constant, 0);
+	node->constant.val = val;
+	return node;
+}
+
+static char is_constant(node_t *node, long long val)
+{
+	return node->type == constant && node->constant.val == val;
+}
+
+/* subtrees without calls can be dropped. */
+static char is_pure(node_t *node)
+{
+	if (node->type == call)
+		return 0;
+
+	for (size_t i = 0; i < node->children_count; i++)
+		if (!is_pure(node->children[i]))
+			return 0;
+	return 1;
+}
+
+static char is_same(node_t *left, node_t *right)
+{
+	return left->type == variable && right->type == variable
+		&& left->variable.sym == right->variable.sym;
+}
+
+void fold_full_pass(node_t *ast)
+{
+	fold_t fd =
+	{
+		.ast = ast,
+		.assigns = calloc(ast->scope.sym_count, sizeof(size_t)),
+		.known = calloc(ast->scope.sym_count, sizeof(char)),
+		.val = calloc(ast->scope.sym_count, sizeof(long long))
+	};
+
+	fold_count(&fd, ast);
+	fold_scope(&fd, ast);
+
+	free(fd.assigns);
+	free(fd.known);
+	free(fd.val);
+}
+
+void fold_count(fold_t *fd, node_t *node)
+{
+	if (node->type == assign)
+		fd->assigns[node->children[0]->variable.sym]++;
+
+	for (size_t i = 0; i < node->children_count; i++)
+		if (node->children[i]->type != scope)
+			fold_count(fd, node->children[i]);
+}
+
+void fold_scope(fold_t *fd, node_t *node)
+{
+	for (size_t i = 0; i < node->children_count; i++)
+	{
+		node_t *child = node->children[i];
+		fd->scope = node;
+
+		if (child->type == scope)
+		{
+			fold_scope(fd, child);
+			continue;
+		}
+
+		node->children[i] = child = fold_node(fd, child);
+
+		/* statements come in order, so the assignment precedes every use. */
+		if (node == fd->ast && child->type == assign
+			&& child->children[1]->type == constant
+			&& fd->assigns[child->children[0]->variable.sym] == 1)
+		{
+			size_t sym = child->children[0]->variable.sym;
+			fd->known[sym] = 1;
+			fd->val[sym] = child->children[1]->constant.val;
+
+			memmove(&node->children[i], &node->children[i + 1],
+				(--node->children_count - i) * sizeof(node_t*));
+			i--;
+		}
+	}
+}
+
+node_t* fold_node(fold_t *fd, node_t *node)
+{
+	switch (node->type)
+	{
+	case variable:
+		if (fd->scope == fd->ast && fd->known[node->variable.sym])
+			return constant_of(fd->val[node->variable.sym]);
+		return node;
+	case assign:
+		node->children[1] = fold_node(fd, node->children[1]);
+		return node;
+	default:
+		for (size_t i = 0; i < node->children_count; i++)
+			node->children[i] = fold_node(fd, node->children[i]);
+	}
+
+	switch (node->type)
+	{
+	case add: case sub: case mul: case divi: case eq:
+		return fold_ar_expr(fd, node);
+	default:
+		return node;
+	}
+}
+
+node_t* fold_ar_expr(fold_t *fd, node_t *node)
+{
+	if (node->children_count != 2)
+	{
+		printf("Ill-formated ar_expr.\n");
+		exit(1);
+	}
+
+	node_t *left = node->children[0], *right = node->children[1];
+
+	if (left->type == constant && right->type == constant)
+	{
+		/* arithmetic wraps around like the 64-bit registers do. */
+		unsigned long long l = left->constant.val, r = right->constant.val;
+		long long val;
+		switch (node->type)
+		{
+		case add: val = l + r; break;
+		case sub: val = l - r; break;
+		case mul: val = l * r; break;
+		case eq: val = l == r; break;
+		/* a division that faults is left to do so at runtime. */
+		case divi:
+			if (r == 0 || l == 1ULL << 63 && r == -1ULL)
+				return node;
+			val = (long long) l / (long long) r;
+			break;
+		}
+
+		/* constants are emitted as 32-bit immediates. */
+		if ((int) val == val)
+			return constant_of(val);
+		return node;
+	}
+
+	switch (node->type)
+	{
+	case add:
+		if (is_constant(left, 0))
+			return right;
+		if (is_constant(right, 0))
+			return left;
+		break;
+	case sub:
+		if (is_constant(right, 0))
+			return left;
+		if (is_same(left, right))
+			return constant_of(0);
+		break;
+	case mul:
+		if (is_constant(left, 1))
+			return right;
+		if (is_constant(right, 1))
+			return left;
+		if (is_constant(left, 0) && is_pure(right)
+			|| is_constant(right, 0) && is_pure(left))
+			return constant_of(0);
+		break;
+	case divi:
+		if (is_constant(right, 1))
+			return left;
+		break;
+	case eq:
+		if (is_same(left, right))
+			return constant_of(1);
+		break;
+	}
+
+	return node;
+}
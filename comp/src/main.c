@@ -1,6 +1,7 @@
 
 #include "parser.h"
 #include "codegen.h"
+#include "fold.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,14 +14,24 @@ int main(int argc, char** argv)
 		exit(1);
 	}
 
+	/* writing the assembly to stdout leaves no room for diagnostics. */
+	char to_stdout = argc == 3 && strcmp(argv[2], "-") == 0;
+
 	parser_t *par = parser_init(argv[1]);
 	node_t *ast = parser_full_pass(par);
-	ast_print(ast, 0);
-	puts("");
+	fold_full_pass(ast);
+	if (!to_stdout)
+	{
+		ast_print(ast, 0);
+		puts("");
+	}
 	codegen_t *cg = codegen_init(ast);
-	codegen_pretty_print(cg);
+	if (!to_stdout)
+		codegen_pretty_print(cg);
 
-	if (argc == 3)
+	if (to_stdout)
+		fwrite(cg->scratch, strlen(cg->scratch), 1, stdout);
+	else if (argc == 3)
 	{
 		size_t size = strlen(cg->scratch);
 
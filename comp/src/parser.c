@@ -449,7 +449,7 @@ char parser_arith(parser_t *par, node_t *node)
 char parser_cmp(parser_t *par, node_t *node)
 {
 	if (accept(par, equals))
-	f{
+	{
 		node_t *new = ast_init_node(eq, node);
 		if (parser_rexpression(par, new)
 			|| parser_rexpression(par, new))